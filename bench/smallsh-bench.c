@@ -0,0 +1,839 @@
+#define SMALLSH_NO_MAIN
+#include "../smallsh.c"
+
+/*
+ * Benchmark suite for smallsh. Prints one JSON object with the results, so
+ * runs of two builds can be compared with any JSON tool.
+ *
+ * Build:  gcc -O2 -Wall -Wextra -std=c11 bench/smallsh-bench.c -o smallsh-bench
+ * Usage:  smallsh-bench [-n FG_ITERATIONS] [-s STARTUP_ITERATIONS]
+ *                       [-b BG_JOBS] [-r JOBS[,JOBS...]] [-S STRESS_JOBS]
+ *                       [-I STORM_US] [-o FILE] SHELL
+ *
+ * Measurements:
+ *   startup   time from fork() to the first prompt on a pseudo-terminal
+ *   fg_true   round trip of `true` from the newline to the next prompt
+ *   bg_launch throughput of `true &` in batch mode
+ *   reap      delay between jobs exiting and the shell reporting them, with
+ *             1k and 10k concurrent jobs
+ *   stress    50k short background jobs in batch mode while the shell gets
+ *             SIGTSTP or SIGINT every 100 us: throughput, reap latency, and
+ *             jobs lost, reported twice or left as zombies (all should be 0)
+ *   parse     parse_line() on lines of 1 KB to 1 MB, linked in from
+ *             smallsh.c
+ *
+ * Latencies are in microseconds. The reap jobs are this binary run as
+ * `smallsh-bench --until NS`, which sleeps until an absolute
+ * CLOCK_MONOTONIC time, so the harness knows when every job exits.
+ */
+
+// A shell running on a pseudo-terminal
+struct bench_shell
+{
+    pid_t pid;
+    int master;                 // our end of the terminal
+    char buf[1 << 16];          // output not yet consumed as a line
+    size_t len;
+};
+
+// Percentiles of a set of samples
+struct bench_stats
+{
+    size_t n;
+    double min, p50, p99, max, mean;
+};
+
+// Result of the signal storm run
+struct bench_stress
+{
+    size_t jobs;                // job lines sent
+    unsigned long signals;      // SIGTSTP and SIGINT sent to the shell
+    double seconds;
+    size_t background;          // jobs the shell started in the background
+    size_t lost;                // started and never reported
+    size_t unknown;             // reported without being started
+    size_t failed;              // reported with a nonzero status
+    size_t zombies;             // children left unreaped at the end
+    size_t unexpected;          // other output lines
+    struct bench_stats latency; // job exit to its report
+};
+
+/**
+ * @brief       Current CLOCK_MONOTONIC time.
+ *
+ * @return uint64_t
+ *              Nanoseconds.
+ */
+static uint64_t bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief       Sorts samples and computes their percentiles.
+ *
+ * @param samples   The samples, sorted in place.
+ * @param n         Number of samples.
+ * @return struct bench_stats
+ */
+static struct bench_stats bench_summarize(double *samples, size_t n)
+{
+    struct bench_stats st = { .n = n };
+    if (n == 0) {
+        return st;
+    }
+    qsort(samples, n, sizeof(double), bench_compare);
+    double sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum += samples[i];
+    }
+    st.min = samples[0];
+    st.p50 = samples[n / 2];
+    st.p99 = samples[(size_t) (n * 0.99) < n ? (size_t) (n * 0.99) : n - 1];
+    st.max = samples[n - 1];
+    st.mean = sum / n;
+    return st;
+}
+
+static void bench_print_stats(FILE *out, const char *name, struct bench_stats st)
+{
+    fprintf(out, "\"%s\": {\"n\": %zu, \"min\": %.1f, \"p50\": %.1f, "
+            "\"p99\": %.1f, \"max\": %.1f, \"mean\": %.1f}",
+            name, st.n, st.min, st.p50, st.p99, st.max, st.mean);
+}
+
+/**
+ * @brief       Starts the shell on a new pseudo-terminal with echo turned
+ *              off, so it runs in interactive mode.
+ *
+ * @param sh    Receives the shell.
+ * @param shell Path of the shell.
+ */
+static void bench_start(struct bench_shell *sh, const char *shell)
+{
+    sh->len = 0;
+    sh->master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (sh->master == -1 || grantpt(sh->master) == -1 || unlockpt(sh->master) == -1) {
+        perror("posix_openpt");
+        exit(1);
+    }
+    const char *slave = ptsname(sh->master);
+
+    sh->pid = fork();
+    if (sh->pid == -1) {
+        perror("fork()");
+        exit(1);
+    }
+    if (sh->pid == 0) {
+        // The terminal becomes the controlling terminal of a new session
+        setsid();
+        int fd = open(slave, O_RDWR);
+        if (fd == -1) {
+            perror(slave);
+            _exit(1);
+        }
+        struct termios tio;
+        tcgetattr(fd, &tio);
+        tio.c_lflag &= ~ECHO;
+        tcsetattr(fd, TCSANOW, &tio);
+        dup2(fd, 0);
+        dup2(fd, 1);
+        dup2(fd, 2);
+        if (fd > 2) {
+            close(fd);
+        }
+        execl(shell, shell, (char *) NULL);
+        perror(shell);
+        _exit(127);
+    }
+}
+
+/**
+ * @brief       Reads once from the shell. Complete lines that contain
+ *              `needle` are counted, and the time each one arrived is
+ *              stored; the unfinished last line stays in the buffer.
+ *
+ * @param sh        The shell.
+ * @param needle    Text to look for in lines, or NULL.
+ * @param times     Receives arrival times of matching lines, or NULL.
+ * @param matched   Number of matching lines so far, updated.
+ */
+static void bench_fill(struct bench_shell *sh, const char *needle,
+                       uint64_t *times, size_t *matched)
+{
+    if (sh->len == sizeof(sh->buf)) {
+        // a line longer than the buffer is not interesting
+        sh->len = 0;
+    }
+    ssize_t n;
+    do {
+        n = read(sh->master, sh->buf + sh->len, sizeof(sh->buf) - sh->len);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0) {
+        fprintf(stderr, "shell exited unexpectedly\n");
+        exit(1);
+    }
+    uint64_t now = bench_now();
+    sh->len += n;
+
+    char *line = sh->buf;
+    char *nl;
+    while ((nl = memchr(line, '\n', sh->buf + sh->len - line)) != NULL) {
+        if (needle != NULL && memmem(line, nl - line, needle, strlen(needle)) != NULL) {
+            if (times != NULL) {
+                times[*matched] = now;
+            }
+            (*matched)++;
+        }
+        line = nl + 1;
+    }
+    sh->len -= line - sh->buf;
+    memmove(sh->buf, line, sh->len);
+}
+
+/**
+ * @brief       Reads shell output until `want` lines containing `needle`
+ *              have been seen and the output ends with the prompt.
+ *
+ * @param sh        The shell.
+ * @param needle    Text to look for in lines, or NULL.
+ * @param times     Receives arrival times of matching lines, or NULL.
+ * @param want      Number of matching lines to wait for.
+ * @return size_t   The number of matching lines.
+ */
+static size_t bench_read(struct bench_shell *sh, const char *needle,
+                         uint64_t *times, size_t want)
+{
+    size_t matched = 0;
+    while (matched < want || sh->len < 2
+            || memcmp(sh->buf + sh->len - 2, ": ", 2) != 0) {
+        bench_fill(sh, needle, times, &matched);
+    }
+    sh->len = 0;
+    return matched;
+}
+
+/**
+ * @brief       Writes to the shell while reading its output, so neither
+ *              side blocks on a full terminal buffer.
+ *
+ * @param sh        The shell.
+ * @param data      Input to send.
+ * @param len       Length of the input.
+ * @param needle    Text to count in the output lines read meanwhile.
+ * @return size_t   The number of matching lines read.
+ */
+static size_t bench_write(struct bench_shell *sh, const char *data, size_t len,
+                          const char *needle)
+{
+    size_t matched = 0;
+    while (len > 0) {
+        struct pollfd pfd = { .fd = sh->master, .events = POLLIN | POLLOUT };
+        if (poll(&pfd, 1, -1) == -1) {
+            continue;
+        }
+        if (pfd.revents & POLLOUT) {
+            ssize_t n = write(sh->master, data, len > 4096 ? 4096 : len);
+            if (n > 0) {
+                data += n;
+                len -= n;
+            }
+        }
+        if (pfd.revents & (POLLIN | POLLHUP)) {
+            bench_fill(sh, needle, NULL, &matched);
+        }
+    }
+    return matched;
+}
+
+/**
+ * @brief       Ends the shell with `exit` and waits for it.
+ *
+ * @param sh    The shell.
+ */
+static void bench_stop(struct bench_shell *sh)
+{
+    if (write(sh->master, "exit\n", 5) != 5) {
+        kill(sh->pid, SIGKILL);
+    }
+    waitpid(sh->pid, NULL, 0);
+    close(sh->master);
+}
+
+/**
+ * @brief       Measures the time from fork() to the first prompt.
+ */
+static struct bench_stats bench_startup(const char *shell, size_t iterations)
+{
+    double *samples = malloc(iterations * sizeof(double));
+    struct bench_shell *sh = malloc(sizeof(*sh));
+    for (size_t i = 0; i < iterations; i++) {
+        uint64_t start = bench_now();
+        bench_start(sh, shell);
+        bench_read(sh, NULL, NULL, 0);
+        samples[i] = (bench_now() - start) / 1e3;
+        bench_stop(sh);
+    }
+    struct bench_stats st = bench_summarize(samples, iterations);
+    free(samples);
+    free(sh);
+    return st;
+}
+
+/**
+ * @brief       Measures the round trip of a foreground `true`.
+ */
+static struct bench_stats bench_fg_true(const char *shell, size_t iterations)
+{
+    double *samples = malloc(iterations * sizeof(double));
+    struct bench_shell *sh = malloc(sizeof(*sh));
+    bench_start(sh, shell);
+    bench_read(sh, NULL, NULL, 0);
+    for (size_t i = 0; i < iterations; i++) {
+        uint64_t start = bench_now();
+        if (write(sh->master, "true\n", 5) != 5) {
+            perror("write");
+            exit(1);
+        }
+        bench_read(sh, NULL, NULL, 0);
+        samples[i] = (bench_now() - start) / 1e3;
+    }
+    bench_stop(sh);
+    struct bench_stats st = bench_summarize(samples, iterations);
+    free(samples);
+    free(sh);
+    return st;
+}
+
+/**
+ * @brief       Measures how fast batch mode launches `true &`.
+ *
+ * @return double
+ *              Wall time in seconds.
+ */
+static double bench_bg_launch(const char *shell, size_t jobs)
+{
+    char path[] = "/tmp/smallsh-bench-XXXXXX";
+    int fd = mkstemp(path);
+    FILE *script = fd == -1 ? NULL : fdopen(fd, "w");
+    if (script == NULL) {
+        perror(path);
+        exit(1);
+    }
+    for (size_t i = 0; i < jobs; i++) {
+        fputs("true &\n", script);
+    }
+    fclose(script);
+
+    uint64_t start = bench_now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        execl(shell, shell, path, (char *) NULL);
+        _exit(127);
+    }
+    waitpid(pid, NULL, 0);
+    double elapsed = (bench_now() - start) / 1e9;
+    unlink(path);
+    return elapsed;
+}
+
+/**
+ * @brief       Starts `jobs` background jobs that all exit at the same
+ *              moment and measures how long after that moment each exit is
+ *              reported.
+ *
+ * @param late  Set if some jobs were launched after the exit time.
+ */
+static struct bench_stats bench_reap(const char *shell, const char *self,
+                                     size_t jobs, bool *late)
+{
+    struct bench_shell *sh = malloc(sizeof(*sh));
+    bench_start(sh, shell);
+    bench_read(sh, NULL, NULL, 0);
+
+    // Leave time to launch every job: 2 s plus 0.5 ms per job
+    uint64_t deadline = bench_now() + 2000000000u + jobs * 500000u;
+    char line[PATH_MAX + 64];
+    int n = snprintf(line, sizeof(line), "%s --until %llu &\n",
+                     self, (unsigned long long) deadline);
+    size_t size = n * jobs;
+    char *input = malloc(size);
+    for (size_t i = 0; i < jobs; i++) {
+        memcpy(input + i * n, line, n);
+    }
+
+    uint64_t *times = malloc(jobs * sizeof(uint64_t));
+    size_t done = bench_write(sh, input, size, "is done");
+    size_t missing = jobs - done;
+    *late = done > 0 || bench_now() > deadline;
+    // bench_read starts counting from zero
+    bench_read(sh, "is done", times, missing);
+
+    double *samples = malloc(missing * sizeof(double));
+    for (size_t i = 0; i < missing; i++) {
+        samples[i] = times[i] > deadline ? (times[i] - deadline) / 1e3 : 0;
+    }
+    struct bench_stats st = bench_summarize(samples, missing);
+    bench_stop(sh);
+    free(samples);
+    free(times);
+    free(input);
+    free(sh);
+    return st;
+}
+
+/**
+ * @brief       Sends a shell SIGTSTP and SIGINT in turn, one every
+ *              interval, until the shell is gone or this process is killed.
+ *
+ * @param shell         The shell.
+ * @param interval_us   Microseconds between signals.
+ * @param sent          Shared counter of signals sent.
+ */
+static void bench_storm(pid_t shell, unsigned long interval_us, unsigned long *sent)
+{
+    struct timespec ts = { interval_us / 1000000, interval_us % 1000000 * 1000 };
+    for (unsigned long i = 0; kill(shell, i % 2 ? SIGINT : SIGTSTP) == 0; i++) {
+        __atomic_fetch_add(sent, 1, __ATOMIC_RELAXED);
+        nanosleep(&ts, NULL);
+    }
+    _exit(0);
+}
+
+/**
+ * @brief       Counts the children of a process that have exited and not
+ *              been waited for.
+ *
+ * @param parent    The process.
+ * @return size_t   The number of zombies.
+ */
+static size_t bench_zombies(pid_t parent)
+{
+    size_t zombies = 0;
+    DIR *dir = opendir("/proc");
+    struct dirent *ent;
+    while (dir != NULL && (ent = readdir(dir)) != NULL) {
+        char path[64], stat[512];
+        snprintf(path, sizeof(path), "/proc/%.20s/stat", ent->d_name);
+        int fd = ent->d_name[0] >= '0' && ent->d_name[0] <= '9' ? open(path, O_RDONLY) : -1;
+        ssize_t n = fd != -1 ? read(fd, stat, sizeof(stat) - 1) : -1;
+        if (fd != -1) {
+            close(fd);
+        }
+        if (n <= 0) {
+            continue;
+        }
+        stat[n] = '\0';
+        // "pid (comm) S ppid ...", and comm may hold anything
+        char *end = strrchr(stat, ')');
+        char state;
+        int ppid;
+        if (end != NULL && sscanf(end + 1, " %c %d", &state, &ppid) == 2
+                && state == 'Z' && ppid == parent) {
+            zombies++;
+        }
+    }
+    if (dir != NULL) {
+        closedir(dir);
+    }
+    return zombies;
+}
+
+/**
+ * @brief       Starts `jobs` background jobs through the shell in batch
+ *              mode while another process sends the shell SIGTSTP and
+ *              SIGINT, and checks that every job it starts is reported
+ *              exactly once and that no child is left unreaped.
+ *
+ *              Job i sleeps until 1 ms after its line is sent, so each
+ *              report has a known exit time. SIGTSTP puts the shell in and
+ *              out of foreground-only mode, where a job runs in the
+ *              foreground and prints "fg i" instead, so the i-th
+ *              "background pid is" line belongs to the i-th job that did
+ *              not. Pids are reused over a long run, so a pid is matched to
+ *              the job started as it most recently. The latency of a job
+ *              started after its exit time is taken from when its start was
+ *              seen, which leaves out the time its line waited in the pipe.
+ *
+ * @param interval_us   Microseconds between signals.
+ * @return struct bench_stress
+ */
+static struct bench_stress bench_stress(const char *shell, const char *self,
+                                        size_t jobs, unsigned long interval_us)
+{
+    struct bench_stress r = { .jobs = jobs };
+    int in[2], out[2];
+    if (pipe2(in, O_CLOEXEC) == -1 || pipe2(out, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        exit(1);
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork()");
+        exit(1);
+    }
+    if (pid == 0) {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(out[1], STDERR_FILENO);
+        execl(shell, shell, (char *) NULL);
+        perror(shell);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+
+    // The storm starts once the shell has its handlers in place
+    char buf[1 << 16];
+    size_t len = 0;
+    static const char hello[] = "echo stress-start\n";
+    if (write(in[1], hello, sizeof(hello) - 1) != sizeof(hello) - 1) {
+        perror("write");
+        exit(1);
+    }
+    while (len < sizeof(buf) && memmem(buf, len, "stress-start\n", 13) == NULL) {
+        ssize_t n = read(out[0], buf + len, sizeof(buf) - len);
+        if (n <= 0) {
+            fprintf(stderr, "stress: %s did not start\n", shell);
+            exit(1);
+        }
+        len += n;
+    }
+    len = 0;
+    fcntl(in[1], F_SETFL, O_NONBLOCK);
+    fcntl(out[0], F_SETFL, O_NONBLOCK);
+
+    unsigned long *sent = mmap(NULL, sizeof(*sent), PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (sent == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    *sent = 0;
+    pid_t storm = fork();
+    if (storm == 0) {
+        bench_storm(pid, interval_us, sent);
+    }
+
+    size_t pid_max = 4194304;
+    FILE *f = fopen("/proc/sys/kernel/pid_max", "r");
+    if (f != NULL) {
+        if (fscanf(f, "%zu", &pid_max) != 1) {
+            pid_max = 4194304;
+        }
+        fclose(f);
+    }
+    uint32_t *owner = calloc(pid_max + 1, sizeof(uint32_t));    // job + 1 running as each pid
+    uint64_t *deadlines = malloc(jobs * sizeof(uint64_t));
+    bool *foreground = calloc(jobs, sizeof(bool));
+    double *samples = malloc(jobs * sizeof(double));
+    size_t nsamples = 0;
+    size_t next_job = 0;        // the next "background pid is" belongs to it or a later one
+    size_t outstanding = 0;
+    size_t lines = 0;
+    bool end_sent = false, end_seen = false, sync_sent = false, synced = false;
+    char line[PATH_MAX + 64];
+    size_t line_len = 0, line_off = 0;
+    uint64_t start = bench_now(), last_filler = 0, give_up = 0, finished = 0;
+
+    while (!synced) {
+        uint64_t now = bench_now();
+        if (end_sent && now > give_up) {
+            break;
+        }
+        if (line_off == line_len) {
+            line_off = line_len = 0;
+            if (lines < jobs) {
+                deadlines[lines] = now + 1000000;
+                line_len = snprintf(line, sizeof(line), "%s --until %llu %zu &\n", self,
+                                    (unsigned long long) deadlines[lines], lines);
+                lines++;
+            } else if (!end_sent) {
+                line_len = snprintf(line, sizeof(line), "echo stress-end\n");
+                end_sent = true;
+                give_up = now + 30000000000u;
+            } else if (end_seen && outstanding == 0 && !sync_sent) {
+                // Every job is reported. The shell runs this job in the
+                // foreground after the fillers before it, so once it
+                // answers no filler is left running.
+                line_len = snprintf(line, sizeof(line), "%s --until 0 sync\n", self);
+                sync_sent = true;
+                finished = now;
+                kill(storm, SIGKILL);
+            } else if (!sync_sent && now - last_filler > 10000000) {
+                // A batch shell flushes its output when it starts a child,
+                // and reaps between lines
+                line_len = snprintf(line, sizeof(line), "%s --until 0\n", self);
+                last_filler = now;
+            }
+        }
+
+        struct pollfd pfd[2] = {
+            { .fd = out[0], .events = POLLIN },
+            { .fd = line_off < line_len ? in[1] : -1, .events = POLLOUT },
+        };
+        if (poll(pfd, 2, 10) == -1) {
+            continue;
+        }
+        if (pfd[1].revents & POLLOUT) {
+            ssize_t n = write(in[1], line + line_off, line_len - line_off);
+            if (n > 0) {
+                line_off += n;
+            }
+        }
+        if (!(pfd[0].revents & (POLLIN | POLLHUP))) {
+            continue;
+        }
+        ssize_t n = read(out[0], buf + len, sizeof(buf) - len);
+        if (n == 0) {
+            fprintf(stderr, "stress: shell exited unexpectedly\n");
+            break;
+        }
+        if (n < 0) {
+            continue;
+        }
+        now = bench_now();
+        len += n;
+
+        char *p = buf, *nl;
+        while ((nl = memchr(p, '\n', buf + len - p)) != NULL) {
+            *nl = '\0';
+            int child, value;
+            size_t job;
+            if (sscanf(p, "background pid %d is done: exit value %d", &child, &value) == 2
+                    || sscanf(p, "background pid %d is done: terminated by signal %d",
+                              &child, &value) == 2) {
+                if (child <= 0 || (size_t) child > pid_max || owner[child] == 0) {
+                    r.unknown++;
+                } else {
+                    uint64_t exited = deadlines[owner[child] - 1];
+                    samples[nsamples++] = now > exited ? (now - exited) / 1e3 : 0;
+                    owner[child] = 0;
+                    outstanding--;
+                    // both a nonzero exit value and a signal are failures
+                    r.failed += value != 0;
+                }
+            } else if (sscanf(p, "background pid is %d", &child) == 1
+                    && child > 0 && (size_t) child <= pid_max) {
+                while (next_job < lines && foreground[next_job]) {
+                    next_job++;
+                }
+                if (owner[child] != 0) {
+                    // started again before the last job with this pid was reported
+                    r.lost++;
+                    outstanding--;
+                }
+                // A job read late from the pipe exits as soon as it starts
+                if (next_job < lines && deadlines[next_job] < now) {
+                    deadlines[next_job] = now;
+                }
+                owner[child] = ++next_job;
+                outstanding++;
+                r.background++;
+            } else if (strcmp(p, "fg sync") == 0) {
+                synced = true;
+            } else if (sscanf(p, "fg %zu", &job) == 1 && job < jobs) {
+                foreground[job] = true;
+            } else if (strcmp(p, "stress-end") == 0) {
+                end_seen = true;
+            } else if (*p != '\0' && strstr(p, "foreground-only mode") == NULL) {
+                if (r.unexpected++ < 5) {
+                    fprintf(stderr, "stress: unexpected output: %s\n", p);
+                }
+            }
+            p = nl + 1;
+        }
+        len -= p - buf;
+        memmove(buf, p, len);
+        if (len == sizeof(buf)) {
+            len = 0;
+        }
+    }
+    r.seconds = ((finished != 0 ? finished : bench_now()) - start) / 1e9;
+    kill(storm, SIGKILL);
+    waitpid(storm, NULL, 0);
+    r.signals = *sent;
+    munmap(sent, sizeof(*sent));
+
+    // The sync job answered just before it exited, so the shell may not
+    // have reaped it yet. A child the shell lost stays a zombie for good.
+    struct timespec retry = { 0, 10000000 };
+    r.zombies = bench_zombies(pid);
+    for (int i = 0; r.zombies > 0 && i < 100; i++) {
+        nanosleep(&retry, NULL);
+        r.zombies = bench_zombies(pid);
+    }
+    for (size_t i = 1; i <= pid_max; i++) {
+        r.lost += owner[i] != 0;
+    }
+
+    close(in[1]);
+    fcntl(out[0], F_SETFL, 0);
+    while (read(out[0], buf, sizeof(buf)) > 0) {
+    }
+    close(out[0]);
+    waitpid(pid, NULL, 0);
+    r.latency = bench_summarize(samples, nsamples);
+    free(owner);
+    free(deadlines);
+    free(foreground);
+    free(samples);
+    return r;
+}
+
+/**
+ * @brief       Times parse_line() on a line of about `bytes` bytes. Words
+ *              get longer with the line so it stays under MAX_ARGS, and
+ *              every eighth word is quoted.
+ *
+ * @return double
+ *              Nanoseconds per line.
+ */
+static double bench_parse(size_t bytes)
+{
+    size_t word_len = bytes / 256 > 8 ? bytes / 256 : 8;
+    char *line = malloc(bytes + word_len + 4);
+    size_t len = 0;
+    for (int word = 0; len < bytes; word++) {
+        bool quoted = word % 8 == 7;
+        if (quoted) {
+            line[len++] = '\'';
+        }
+        for (size_t i = 0; i < word_len; i++) {
+            line[len++] = quoted && i % 4 == 3 ? ' ' : 'a' + (word + i) % 26;
+        }
+        if (quoted) {
+            line[len++] = '\'';
+        }
+        line[len++] = ' ';
+    }
+
+    // Short lines are repeated until the run takes a measurable time
+    size_t iterations = bytes < 65536 ? 100000 : 1000;
+    uint64_t start = bench_now();
+    for (size_t i = 0; i < iterations; i++) {
+        parse_line(line, len);
+        arena_reset(&line_arena);
+    }
+    double ns = (double) (bench_now() - start) / iterations;
+    free(line);
+    return ns;
+}
+
+int main(int argc, char *argv[])
+{
+    if ((argc == 3 || argc == 4) && strcmp(argv[1], "--until") == 0) {
+        // Reap job: sleep until the deadline
+        uint64_t deadline = strtoull(argv[2], NULL, 10);
+        struct timespec ts = { deadline / 1000000000u, deadline % 1000000000u };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+        }
+        // Stress job: a background job's output goes to /dev/null, so only
+        // a job run in foreground-only mode is seen
+        if (argc == 4) {
+            printf("fg %s\n", argv[3]);
+        }
+        return 0;
+    }
+
+    size_t fg_iterations = 100000;
+    size_t startup_iterations = 100;
+    size_t bg_jobs = 10000;
+    const char *reap_list = "1000,10000";
+    size_t stress_jobs = 50000;
+    unsigned long storm_interval = 100;
+    FILE *out = stdout;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:b:r:S:I:o:")) != -1) {
+        if (opt == 'n') {
+            fg_iterations = strtoul(optarg, NULL, 10);
+        } else if (opt == 's') {
+            startup_iterations = strtoul(optarg, NULL, 10);
+        } else if (opt == 'b') {
+            bg_jobs = strtoul(optarg, NULL, 10);
+        } else if (opt == 'r') {
+            reap_list = optarg;
+        } else if (opt == 'S') {
+            stress_jobs = strtoul(optarg, NULL, 10);
+        } else if (opt == 'I') {
+            storm_interval = strtoul(optarg, NULL, 10);
+        } else if (opt == 'o' && (out = fopen(optarg, "w")) == NULL) {
+            perror(optarg);
+            return 1;
+        } else if (opt != 'o') {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-n FG_ITERATIONS] [-s STARTUP_ITERATIONS] "
+                "[-b BG_JOBS] [-r JOBS[,JOBS...]] [-S STRESS_JOBS] [-I STORM_US] "
+                "[-o FILE] SHELL\n", argv[0]);
+        return 2;
+    }
+    const char *shell = argv[optind];
+    char self[PATH_MAX];
+    if (realpath("/proc/self/exe", self) == NULL) {
+        perror("/proc/self/exe");
+        return 1;
+    }
+    // The shell reports on the terminal, not through a signal to us
+    signal(SIGPIPE, SIG_IGN);
+
+    fprintf(out, "{\"shell\": \"%s\", ", shell);
+    bench_print_stats(out, "startup_us", bench_startup(shell, startup_iterations));
+    fprintf(out, ", ");
+    bench_print_stats(out, "fg_true_us", bench_fg_true(shell, fg_iterations));
+
+    double elapsed = bench_bg_launch(shell, bg_jobs);
+    fprintf(out, ", \"bg_launch\": {\"jobs\": %zu, \"seconds\": %.3f, "
+            "\"jobs_per_s\": %.1f}", bg_jobs, elapsed,
+            elapsed > 0 ? bg_jobs / elapsed : 0.0);
+
+    fprintf(out, ", \"reap_us\": [");
+    char *list = strdup(reap_list);
+    const char *sep = "";
+    for (char *jobs = strtok(list, ","); jobs != NULL; jobs = strtok(NULL, ",")) {
+        bool late = false;
+        struct bench_stats st = bench_reap(shell, self, strtoul(jobs, NULL, 10), &late);
+        fprintf(out, "%s{\"jobs\": %s, \"late\": %s, ", sep, jobs, late ? "true" : "false");
+        bench_print_stats(out, "latency", st);
+        fprintf(out, "}");
+        sep = ", ";
+    }
+    free(list);
+    fprintf(out, "]");
+
+    if (stress_jobs > 0) {
+        struct bench_stress r = bench_stress(shell, self, stress_jobs, storm_interval);
+        fprintf(out, ", \"stress\": {\"jobs\": %zu, \"signals\": %lu, \"seconds\": %.3f, "
+                "\"jobs_per_s\": %.1f, \"background\": %zu, \"lost\": %zu, "
+                "\"unknown\": %zu, \"failed\": %zu, \"zombies\": %zu, "
+                "\"unexpected\": %zu, ", r.jobs, r.signals, r.seconds,
+                r.seconds > 0 ? r.jobs / r.seconds : 0.0, r.background, r.lost,
+                r.unknown, r.failed, r.zombies, r.unexpected);
+        bench_print_stats(out, "latency", r.latency);
+        fprintf(out, "}");
+    }
+
+    fprintf(out, ", \"parse\": [");
+    size_t sizes[] = { 1024, 65536, 1 << 20 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        double ns = bench_parse(sizes[i]);
+        fprintf(out, "%s{\"bytes\": %zu, \"ns_per_line\": %.0f, \"mb_per_s\": %.1f}",
+                i ? ", " : "", sizes[i], ns, sizes[i] / ns * 1e3);
+    }
+    fprintf(out, "]}\n");
+    fclose(out);
+    return 0;
+}
@@ -1,346 +1,10361 @@
 #define _GNU_SOURCE
 #include <signal.h>
+#include <stdarg.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <time.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <termios.h>
 #include <linux/limits.h>
-#define INPUT_LENGTH 2048
-#define MAX_ARGS 512
-#define MAX_BG_PC 20
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "trace.h"
+#define READ_CHUNK (64 * 1024)
+#define ARGV_MIN 8                  // first argv allocation of a command
+#define JOB_TABLE_MIN 16
+#define ARENA_BLOCK (64 * 1024)
+#define ARENA_KEEP_MAX (1024 * 1024)    // arenas give back anything over this
+#define PATH_CACHE_MIN 64
+#define ZYGOTE_MSG_MAX (256 * 1024)
+#define ENV_INDEX_MIN 64
+#define EXIT_TIMEOUT_MS 2000
+#define HISTORY_MAGIC "SMHIST1\n"
+#define HISTORY_INDEX_MAGIC "SMHIDX1\n"
+#define HISTORY_MIN_SIZE (64 * 1024)
+#define HISTORY_TAIL_MIN 64
+#define HISTORY_TAIL_MAX 8192       // new lines kept out of the index
+#define HISTORY_RANGE_MAX 4096      // matches checked directly in a search
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ(2, 35)
+// posix_spawn can hand the terminal to the child before it runs
+#define HAVE_SPAWN_TCSETPGRP 1
+#endif
+#endif
+// Command substitution output up to this size is read into the line arena,
+// anything bigger is mapped
+#define CAPTURE_READ_MAX (64 * 1024)
+// The lexer replaces each $ that is subject to expansion with one of these
+#define EXPAND_MARK '\x01'          // unquoted $
+#define EXPAND_MARK_QUOTED '\x02'   // $ inside double quotes
+#define EXPAND_END '\x03'           // ends the NAME of a marked $NAME
+// Line editor
+#define PROMPT_LEN 2                // columns taken by ": " or "> "
+#define EDIT_HISTORY_DEPTH 256      // history lines Up can step back through
+#define EDIT_LIST_MAX 200           // completions listed by a second Tab
+#define EDIT_ESCAPE_MS 50           // wait for the rest of an escape sequence
+#define EDIT_EOF (-1)               // edit_getc() results besides bytes
+#define EDIT_TIMEOUT (-2)
+#define EDIT_INTERRUPT (-3)
+#define EDIT_DELETE 256             // the Delete key
 
-static bool fg_only = false;
-int background_processes[MAX_BG_PC] = {0};
+#define METRICS_MIN_BITS 10         // histograms start at 2^10 ns
+#define METRICS_BUCKETS 108         // 4 per power of two up to 2^37 ns (137 s)
+#define METRICS_ERRNO_MAX 134       // exec failures are counted per errno below this
+#define METRICS_REQUEST_MS 1000     // wait for a scrape request before answering
+
+#define BGLOG_BLOCK (64 * 1024)     // log output is queued in blocks this big
+#define BGLOG_IOV 64                // blocks per writev()
+#define BGLOG_READ (64 * 1024)      // bytes read from a job's pipe at once
+#define BGLOG_LINE_MAX (64 * 1024)  // longer lines are broken up
+#define BGLOG_OUT_MAX (8 * 1024 * 1024) // unwritten log before pipes are paused
+#define BGLOG_EVENTS 256            // epoll events handled per wakeup
+#define BGLOG_ERR_FIRST (1 << 30)   // the only pipe sent for a job is stderr
+#define BGLOG_JOB_MASK (BGLOG_ERR_FIRST - 1)
+
+// Batch executor
+#define BATCH_FILES 8               // redirections tracked per command
+#define BATCH_QUEUE_FACTOR 4        // lines waiting to report per running slot
+
+#define SERVER_READ (16 * 1024)     // bytes read from a client or pipe at once
+#define SERVER_IN_MAX (1024 * 1024) // queued requests before a client is not read
+#define SERVER_OUT_MAX (1024 * 1024)    // unsent output before a command is paused
+#define SERVER_EVENTS 64            // epoll events handled per wakeup
+#define SERVER_BACKLOG 128          // listen() backlog
+#define SERVER_EVENT(kind, id) ((uint64_t) (kind) | (uint64_t) (id) << 8)
+
+#define FUNCTION_DEPTH_MAX 1000     // nested function calls
+
+#define SCRIPT_CACHE_MAGIC "SMSCRC1\n"
+#define SCRIPT_CACHE_MAX (1u << 30) // larger scripts are not compiled
+#define SCRIPT_CACHE_NONE UINT32_MAX    // string offset of a missing redirection
+#define SCRIPT_INTERN_MIN 1024      // first slots of the string set
+#define SCRIPT_STAGE_APPEND_OUTPUT 1    // script_cache_stage flags
+#define SCRIPT_STAGE_APPEND_ERROR 2
+#define SCRIPT_STAGE_MERGE_ERROR 4
+#define SCRIPT_STAGE_BACKGROUND 8
+
+static volatile sig_atomic_t fg_only = 0;  // set from the SIGTSTP handler
+static bool interactive = false; // prompt and wait on a terminal
+static int sigchld_fd = -1;     // signalfd that reports SIGCHLD
+static bool quiet_reports = false;  // exit is shutting jobs down, no reports
+static bool prompt_shown = false;
+static int substitution_depth = 0;  // $(...) commands being run
+static volatile sig_atomic_t sigint_received = 0;  // Ctrl+C at the prompt
+static bool fg_interrupted = false; // a foreground job was killed by SIGINT
+static const char *prompt = ": ";   // "> " while a compound command is read
+
+// Job control: every job gets its own process group and the foreground job
+// owns the terminal. Only used when the shell runs on a terminal.
+static bool job_control = false;
+static pid_t shell_pgid = 0;
+static struct termios shell_tmodes;     // terminal modes to restore at the prompt
+static int current_job = 0;             // job %% and %+ refer to, 0 if none
 
 struct last_status 
 {
     bool exited;
     bool terminated;
     int code; 
+    bool has_usage;             // usage/start/end are filled in
+    struct rusage usage;        // summed over all processes of the command
+    struct timespec start;      // monotonic launch time
+    struct timespec end;        // monotonic time the last process was reaped
+    const char *limit;          // limit that killed the command, or NULL
+};
+
+// The history log is this header followed by lines, each ending in '\n'
+struct history_header
+{
+    char magic[8];              // HISTORY_MAGIC
+    uint64_t used;              // bytes in use, header included
+};
+
+// The index file is this header followed by the log offsets of the
+// distinct lines, sorted by text
+struct history_index_header
+{
+    char magic[8];              // HISTORY_INDEX_MAGIC
+    uint64_t covered;           // log bytes the index includes
+    uint64_t count;             // offsets that follow
+};
+
+struct history_slot
+{
+    uint32_t offset;            // newest line with this text, 0 if empty
+    uint32_t hash;
+};
+
+// A compiled script is this header followed by its lines, their pipeline
+// stages, the argument table and the NUL-terminated strings the arguments
+// and redirections point at. Indexes and offsets count from the start of
+// their table.
+struct script_cache_header
+{
+    char magic[8];              // SCRIPT_CACHE_MAGIC
+    uint64_t script_size;       // the script it was compiled from
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t script_hash;       // hash_words() of the script
+    uint64_t image_hash;        // hash_words() of everything after the header
+    uint32_t lines;
+    uint32_t stages;
+    uint32_t args;
+    uint32_t strings;           // bytes in the string table
+};
+
+// A line of a compiled script, with stages stage .. stage + count - 1
+struct script_cache_line
+{
+    uint32_t stage;
+    uint32_t count;
+};
+
+struct script_cache_stage
+{
+    uint32_t arg;               // first argument in the argument table
+    uint32_t argc;
+    uint32_t input_file;        // string offsets, or SCRIPT_CACHE_NONE
+    uint32_t output_file;
+    uint32_t error_file;
+    uint32_t flags;             // SCRIPT_STAGE_*
+};
+
+// A script being compiled. The tables grow on the heap, and the string set
+// finds the one copy of each distinct string in the string table.
+struct script_builder
+{
+    struct script_cache_line *lines;
+    struct script_cache_stage *stages;
+    uint32_t *args;
+    char *strings;
+    uint32_t *set;              // string offsets + 1, 0 in an empty slot
+    size_t nlines, nstages, nargs, nstrings, nset;
+    size_t lines_cap, stages_cap, args_cap, strings_cap;
+    size_t set_mask;
+};
+
+// Kinds of line in a compound command
+enum node_type
+{
+    NODE_COMMAND,               // a command or pipeline
+    NODE_IF,                    // if, or an elif
+    NODE_WHILE,
+    NODE_FOR,
+    NODE_FUNCTION,              // NAME() { defines a function
+    NODE_BREAK,
+    NODE_CONTINUE,
+    NODE_RETURN,
+};
+
+// A parsed line of a compound command. Bodies are lists linked by next;
+// an elif is an if alone in the else body of the one before it.
+struct node
+{
+    enum node_type type;
+    struct command_line *cmd;   // the command, the if or while condition,
+                                // the words of a for or the value of return
+    const char *name;           // variable of a for, name of a function
+    bool negate;                // the condition started with !
+    struct node *body;          // then, do or function body
+    struct node *orelse;        // else body
+    struct node *next;
+};
+
+// What ends a body early
+enum flow
+{
+    FLOW_NEXT,
+    FLOW_BREAK,
+    FLOW_CONTINUE,
+    FLOW_RETURN,
+    FLOW_INTERRUPT,             // Ctrl+C: unwind every compound command
+};
+
+struct function
+{
+    const char *name;
+    struct node *body;
+    struct function *next;
+};
+
+// Position in an arena to free back to
+struct arena_mark
+{
+    struct arena_block *block;
+    size_t used;
+};
+
+// Output of a $(...) command substitution
+struct capture
+{
+    const char *data;           // the output, without trailing newlines
+    size_t len;
+    void *map;                  // mapping to unmap, NULL if read into the arena
+    size_t map_len;
+};
+
+// Per-command limits from the `limit` prefix
+struct command_limits
+{
+    rlim_t as;                  // RLIMIT_AS in bytes, RLIM_INFINITY if unset
+    rlim_t cpu;                 // RLIMIT_CPU in seconds, RLIM_INFINITY if unset
+    rlim_t nofile;              // RLIMIT_NOFILE, RLIM_INFINITY if unset
+    unsigned long long memory_max;  // cgroup memory.max in bytes, 0 if unset
+    unsigned cpu_percent;       // cgroup cpu.max in percent of a CPU, 0 if unset
+    char *cgroup;               // cgroup made for the command, NULL if none
+    int procs_fd;               // cgroup.procs of that cgroup, -1 if none
+};
+
+struct command_line
+{
+    char **argv;                // argument array, NULL terminated; grows
+                                // in the command's arena, NULL if empty
+    int argc;                   // argument counts
+    int argv_cap;               // slots in argv, the NULL included
+    char *input_file;           // input redirection
+    char *output_file;          // output redirection
+    char *error_file;           // stderr redirection
+    bool append_output;         // >> instead of >
+    bool append_error;          // 2>> instead of 2>
+    bool merge_error;           // 2>&1: stderr goes wherever stdout goes
+    bool is_bg;                 // is background (set on the first stage)
+    struct command_line *next;  // next pipeline stage
+};
+
+// A built-in command
+struct builtin
+{
+    const char *name;
+    void (*run)(struct command_line *cmd);
+    bool redirect;              // the shell applies < > 2> around it
+    bool has_program;           // a program of the same name runs for &
+};
+
+// Bump allocator chunk. Blocks are chained so pointers stay valid while an
+// arena grows.
+struct arena_block
+{
+    struct arena_block *next;   // older block
+    size_t size;                // usable bytes in data
+    size_t used;                // bytes handed out
+    char data[];
+};
+
+struct arena
+{
+    struct arena_block *head;   // block allocations come from
+};
+
+// Buffered line reader. Input is read in large blocks into a sliding
+// buffer; lines are returned in place and may be of any length.
+struct line_reader
+{
+    int fd;                     // source, -1 for an in-memory string
+    char *buf;                  // buffered input
+    size_t size;                // allocated bytes
+    size_t start;               // first unread byte
+    size_t scan;                // bytes from start known to hold no newline
+    size_t end;                 // end of buffered data
+    bool eof;                   // no more data can be read
+};
+
+// What the tracer needs to know about a launched command
+struct trace_info
+{
+    uint64_t argv_hash;         // hash of every stage's argv
+    uint64_t start_ns;          // CLOCK_REALTIME launch time
+    uint64_t launch_ns;         // time spent in the launch calls
+    uint16_t flags;             // TRACE_* flags
+    uint16_t stages;            // pipeline stages
+};
+
+struct job
+{
+    pid_t pid;                  // reported pid (last stage), 0 when free
+    int id;                     // job number, slot index + 1
+    int next_free;              // next free slot, -1 at the end of the list
+    int remaining;              // pipeline stages not reaped yet
+    int status;                 // wait status of the last stage
+    bool parallel;              // started by the parallel built-in
+    int batch;                  // batch queue entry + 1, 0 if not batched
+    int session;                // server session + 1, 0 if not a request
+    bool timed;                 // print resource usage when done
+    bool stopped;               // stopped by a signal, waiting for fg/bg
+    bool has_tmodes;            // tmodes holds the job's terminal modes
+    pid_t pgid;                 // process group, 0 if it has none of its own
+    char *command;              // command text for jobs, NULL for parallel
+    char *cgroup;               // cgroup of a limited job, NULL if none
+    bool cpu_limited;           // ran with a CPU time limit
+    struct termios tmodes;      // terminal modes saved when it stopped
+    struct timespec start;      // monotonic launch time
+    struct timespec end;        // monotonic time the last exit was read
+    struct rusage usage;        // summed over the reaped processes
+    struct trace_info trace;    // launch data for the trace log
+};
+
+struct job_index_entry
+{
+    pid_t pid;                  // 0 marks an empty bucket
+    int slot;                   // job slot the pid belongs to
+};
+
+// Background jobs live in a slot map that grows on demand. Free slots are
+// chained into a free list and an open addressing hash maps the pid of
+// every pipeline stage to its slot, so insert, lookup and remove are O(1).
+static struct
+{
+    struct job *slots;          // slot storage
+    int capacity;               // allocated slots
+    int used;                   // slots handed out at least once
+    int count;                  // live jobs
+    int free_head;              // first free slot, -1 if none
+    struct job_index_entry *index;  // pid hash
+    int index_count;            // pids in the hash
+    int index_mask;             // hash capacity - 1 (power of two)
+} job_table = { .free_head = -1, .index_mask = -1 };
+
+// Jobs whose last process was reaped while a foreground command was waited
+// on, reported by the next reap_background_processes()
+static struct
+{
+    int *ids;
+    int count;
+    int cap;
+} held_jobs;
+
+static struct last_status prev_fg_status = { .exited = false, .terminated = false, .code = 0 };
+
+// Status of the most recently completed background job
+static struct last_status prev_bg_status;
+static pid_t prev_bg_pid = 0;
+
+// Last process of the most recently started background job, for $!
+static pid_t last_bg_pid = 0;
+// The shell's own pid, for $$; a $(...) subshell keeps its parent's
+static pid_t shell_pid = 0;
+
+struct path_entry
+{
+    char *name;                 // command name, NULL for an empty bucket
+    char *path;                 // absolute path it resolved to
+    uint64_t hash;              // hash of name
+    unsigned long hits;         // launches served from this entry
+};
+
+// Command name -> absolute path cache, like bash's hash table. Open
+// addressing, rebuilt from scratch whenever PATH changes.
+static struct
+{
+    struct path_entry *entries; // buckets
+    int mask;                   // bucket count - 1 (power of two)
+    int count;                  // cached commands
+    char *path_value;           // PATH the entries were resolved against
+    char **commands;            // sorted executables on PATH, for completion
+    size_t ncommands;
+} path_cache = { .mask = -1 };
+
+// Command history: an mmap'd append-only log, a sorted index of its
+// distinct lines and a hash set of the lines added since the index was
+// last merged. Offsets are 32 bits, so the log stops growing at 4 GB.
+static struct
+{
+    int fd;                     // the log, -1 when history is off
+    struct history_header *log; // mapping of the log
+    size_t log_size;            // mapped bytes
+    char index_path[PATH_MAX + 8];   // the log path plus ".idx"
+    void *index_map;            // mapping of the index file
+    size_t index_map_size;
+    const uint32_t *index;      // sorted offsets, inside index_map
+    uint32_t count;             // offsets in the index
+    uint64_t covered;           // log bytes the index includes
+    struct history_slot *tail;  // lines at or after covered
+    uint32_t tail_mask;         // hash set size - 1 (power of two)
+    uint32_t tail_count;
+} history = { .fd = -1 };
+
+// Raw-mode line editor used at an interactive prompt on a terminal. The
+// screen is updated from the difference between the line and what was last
+// drawn, and all output for a batch of keys goes out in one write.
+static struct
+{
+    bool enabled;
+    char *buf;                  // the line being edited
+    size_t len, cap, cursor;
+    char *shown;                // the line as it is on screen
+    size_t shown_len, shown_cap, shown_cursor;
+    size_t cols;                // terminal width
+    char *out;                  // pending terminal output
+    size_t out_len, out_cap;
+    char in[256];               // bytes read and not handled yet
+    size_t in_len, in_pos;
+    uint32_t hist[EDIT_HISTORY_DEPTH]; // history lines stepped back through
+    int hist_depth;             // 0 while editing the typed line
+    char *typed;                // the typed line, saved while browsing
+    size_t typed_len;
+} editor;
+
+// A file a batched command redirects to or from
+struct batch_file
+{
+    char *name;
+    bool write;
+};
+
+// A script line started by the batch executor and not reported yet
+struct batch_entry
+{
+    bool done;                  // finished, waiting for its turn to report
+    bool sets_status;           // a foreground command, not a & launch
+    int out_fd;                 // memfd holding its stdout
+    int err_fd;                 // memfd holding its stderr
+    struct last_status status;  // how it ended
+    struct batch_file files[BATCH_FILES];  // its redirections, while it runs
+    int nfiles;
+};
+
+// Batch executor for scripts, enabled by SMALLSH_BATCH. Consecutive & lines,
+// and the lines of a region the script declares independent, run at the same
+// time, and their output and status are reported in script order.
+static struct
+{
+    int limit;                  // commands run at once, 0 when off
+    bool parallel;              // in a "# smallsh: parallel" region
+    struct batch_entry *entries;    // ring of started, unreported lines
+    int capacity;
+    int head;                   // oldest entry
+    int count;
+    int running;                // entries not done
+} batch;
+
+// What an epoll event of the server is about, in the low byte of its data.
+// The rest holds the session id.
+enum { SERVER_LISTEN, SERVER_REAPER, SERVER_CLIENT, SERVER_STDOUT, SERVER_STDERR };
+
+// A client of the server. Its requests run one at a time in its own
+// working directory and with its own $?.
+struct session
+{
+    int id;                     // index in server.sessions
+    int fd;                     // the client socket, -1 once dropped
+    int cwd;                    // O_PATH descriptor of its directory
+    struct last_status status;  // its $?
+    pid_t last_bg_pid;          // its $!
+    char *in;                   // requests read and not run yet
+    size_t in_start, in_len, in_cap;
+    char *out;                  // frames not sent yet
+    size_t out_sent, out_len, out_cap;
+    uint32_t events;            // what epoll waits for on fd
+    int pipes[2];               // stdout and stderr of its command, -1 once at EOF
+    int job;                    // job id of its command, 0 when reaped
+    bool busy;                  // a request has not been answered yet
+    bool timed;                 // the request has a time prefix
+    bool paused;                // pipes unwatched until the client catches up
+    bool eof;                   // no more requests will come
+    bool queued;                // on the ready list
+};
+
+// Command server state for --server
+static struct
+{
+    int listen_fd;
+    int epoll_fd;
+    int cwd;                    // directory new sessions start in
+    struct session **sessions;  // by id, NULL for a free id
+    int *free_ids;              // stack of free ids
+    int nfree;
+    int capacity;
+    int count;                  // open sessions
+    int *ready;                 // sessions to advance after the events
+    int nready, ready_cap;
+} server;
+static const char *server_path = NULL;   // --server socket, NULL otherwise
+
+// Everything parsed from one input line is allocated here
+static struct arena line_arena;
+
+// Short-lived allocations, reset by whoever uses it
+static struct arena scratch_arena;
+
+// Progress of the running parallel built-in
+static struct
+{
+    int running;                // jobs started and not reaped
+    unsigned long done;         // jobs reaped
+    unsigned long failed;       // jobs that exited non-zero or were killed
+} parallel_state;
+
+// Where command lines come from
+static struct line_reader input_reader = { .fd = STDIN_FILENO };
+static const char *script_path = NULL;  // script named on the command line
+
+// Compiled script that is run instead of reading input_reader
+static struct
+{
+    char *image;                // header and tables, mapped or on the heap
+    const struct script_cache_line *lines;
+    const struct script_cache_stage *stages;
+    const uint32_t *args;
+    char *strings;
+    uint32_t count;             // lines
+    uint32_t next;              // next line to run
+} script_cache;
+
+// Compound commands and functions
+static struct
+{
+    struct arena arena;         // the compound command at the prompt
+    struct arena kept;          // function bodies, never freed
+    struct function *functions;
+    int loops;                  // loops around the running line
+    int depth;                  // function calls running
+    bool interrupted;           // unwinding after Ctrl+C
+    const char *arg0;           // $0
+    char **args;                // $1 ..., of the running function or script
+    int nargs;
+} compound = { .arg0 = "smallsh" };
+
+// Syntax errors found by parse_line()
+static struct
+{
+    unsigned long count;
+    bool quiet;                 // compiling a script, the line reports them
+} syntax_errors;
+
+// Debug counters for which launch path started each command
+static struct
+{
+    unsigned long spawned;      // launched by posix_spawn
+    unsigned long forked;       // launched by the fork fallback
+    unsigned long spliced;      // built-in splice stages
+    unsigned long zygote;       // launched by the zygote helper
+} launch_stats;
+
+// Run cat/tee pipeline stages in-process with splice(2)/tee(2)
+static bool splice_stages = false;
+
+// Launch path taken by the last launch_process() call, as a TRACE_* flag
+static uint16_t last_launch_path = 0;
+
+// Process group for the next launch_process() call: -1 to stay in the
+// shell's group, 0 to start a new group, or the group to join. With
+// launch_tty the child takes the terminal before it runs.
+static pid_t launch_pgid = -1;
+static bool launch_tty = false;
+
+// Limits for the next launch_process() calls, NULL if the command has none.
+// Limited commands always take the fork path, which applies them.
+static struct command_limits *launch_limits = NULL;
+static unsigned long cgroup_seq = 0;   // names the cgroups made for commands
+
+// /dev/null, opened once on first use and shared by every background job
+static int null_fd = -1;
+
+// Open-addressing index of environ for $VAR lookups. It is rebuilt on the
+// next lookup after invalidate_env_index().
+static struct
+{
+    char **entries;             // "NAME=value" strings, NULL if empty
+    size_t capacity;            // always a power of two
+    bool valid;
+} env_index;
+
+// Messages between the shell and the zygote helper
+enum zygote_reply_type { ZYGOTE_STARTED, ZYGOTE_EXITED };
+
+struct zygote_request
+{
+    uint32_t argc;              // arguments that follow
+    uint32_t nenv;              // environment strings after the arguments
+    int32_t pgid;               // process group to join, 0 for a new one,
+                                // -1 for the helper's
+    uint8_t is_bg;              // background redirection defaults
+    uint8_t has_input;          // an input file name follows
+    uint8_t has_output;         // an output file name follows
+    uint8_t has_error;          // an error file name follows
+    uint8_t append_output;      // >>
+    uint8_t append_error;       // 2>>
+    uint8_t merge_error;        // 2>&1
+    uint8_t has_in_fd;          // a stdin pipe is attached
+    uint8_t has_out_fd;         // a stdout pipe is attached
+    // NUL-terminated strings: argv, input file, output file, error file,
+    // cwd, environ
+};
+
+struct zygote_reply
+{
+    int32_t type;               // enum zygote_reply_type
+    int32_t pid;                // child pid, -1 if fork failed
+    int32_t status;             // wait status, or errno of a failed fork
+    struct rusage usage;        // resource usage of an exited child
+};
+
+// Pre-forked launch helper, enabled by SMALLSH_ZYGOTE
+static struct
+{
+    int fd;                     // socket to the helper, -1 when off
+    pid_t pid;                  // helper pid
+    struct zygote_reply *stash; // exits of foreground pids not waited yet
+    int nstash;
+    int stash_cap;
+} zygote = { .fd = -1 };
+
+// Background log helper, enabled by SMALLSH_BGLOG
+static struct
+{
+    int fd;                     // socket to the helper, -1 when off
+    pid_t pid;                  // helper pid
+    int saved_err;              // the shell's stderr while a job launches
+} bglog = { .fd = -1 };
+
+// Output pipe for the last stage of the next background launch, -1 if none
+static int launch_bg_out = -1;
+
+// A job pipe read by the log helper
+struct bglog_stream
+{
+    int fd;
+    int job;                    // job id it is tagged with
+    bool err;                   // it is the job's stderr
+    char *partial;              // line read up to here, BGLOG_LINE_MAX bytes
+    size_t partial_len;
+};
+
+// Block of log output waiting to be written
+struct bglog_block
+{
+    struct bglog_block *next;
+    size_t len;                 // bytes in data
+    size_t sent;                // bytes of data already written
+    char data[BGLOG_BLOCK];
+};
+
+// Pipes the log helper reads
+struct bglog_table
+{
+    struct bglog_stream **streams;  // by index, NULL once closed
+    int *free_list;             // closed indexes
+    int count;                  // indexes handed out
+    int nfree;
+    int capacity;
+    int open;                   // streams not closed
+};
+
+// Log output of the helper, oldest block first
+struct bglog_output
+{
+    struct bglog_block *head, *tail;
+    struct bglog_block *spare;  // emptied block kept for reuse
+    size_t pending;             // bytes not written yet
+};
+
+// Memory-mapped execution trace ring, enabled by SMALLSH_TRACE
+static struct
+{
+    struct trace_header *header; // NULL when tracing is off
+    struct trace_record *records;
+} trace_log;
+
+// Log-linear latency histogram, in nanoseconds
+struct histogram
+{
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t buckets[METRICS_BUCKETS];
 };
 
-struct command_line
-{
-    char *argv[MAX_ARGS + 1];   // argument array
-    int argc;                   // argument counts
-    char *input_file;           // input redirection
-    char *output_file;          // output redirection
-    bool is_bg;                 // is background
-};
+// Metrics shared with the exporter process. Only relaxed atomics touch it.
+struct metrics
+{
+    uint64_t commands[2];       // launched in the foreground, background
+    struct histogram launch[4]; // per process, by launch path (TRACE_* bit)
+    uint64_t exec_failures[METRICS_ERRNO_MAX];  // by errno, 0 for others
+    int jobs_active;            // jobs in the job table
+    struct histogram reap_lag;  // upper bound per background process
+};
+
+// Metrics mapping, enabled by SMALLSH_METRICS; NULL when off
+static struct metrics *metrics = NULL;
+
+// Last time the shell was known to be watching for child exits
+static struct timespec reap_watched;
+
+
+/**
+ * @brief           Handler for SIGTSTP. Forces the shell into a foreground only mode
+ *                  and ignores all & commands to run a background process.
+ * 
+ *                  Only async-signal-safe calls are made: the message goes
+ *                  out with write(), never through stdio, whose buffer the
+ *                  interrupted code may be in the middle of changing.
+ * 
+ * @param signo     The signal number that is passed to the handler
+ */
+void handle_SIGTSTP(int signo){
+    static const char msg_enter[] = "\nEntering foreground-only mode (& is now ignored)\n";
+    static const char msg_exit[]  = "\nExiting foreground-only mode\n";
+    int saved_errno = errno;
+    if (!fg_only) {
+        fg_only = 1;
+        write(STDOUT_FILENO, msg_enter, sizeof(msg_enter) - 1);
+    } else {
+        fg_only = 0;
+        write(STDOUT_FILENO, msg_exit, sizeof(msg_exit) - 1);
+    }
+    errno = saved_errno;
+}
+
+/**
+ * @brief           Signal handler for SIGINT. Ignores the signal for parent
+ *                  and does not do anything.
+ * 
+ * @param signo     The signal number passed to the handler.
+ */
+void handle_SIGINT(int signo){
+    // ignore signal for parent
+    // this handler will not be passed down to child processes
+    // the line editor drops the line being typed
+    sigint_received = 1;
+}
+
+/**
+ * @brief       Adds the resources used by one process to a running total.
+ *              CPU times and counters are summed; max RSS is the largest
+ *              of the processes.
+ * 
+ * @param sum   The total to update.
+ * @param ru    The usage of one process.
+ */
+void add_rusage(struct rusage *sum, const struct rusage *ru) {
+    timeradd(&sum->ru_utime, &ru->ru_utime, &sum->ru_utime);
+    timeradd(&sum->ru_stime, &ru->ru_stime, &sum->ru_stime);
+    if (ru->ru_maxrss > sum->ru_maxrss) {
+        sum->ru_maxrss = ru->ru_maxrss;
+    }
+    sum->ru_minflt += ru->ru_minflt;
+    sum->ru_majflt += ru->ru_majflt;
+    sum->ru_nvcsw += ru->ru_nvcsw;
+    sum->ru_nivcsw += ru->ru_nivcsw;
+}
+
+/**
+ * @brief       Seconds between two monotonic timestamps.
+ * 
+ * @param start The earlier time.
+ * @param end   The later time.
+ * @return double 
+ *              The elapsed time in seconds.
+ */
+double elapsed_seconds(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * @brief       Fills in the outcome part of a status from a wait status.
+ * 
+ * @param st        The status to update.
+ * @param wstatus   The status returned by wait4.
+ */
+void set_wait_status(struct last_status *st, int wstatus) {
+    st->limit = NULL;
+    if (WIFSIGNALED(wstatus)) {
+        st->terminated = true;
+        st->exited = false;
+        st->code = WTERMSIG(wstatus);
+    } else if (WIFEXITED(wstatus)) {
+        st->exited = true;
+        st->terminated = false;
+        st->code = WEXITSTATUS(wstatus);
+    }
+}
+
+/**
+ * @brief       Records the exit value of a built-in as the foreground
+ *              status. Built-ins have no resource usage.
+ * 
+ * @param code  The exit value.
+ */
+void set_exit_status(int code) {
+    prev_fg_status = (struct last_status) { .exited = true, .code = code };
+}
+
+/**
+ * @brief       Prints "terminated by signal N", naming the limit that
+ *              killed the command if there was one.
+ * 
+ * @param st    A status with terminated set.
+ */
+void print_termination(const struct last_status *st) {
+    if (st->limit != NULL) {
+        printf("terminated by signal %d (%s)\n", st->code, st->limit);
+    } else {
+        printf("terminated by signal %d\n", st->code);
+    }
+}
+
+/**
+ * @brief       Prints wall time, CPU times, max RSS and context switches
+ *              of a command.
+ * 
+ * @param out   Stream to print to.
+ * @param st    The status holding the usage.
+ */
+void print_usage(FILE *out, const struct last_status *st) {
+    const struct rusage *ru = &st->usage;
+    fprintf(out, "  wall     %.3f s\n", elapsed_seconds(&st->start, &st->end));
+    fprintf(out, "  user     %ld.%03ld s\n", (long) ru->ru_utime.tv_sec,
+            (long) ru->ru_utime.tv_usec / 1000);
+    fprintf(out, "  sys      %ld.%03ld s\n", (long) ru->ru_stime.tv_sec,
+            (long) ru->ru_stime.tv_usec / 1000);
+    fprintf(out, "  maxrss   %ld KB\n", ru->ru_maxrss);
+    fprintf(out, "  ctxsw    %ld voluntary, %ld involuntary\n",
+            ru->ru_nvcsw, ru->ru_nivcsw);
+}
+
+/**
+ * @brief       Maps the trace ring named by SMALLSH_TRACE. An existing
+ *              trace with the same layout is appended to; anything else is
+ *              replaced. SMALLSH_TRACE_RECORDS sets the ring size.
+ */
+void init_trace_log() {
+    const char *path = getenv("SMALLSH_TRACE");
+    if (path == NULL || *path == '\0') {
+        return;
+    }
+    uint64_t capacity = TRACE_DEFAULT_RECORDS;
+    const char *records = getenv("SMALLSH_TRACE_RECORDS");
+    if (records != NULL && strtoull(records, NULL, 10) > 0) {
+        capacity = strtoull(records, NULL, 10);
+    }
+    size_t size = sizeof(struct trace_header) + capacity * sizeof(struct trace_record);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror(path);
+        return;
+    }
+    struct stat st;
+    bool reuse = fstat(fd, &st) == 0 && (size_t) st.st_size == size;
+    if (!reuse && ftruncate(fd, 0) == -1) {
+        perror(path);
+    }
+    if (!reuse && ftruncate(fd, size) == -1) {
+        perror(path);
+        close(fd);
+        return;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return;
+    }
+
+    struct trace_header *header = map;
+    if (!reuse || memcmp(header->magic, TRACE_MAGIC, 8) != 0
+            || header->version != TRACE_VERSION
+            || header->record_size != sizeof(struct trace_record)
+            || header->capacity != capacity) {
+        memset(map, 0, size);
+        memcpy(header->magic, TRACE_MAGIC, 8);
+        header->version = TRACE_VERSION;
+        header->record_size = sizeof(struct trace_record);
+        header->capacity = capacity;
+        header->next_seq = 1;
+    }
+    trace_log.header = header;
+    trace_log.records = (struct trace_record *) (header + 1);
+}
+
+/**
+ * @brief       Adds a duration to a histogram. Lock-free: the shell, its
+ *              forked children and the exporter only ever touch it with
+ *              relaxed atomics, and nothing here makes a system call.
+ * 
+ * @param h     The histogram.
+ * @param ns    The duration in nanoseconds.
+ */
+void metrics_observe(struct histogram *h, uint64_t ns)
+{
+    // 4 buckets per power of two from 1.28 us up, like an HDR histogram
+    // with 2 significant bits
+    int index = 0;
+    if (ns >= 1ULL << METRICS_MIN_BITS) {
+        int bits = 63 - __builtin_clzll(ns);
+        index = (bits - METRICS_MIN_BITS) * 4 + ((ns >> (bits - 2)) & 3);
+    }
+    if (index < METRICS_BUCKETS) {
+        __atomic_fetch_add(&h->buckets[index], 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&h->sum_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief       Counts a failed exec. Called in the child, which shares the
+ *              metrics mapping with the shell.
+ * 
+ * @param err   The errno of the exec.
+ */
+void metrics_exec_failed(int err)
+{
+    if (metrics != NULL) {
+        __atomic_fetch_add(&metrics->exec_failures[err > 0 && err < METRICS_ERRNO_MAX ? err : 0],
+                           1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief       Records that the shell is watching the SIGCHLD signalfd
+ *              right now: any exit after this is noticed as it happens.
+ *              Called when a wait that includes the signalfd returns.
+ */
+void metrics_watched()
+{
+    if (metrics != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &reap_watched);
+    }
+}
+
+/**
+ * @brief       Records the launch latency of a process that was just
+ *              started, under the launch path it took.
+ * 
+ * @param start When the launch began.
+ */
+void metrics_launched(const struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    metrics_observe(&metrics->launch[__builtin_ctz(last_launch_path)],
+                    elapsed_seconds(start, &end) * 1e9);
+}
+
+/**
+ * @brief       Records the reap lag of a background process: how long it
+ *              may have been a zombie. The exit itself is not timestamped,
+ *              so this is the time since the shell last watched for exits,
+ *              or since the job started if that is later. It is close to 0
+ *              for exits that happen at the prompt and covers the wait for
+ *              a foreground command otherwise.
+ * 
+ * @param start When the process's job was started.
+ */
+void metrics_reaped(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const struct timespec *since = start;
+    if (reap_watched.tv_sec > start->tv_sec
+            || (reap_watched.tv_sec == start->tv_sec && reap_watched.tv_nsec > start->tv_nsec)) {
+        since = &reap_watched;
+    }
+    double lag = elapsed_seconds(since, &now);
+    metrics_observe(&metrics->reap_lag, lag > 0 ? lag * 1e9 : 0);
+}
+
+/**
+ * @brief       Prints a histogram in the Prometheus text format, with
+ *              cumulative buckets.
+ * 
+ * @param out       Stream to print to.
+ * @param name      Metric name.
+ * @param labels    Labels without braces, e.g. `path="spawn"`, or "".
+ * @param h         The histogram.
+ */
+void print_histogram(FILE *out, const char *name, const char *labels, const struct histogram *h)
+{
+    const char *sep = *labels != '\0' ? "," : "";
+    uint64_t total = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        total += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        int bits = METRICS_MIN_BITS + i / 4;
+        double upper = (double) ((5 + i % 4) * (1ULL << (bits - 2))) / 1e9;
+        fprintf(out, "%s_bucket{%s%sle=\"%.9g\"} %llu\n", name, labels, sep, upper,
+                (unsigned long long) total);
+    }
+    uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    // the count may be read ahead of the buckets it goes with
+    count = count > total ? count : total;
+    fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep,
+            (unsigned long long) count);
+    const char *lbrace = *labels != '\0' ? "{" : "";
+    const char *rbrace = *labels != '\0' ? "}" : "";
+    fprintf(out, "%s_sum%s%s%s %.9f\n", name, lbrace, labels, rbrace,
+            __atomic_load_n(&h->sum_ns, __ATOMIC_RELAXED) / 1e9);
+    fprintf(out, "%s_count%s%s%s %llu\n", name, lbrace, labels, rbrace,
+            (unsigned long long) count);
+}
+
+/**
+ * @brief       Prints every metric in the Prometheus text format.
+ * 
+ * @param out   Stream to print to.
+ */
+void print_metrics(FILE *out)
+{
+    static const char *modes[2] = { "foreground", "background" };
+    // indexed by the bit of the TRACE_* launch path flag
+    static const char *paths[4] = { "spawn", "fork", "splice", "zygote" };
+
+    fprintf(out, "# HELP smallsh_commands_total Commands launched, pipelines counted once.\n"
+                 "# TYPE smallsh_commands_total counter\n");
+    for (int i = 0; i < 2; i++) {
+        fprintf(out, "smallsh_commands_total{mode=\"%s\"} %llu\n", modes[i],
+                (unsigned long long) __atomic_load_n(&metrics->commands[i], __ATOMIC_RELAXED));
+    }
+
+    fprintf(out, "# HELP smallsh_launch_seconds Time to start one process, by launch path.\n"
+                 "# TYPE smallsh_launch_seconds histogram\n");
+    for (int i = 0; i < 4; i++) {
+        char labels[32];
+        snprintf(labels, sizeof(labels), "path=\"%s\"", paths[i]);
+        print_histogram(out, "smallsh_launch_seconds", labels, &metrics->launch[i]);
+    }
+
+    fprintf(out, "# HELP smallsh_exec_failures_total Commands that could not be executed, by errno.\n"
+                 "# TYPE smallsh_exec_failures_total counter\n");
+    for (int err = 0; err < METRICS_ERRNO_MAX; err++) {
+        uint64_t n = __atomic_load_n(&metrics->exec_failures[err], __ATOMIC_RELAXED);
+        const char *name = err > 0 ? strerrorname_np(err) : NULL;
+        if (n > 0 && name != NULL) {
+            fprintf(out, "smallsh_exec_failures_total{errno=\"%s\"} %llu\n", name,
+                    (unsigned long long) n);
+        } else if (n > 0) {
+            fprintf(out, "smallsh_exec_failures_total{errno=\"%d\"} %llu\n", err,
+                    (unsigned long long) n);
+        }
+    }
+
+    fprintf(out, "# HELP smallsh_jobs_active Jobs in the job table.\n"
+                 "# TYPE smallsh_jobs_active gauge\n"
+                 "smallsh_jobs_active %d\n",
+            __atomic_load_n(&metrics->jobs_active, __ATOMIC_RELAXED));
+
+    fprintf(out, "# HELP smallsh_reap_lag_seconds Upper bound on the time between a background process exiting and the shell reaping it.\n"
+                 "# TYPE smallsh_reap_lag_seconds histogram\n");
+    print_histogram(out, "smallsh_reap_lag_seconds", "", &metrics->reap_lag);
+}
+
+/**
+ * @brief       Makes a helper process ignore Ctrl+C and Ctrl+Z: terminal
+ *              signals are for the shell and its jobs, not the helper.
+ */
+void helper_ignore_terminal_signals()
+{
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+}
+
+/**
+ * @brief       Raises the soft limit on open files to the hard limit, for
+ *              a process that holds a few descriptors per job or client.
+ */
+void raise_nofile_limit()
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/**
+ * @brief       Main loop of the metrics exporter: answers every connection
+ *              to its socket with the current metrics as a minimal HTTP
+ *              response, so Prometheus or `curl --unix-socket` can scrape
+ *              it. Never returns, and exits with the shell.
+ * 
+ * @param sock  The listening socket.
+ * @param shell Pid of the shell.
+ */
+void metrics_main(int sock, pid_t shell)
+{
+    helper_ignore_terminal_signals();
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != shell) {
+        _exit(0);
+    }
+
+    while (true) {
+        int fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            continue;
+        }
+        // The request does not matter, but is read so closing the socket
+        // does not reset the connection
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        char request[1024];
+        if (poll(&pfd, 1, METRICS_REQUEST_MS) > 0) {
+            (void) !read(fd, request, sizeof(request));
+        }
+
+        char *body = NULL;
+        size_t len = 0;
+        FILE *out = open_memstream(&body, &len);
+        if (out != NULL) {
+            print_metrics(out);
+            fclose(out);
+            dprintf(fd, "HTTP/1.0 200 OK\r\n"
+                        "Content-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: %zu\r\n\r\n", len);
+            for (size_t done = 0; done < len; ) {
+                ssize_t n = write(fd, body + done, len - done);
+                if (n <= 0) {
+                    break;
+                }
+                done += n;
+            }
+            free(body);
+        }
+        close(fd);
+    }
+}
+
+/**
+ * @brief       Turns on metrics if SMALLSH_METRICS names a socket path.
+ *              The counters live in a shared anonymous mapping, which the
+ *              zygote and every forked child inherit, and are served by a
+ *              helper process listening on the socket. The shell itself
+ *              only updates memory.
+ */
+void init_metrics()
+{
+    const char *path = getenv("SMALLSH_METRICS");
+    if (path == NULL || *path == '\0') {
+        return;
+    }
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return;
+    }
+    strcpy(addr.sun_path, path);
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1 || bind(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1
+            || listen(sock, SERVER_BACKLOG) == -1) {
+        perror(path);
+        if (sock != -1) {
+            close(sock);
+        }
+        return;
+    }
+
+    void *map = mmap(NULL, sizeof(struct metrics), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        close(sock);
+        return;
+    }
+    metrics = map;
+
+    pid_t shell = getpid();
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork()");
+        munmap(map, sizeof(struct metrics));
+        metrics = NULL;
+    } else if (pid == 0) {
+        metrics_main(sock, shell);
+    }
+    close(sock);
+}
+
+uint64_t hash_bytes(const void *data, size_t len);
+uint64_t hash_words(const void *data, size_t len);
+
+/**
+ * @brief       Fills in the launch part of a command's trace data.
+ * 
+ * @param trace The trace data to fill in.
+ * @param cmd   The first stage of the command.
+ * @param is_bg Whether the command runs in the background.
+ */
+void trace_begin(struct trace_info *trace, struct command_line *cmd, bool is_bg) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    trace->start_ns = (uint64_t) now.tv_sec * 1000000000u + now.tv_nsec;
+    trace->flags = is_bg ? TRACE_BACKGROUND : 0;
+    trace->stages = 0;
+
+    // Chain FNV-1a over each argument including its terminator
+    uint64_t h = hash_bytes("", 0);
+    for (struct command_line *stage = cmd; stage; stage = stage->next) {
+        for (int i = 0; i < stage->argc; i++) {
+            const unsigned char *p = (const unsigned char *) stage->argv[i];
+            do {
+                h ^= *p;
+                h *= 1099511628211ull;
+            } while (*p++ != '\0');
+        }
+        trace->stages++;
+    }
+    trace->argv_hash = h;
+}
+
+/**
+ * @brief       Appends a finished command to the trace ring. The record is
+ *              written straight into the shared mapping, so this never
+ *              makes a system call; the sequence number is stored last so
+ *              readers can skip a record that is still being written.
+ * 
+ * @param trace     Launch data of the command.
+ * @param pid       Pid of the last stage.
+ * @param wstatus   Wait status of the last stage.
+ * @param start     Monotonic launch time.
+ * @param end       Monotonic time the command was reaped.
+ */
+void trace_command(const struct trace_info *trace, pid_t pid, int wstatus,
+                   const struct timespec *start, const struct timespec *end) {
+    if (trace_log.header == NULL || trace->stages == 0) {
+        return;
+    }
+    uint64_t seq = trace_log.header->next_seq++;
+    struct trace_record *rec = &trace_log.records[(seq - 1) % trace_log.header->capacity];
+
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELEASE);
+    rec->start_ns = trace->start_ns;
+    rec->argv_hash = trace->argv_hash;
+    rec->launch_ns = trace->launch_ns;
+    rec->duration_ns = elapsed_seconds(start, end) * 1e9;
+    rec->pid = pid;
+    rec->wait_status = wstatus;
+    rec->stages = trace->stages;
+    rec->flags = trace->flags;
+    __atomic_store_n(&rec->seq, seq, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief       Parses a size such as 512, 64K, 100M or 2G.
+ * 
+ * @param text  The size.
+ * @param size  Receives the size in bytes.
+ * @return bool True if the size is valid.
+ */
+bool parse_size(const char *text, unsigned long long *size)
+{
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text || errno != 0 || text[0] == '-') {
+        return false;
+    }
+    int shifts = 0;
+    switch (*end) {
+    case 'G': case 'g': shifts++; // fall through
+    case 'M': case 'm': shifts++; // fall through
+    case 'K': case 'k': shifts++; end++; break;
+    }
+    for (; shifts > 0; shifts--) {
+        // a size past the range would wrap to a tiny one
+        if (value > ULLONG_MAX >> 10) {
+            return false;
+        }
+        value <<= 10;
+    }
+    *size = value;
+    return *end == '\0';
+}
+
+/**
+ * @brief       Opens a cgroup control file.
+ * 
+ * @param dir   The cgroup directory.
+ * @param file  The control file, e.g. "memory.max".
+ * @param flags O_RDONLY or O_WRONLY.
+ * @return int  The fd, or -1 with errno set.
+ */
+int open_cgroup_file(const char *dir, const char *file, int flags)
+{
+    char path[PATH_MAX];
+    int n = snprintf(path, sizeof(path), "%s/%s", dir, file);
+    if (n < 0 || (size_t) n >= sizeof(path)) {
+        // a truncated path would name some other file
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return open(path, flags | O_CLOEXEC);
+}
+
+/**
+ * @brief       Writes a value to a cgroup control file.
+ * 
+ * @param dir   The cgroup directory.
+ * @param file  The control file.
+ * @param value The text to write.
+ * @return int  0 on success, -1 with errno set on failure.
+ */
+int write_cgroup_file(const char *dir, const char *file, const char *value)
+{
+    int fd = open_cgroup_file(dir, file, O_WRONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t n = write(fd, value, strlen(value));
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return n == -1 ? -1 : 0;
+}
+
+/**
+ * @brief       Creates a cgroup for one command under the cgroup v2
+ *              subtree named by SMALLSH_CGROUP and sets its memory.max and
+ *              cpu.max. The subtree must be delegated to the user and have
+ *              the memory and cpu controllers enabled.
+ * 
+ * @param limits    The limits; cgroup and procs_fd are filled in.
+ * @return int      0 on success, -1 after printing an error.
+ */
+int create_cgroup(struct command_limits *limits)
+{
+    const char *root = getenv("SMALLSH_CGROUP");
+    if (root == NULL) {
+        fprintf(stderr, "limit: -M and -c need SMALLSH_CGROUP\n");
+        return -1;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/smallsh-%d-%lu", root, (int) getpid(), ++cgroup_seq);
+    if (mkdir(path, 0755) == -1) {
+        perror(path);
+        return -1;
+    }
+
+    char value[64];
+    int err = 0;
+    if (limits->memory_max != 0) {
+        snprintf(value, sizeof(value), "%llu", limits->memory_max);
+        err = write_cgroup_file(path, "memory.max", value);
+        if (err == 0) {
+            // without this the job swaps instead of hitting the limit
+            write_cgroup_file(path, "memory.swap.max", "0");
+        }
+    }
+    if (err == 0 && limits->cpu_percent != 0) {
+        snprintf(value, sizeof(value), "%u 100000", limits->cpu_percent * 1000);
+        err = write_cgroup_file(path, "cpu.max", value);
+    }
+    if (err == 0) {
+        limits->procs_fd = open_cgroup_file(path, "cgroup.procs", O_WRONLY);
+        err = limits->procs_fd == -1 ? -1 : 0;
+    }
+    if (err != 0) {
+        perror(path);
+        rmdir(path);
+        return -1;
+    }
+    limits->cgroup = strdup(path);
+    return 0;
+}
+
+/**
+ * @brief       Removes a command's cgroup once all of its processes are
+ *              gone, and frees the path.
+ * 
+ * @param cgroup    The cgroup directory, or NULL.
+ */
+void release_cgroup(char *cgroup)
+{
+    if (cgroup != NULL) {
+        rmdir(cgroup);
+        free(cgroup);
+    }
+}
+
+/**
+ * @brief           Works out whether a limit killed a command.
+ * 
+ * @param cgroup        The command's cgroup, or NULL.
+ * @param cpu_limited   Whether it ran with a CPU time limit.
+ * @param wstatus       The wait status of its last stage.
+ * @return const char* 
+ *                      "memory limit", "CPU time limit", or NULL.
+ */
+const char *limit_reason(const char *cgroup, bool cpu_limited, int wstatus)
+{
+    if (!WIFSIGNALED(wstatus)) {
+        return NULL;
+    }
+    int sig = WTERMSIG(wstatus);
+    if (cgroup != NULL && sig == SIGKILL) {
+        char events[512];
+        int fd = open_cgroup_file(cgroup, "memory.events", O_RDONLY);
+        ssize_t n = fd == -1 ? -1 : read(fd, events, sizeof(events) - 1);
+        if (fd != -1) {
+            close(fd);
+        }
+        if (n > 0) {
+            events[n] = '\0';
+            char *line = strstr(events, "oom_kill ");
+            if (line != NULL && (line == events || line[-1] == '\n')
+                    && strtoul(line + 9, NULL, 10) > 0) {
+                return "memory limit";
+            }
+        }
+    }
+    if (cpu_limited && (sig == SIGXCPU || sig == SIGKILL)) {
+        return "CPU time limit";
+    }
+    return NULL;
+}
+
+/**
+ * @brief       Child side of the limits: sets the resource limits and joins
+ *              the command's cgroup. Runs in the fork path, before exec.
+ * 
+ * @param limits    The limits.
+ */
+void apply_limits(const struct command_limits *limits)
+{
+    static const struct
+    {
+        int resource;
+        const char *name;
+    } resources[] = {
+        { RLIMIT_AS, "RLIMIT_AS" }, { RLIMIT_CPU, "RLIMIT_CPU" },
+        { RLIMIT_NOFILE, "RLIMIT_NOFILE" },
+    };
+    rlim_t values[] = { limits->as, limits->cpu, limits->nofile };
+
+    for (int i = 0; i < 3; i++) {
+        if (values[i] == RLIM_INFINITY) {
+            continue;
+        }
+        // a CPU hard limit one second later kills a job that ignores SIGXCPU
+        struct rlimit rl = {
+            values[i],
+            resources[i].resource == RLIMIT_CPU ? values[i] + 1 : values[i],
+        };
+        if (setrlimit(resources[i].resource, &rl) == -1) {
+            perror(resources[i].name);
+            exit(1);
+        }
+    }
+    if (limits->procs_fd != -1 && write(limits->procs_fd, "0", 1) == -1) {
+        perror("cgroup.procs");
+        exit(1);
+    }
+}
+
+/**
+ * @brief       Hashes a pid into the job index.
+ * 
+ * @param pid   The pid to hash.
+ * @return int  The first index bucket to probe.
+ */
+static int job_hash(pid_t pid) {
+    return (int) (((unsigned int) pid * 2654435761u) >> 7) & job_table.index_mask;
+}
+
+/**
+ * @brief       Inserts a pid into the index without checking the load.
+ * 
+ * @param pid   The pid to insert.
+ * @param slot  The job slot it belongs to.
+ */
+static void insert_job_index(pid_t pid, int slot) {
+    int b = job_hash(pid);
+    while (job_table.index[b].pid != 0) {
+        b = (b + 1) & job_table.index_mask;
+    }
+    job_table.index[b].pid = pid;
+    job_table.index[b].slot = slot;
+}
+
+/**
+ * @brief       Adds a pid to the index, doubling it first when it would
+ *              become more than half full so probe chains stay short.
+ * 
+ * @param pid   The pid to insert.
+ * @param slot  The job slot it belongs to.
+ */
+static void add_job_index(pid_t pid, int slot) {
+    if ((job_table.index_count + 1) * 2 > job_table.index_mask + 1) {
+        int size = job_table.index_mask + 1;
+        size = size > 0 ? size * 2 : JOB_TABLE_MIN * 2;
+        struct job_index_entry *old = job_table.index;
+        int old_size = job_table.index_mask + 1;
+
+        job_table.index = calloc(size, sizeof(struct job_index_entry));
+        if (job_table.index == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        job_table.index_mask = size - 1;
+        for (int i = 0; i < old_size; i++) {
+            if (old[i].pid != 0) {
+                insert_job_index(old[i].pid, old[i].slot);
+            }
+        }
+        free(old);
+    }
+    insert_job_index(pid, slot);
+    job_table.index_count++;
+}
+
+/**
+ * @brief       Removes a pid from the index.
+ * 
+ * @param pid   The pid to remove.
+ * @return int  The job slot the pid belonged to, or -1 if not tracked.
+ */
+static int remove_job_index(pid_t pid) {
+    if (job_table.index == NULL) {
+        return -1;
+    }
+    int b = job_hash(pid);
+    while (job_table.index[b].pid != pid) {
+        if (job_table.index[b].pid == 0) {
+            return -1;
+        }
+        b = (b + 1) & job_table.index_mask;
+    }
+    int slot = job_table.index[b].slot;
+    job_table.index_count--;
+
+    // Backward shift deletion: pull later entries of the probe chain into
+    // the hole so lookups never need tombstones
+    int hole = b;
+    for (int i = (b + 1) & job_table.index_mask; job_table.index[i].pid != 0;
+            i = (i + 1) & job_table.index_mask) {
+        int home = job_hash(job_table.index[i].pid);
+        // Move the entry unless its home lies cyclically in (hole, i]
+        if (((i - home) & job_table.index_mask) >= ((i - hole) & job_table.index_mask)) {
+            job_table.index[hole] = job_table.index[i];
+            hole = i;
+        }
+    }
+    job_table.index[hole].pid = 0;
+    return slot;
+}
+
+/**
+ * @brief       Looks up the job a pid belongs to.
+ * 
+ * @param pid   The pid of any stage of the job.
+ * @return struct job* 
+ *              The job, or NULL if the pid is not tracked.
+ */
+struct job *find_job(pid_t pid) {
+    if (job_table.index == NULL) {
+        return NULL;
+    }
+    for (int b = job_hash(pid); job_table.index[b].pid != 0;
+            b = (b + 1) & job_table.index_mask) {
+        if (job_table.index[b].pid == pid) {
+            return &job_table.slots[job_table.index[b].slot];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief       Adds a background job to the job table, growing the table
+ *              if needed. A job is one process per pipeline stage.
+ * 
+ * @param pids  The pids of the job's processes, last stage last.
+ * @param npids The number of pids.
+ * @return int  The job id assigned to the job.
+ */
+int add_bg_job(pid_t *pids, int npids) {
+    int slot = job_table.free_head;
+    if (slot != -1) {
+        job_table.free_head = job_table.slots[slot].next_free;
+    } else {
+        if (job_table.used == job_table.capacity) {
+            int capacity = job_table.capacity ? job_table.capacity * 2 : JOB_TABLE_MIN;
+            struct job *slots = realloc(job_table.slots, capacity * sizeof(struct job));
+            if (slots == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            job_table.slots = slots;
+            job_table.capacity = capacity;
+        }
+        slot = job_table.used++;
+    }
+
+    struct job *job = &job_table.slots[slot];
+    job->pid = pids[npids - 1];
+    job->id = slot + 1;
+    job->next_free = -1;
+    job->remaining = npids;
+    job->status = 0;
+    job->parallel = false;
+    job->batch = 0;
+    job->session = 0;
+    job->timed = false;
+    job->stopped = false;
+    job->has_tmodes = false;
+    job->pgid = 0;
+    job->command = NULL;
+    job->cgroup = NULL;
+    job->cpu_limited = false;
+    memset(&job->trace, 0, sizeof(job->trace));
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    memset(&job->usage, 0, sizeof(job->usage));
+    job_table.count++;
+    if (metrics != NULL) {
+        __atomic_store_n(&metrics->jobs_active, job_table.count, __ATOMIC_RELAXED);
+    }
+
+    for (int i = 0; i < npids; i++) {
+        add_job_index(pids[i], slot);
+    }
+    return job->id;
+}
+
+/**
+ * @brief       Adds a single background process pid to the job table.
+ * 
+ * @param pid   The pid of the background process.
+ * @return int  The job id assigned to the process.
+ */
+int add_bg_process(int pid) {
+    pid_t pids[1] = { pid };
+    return add_bg_job(pids, 1);
+}
+
+/**
+ * @brief       Removes a job from the table and puts its slot on the free
+ *              list. Pids still in the index are not touched.
+ * 
+ * @param job   The job to remove.
+ */
+void remove_job(struct job *job) {
+    int slot = job->id - 1;
+    free(job->command);
+    job->command = NULL;
+    release_cgroup(job->cgroup);
+    job->cgroup = NULL;
+    job->pid = 0;
+    job->next_free = job_table.free_head;
+    job_table.free_head = slot;
+    job_table.count--;
+    if (metrics != NULL) {
+        __atomic_store_n(&metrics->jobs_active, job_table.count, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief       Frees the job table once it is empty, if it grew past its
+ *              first size, so a burst of jobs does not leave its slots
+ *              allocated. The table is allocated again on the next job.
+ *              Only called between commands, when no job pointer is held.
+ */
+void trim_job_table()
+{
+    if (job_table.count > 0 || job_table.index_count > 0
+            || job_table.capacity <= JOB_TABLE_MIN) {
+        return;
+    }
+    free(job_table.slots);
+    free(job_table.index);
+    job_table.slots = NULL;
+    job_table.capacity = 0;
+    job_table.used = 0;
+    job_table.free_head = -1;
+    job_table.index = NULL;
+    job_table.index_mask = -1;
+}
+
+/**
+ * @brief           Records a reaped background process in its job.
+ * 
+ * @param pid       The pid that was reaped.
+ * @param bgStatus  Its wait status.
+ * @param usage     Its resource usage from wait4.
+ * @return struct job* 
+ *                  The job if this was its last process, which the caller
+ *                  reports and removes, NULL otherwise.
+ */
+struct job *reap_bg_process(pid_t pid, int bgStatus, const struct rusage *usage) {
+    int slot = remove_job_index(pid);
+    if (slot == -1) {
+        return NULL;
+    }
+    struct job *job = &job_table.slots[slot];
+    if (metrics != NULL) {
+        metrics_reaped(&job->start);
+    }
+    add_rusage(&job->usage, usage);
+    if (pid == job->pid) {
+        job->status = bgStatus;
+    }
+    if (--job->remaining > 0) {
+        return NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &job->end);
+    return job;
+}
+
+/**
+ * @brief           Prints the completion message for a reaped background
+ *                  process.
+ *
+ * @param pid       The pid of the background process.
+ * @param bgStatus  The wait status returned for it.
+ * @param limit     The limit that killed it, or NULL.
+ */
+void report_background_process(pid_t pid, int bgStatus, const char *limit) {
+    if (prompt_shown) {
+        // Start the report on its own line instead of after the prompt
+        printf("\n");
+        prompt_shown = false;
+    }
+    if (WIFEXITED(bgStatus)) {
+        printf("background pid %d is done: exit value %d\n", 
+               pid, WEXITSTATUS(bgStatus));
+    } else if (WIFSIGNALED(bgStatus)) {
+        printf("background pid %d is done: terminated by signal %d", 
+               pid, WTERMSIG(bgStatus));
+        printf(limit != NULL ? " (%s)\n" : "\n", limit);
+    }
+}
+
+/**
+ * @brief           Prints a job control line, e.g. "[2]  Stopped  sleep 60".
+ * 
+ * @param job       The job.
+ * @param state     What happened to it.
+ */
+void report_job(const struct job *job, const char *state) {
+    if (prompt_shown) {
+        printf("\n");
+        prompt_shown = false;
+    }
+    printf("[%d]  %-8s %s\n", job->id, state,
+           job->command != NULL ? job->command : "");
+}
+
+/**
+ * @brief           Records that a background job was stopped or resumed.
+ * 
+ * @param pid       The process that changed state.
+ * @param wstatus   Its WIFSTOPPED or WIFCONTINUED wait status.
+ * @return bool     True if a message was printed.
+ */
+bool job_state_changed(pid_t pid, int wstatus) {
+    struct job *job = find_job(pid);
+    bool stopped = WIFSTOPPED(wstatus);
+    if (job == NULL || job->parallel || job->stopped == stopped) {
+        // other stages of the same job report the same change
+        return false;
+    }
+    job->stopped = stopped;
+    if (stopped) {
+        current_job = job->id;
+    }
+    if (quiet_reports) {
+        return false;
+    }
+    report_job(job, stopped ? "Stopped" : "Running");
+    return true;
+}
+
+void batch_finished(struct job *job);
+void session_finished(struct job *job);
+
+/**
+ * @brief           Reports a job whose last process has been reaped and
+ *                  removes it from the table.
+ *
+ * @param job       The job.
+ * @return bool     True if it was a background job of the prompt.
+ */
+bool finish_job(struct job *job) {
+    if (job->batch != 0) {
+        // reported in script order by batch_flush()
+        batch_finished(job);
+        remove_job(job);
+    } else if (job->session != 0) {
+        // answered by the server
+        session_finished(job);
+        remove_job(job);
+    } else if (job->parallel) {
+        // parallel jobs are summarized by the built-in instead
+        trace_command(&job->trace, job->pid, job->status, &job->start, &job->end);
+        parallel_state.running--;
+        parallel_state.done++;
+        if (!WIFEXITED(job->status) || WEXITSTATUS(job->status) != 0) {
+            parallel_state.failed++;
+        }
+        remove_job(job);
+    } else {
+        set_wait_status(&prev_bg_status, job->status);
+        prev_bg_status.limit = limit_reason(job->cgroup, job->cpu_limited, job->status);
+        if (!quiet_reports) {
+            report_background_process(job->pid, job->status, prev_bg_status.limit);
+        }
+        prev_bg_status.has_usage = true;
+        prev_bg_status.usage = job->usage;
+        prev_bg_status.start = job->start;
+        prev_bg_status.end = job->end;
+        prev_bg_pid = job->pid;
+        trace_command(&job->trace, job->pid, job->status,
+                      &prev_bg_status.start, &prev_bg_status.end);
+        if (job->timed && !quiet_reports) {
+            print_usage(stdout, &prev_bg_status);
+        }
+        remove_job(job);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief           Updates the job table for a child that has exited,
+ *                  reporting the job when its last process is done.
+ *
+ * @param pid       The pid that exited.
+ * @param bgStatus  Its wait status.
+ * @param usage     Its resource usage.
+ * @return bool     True if a background job was reported.
+ */
+bool handle_exited_child(pid_t pid, int bgStatus, const struct rusage *usage) {
+    if (WIFSTOPPED(bgStatus) || WIFCONTINUED(bgStatus)) {
+        return job_state_changed(pid, bgStatus);
+    }
+    struct job *job = reap_bg_process(pid, bgStatus, usage);
+    return job != NULL && finish_job(job);
+}
+
+/**
+ * @brief           Reads the SIGCHLD signalfd while a foreground command
+ *                  runs and reaps the background processes it names, so
+ *                  their jobs end when they exit rather than when the
+ *                  command does. Finished jobs are held for the next
+ *                  reap_background_processes() to report.
+ *
+ * @param pgid      Process group being waited on, whose exits are left to
+ *                  the caller, or 0.
+ */
+void reap_during_foreground(pid_t pgid) {
+    struct signalfd_siginfo info;
+    while (read(sigchld_fd, &info, sizeof(info)) == sizeof(info)) {
+        struct job *job = find_job(info.ssi_pid);
+        if ((info.ssi_code != CLD_EXITED && info.ssi_code != CLD_KILLED
+                && info.ssi_code != CLD_DUMPED) || job == NULL
+                || (pgid != 0 && job->pgid == pgid)) {
+            continue;
+        }
+        struct rusage usage;
+        int status;
+        if (wait4(info.ssi_pid, &status, WNOHANG, &usage) != (pid_t) info.ssi_pid
+                || (job = reap_bg_process(info.ssi_pid, status, &usage)) == NULL) {
+            continue;
+        }
+        if (held_jobs.count == held_jobs.cap) {
+            int cap = held_jobs.cap ? held_jobs.cap * 2 : 8;
+            int *ids = realloc(held_jobs.ids, cap * sizeof(*ids));
+            if (ids == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            held_jobs.ids = ids;
+            held_jobs.cap = cap;
+        }
+        held_jobs.ids[held_jobs.count++] = job->id;
+    }
+}
+
+int drain_zygote();
+
+/**
+ * @brief           Drains the SIGCHLD signalfd and reaps every child that
+ *                  has exited with waitpid(-1, WNOHANG). Background
+ *                  processes are reported and removed from the table as
+ *                  they are reaped, so the cost depends on the number of
+ *                  children that finished rather than on the table size.
+ *
+ * @return int      The number of background processes reported.
+ */
+int reap_background_processes() {
+    struct signalfd_siginfo info;
+    struct rusage usage;
+    int bgStatus;
+    int reported = 0;
+    pid_t result;
+
+    // Consume the pending notifications; the wait4 loop below reaps
+    // every child regardless of how many SIGCHLDs were merged
+    while (read(sigchld_fd, &info, sizeof(info)) == sizeof(info)) {
+    }
+    for (int i = 0; i < held_jobs.count; i++) {
+        if (finish_job(&job_table.slots[held_jobs.ids[i] - 1])) {
+            reported++;
+        }
+    }
+    held_jobs.count = 0;
+
+    // With job control, stops and resumes of background jobs are reported
+    int options = WNOHANG | (job_control ? WUNTRACED | WCONTINUED : 0);
+    while ((result = wait4(-1, &bgStatus, options, &usage)) > 0) {
+        if (handle_exited_child(result, bgStatus, &usage)) {
+            reported++;
+        }
+    }
+    reported += drain_zygote();
+    metrics_watched();
+    if (reported > 0) {
+        fflush(stdout);
+    }
+    return reported;
+}
+
+/**
+ * @brief           Blocks SIGCHLD and creates the signalfd the reaper reads
+ *                  child notifications from.
+ */
+void init_child_reaper() {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigchld_fd == -1) {
+        perror("signalfd");
+        exit(1);
+    }
+}
+
+/**
+ * @brief           Prints the prompt and remembers that it is showing.
+ */
+void print_prompt() {
+    printf("%s", prompt);
+    fflush(stdout);
+    prompt_shown = true;
+}
+
+/**
+ * @brief           Waits until stdin has input, reaping and reporting
+ *                  background processes as they finish in the meantime.
+ *                  Only used in interactive mode, and only when the line
+ *                  reader has no complete line buffered.
+ */
+void wait_for_input() {
+    struct pollfd fds[3] = {
+        { .fd = STDIN_FILENO, .events = POLLIN },
+        { .fd = sigchld_fd,   .events = POLLIN },
+        { .fd = -1,           .events = POLLIN },
+    };
+
+    while (true) {
+        // Exits of zygote children arrive on its socket
+        fds[2].fd = zygote.fd;
+        int ready = poll(fds, 3, -1);
+        metrics_watched();
+        if (ready == -1) {
+            if (errno == EINTR) {
+                // SIGTSTP handler printed a message, show the prompt again
+                print_prompt();
+                continue;
+            }
+            perror("poll");
+            return;
+        }
+        if (((fds[1].revents | fds[2].revents) & POLLIN)
+                && reap_background_processes() > 0) {
+            print_prompt();
+        }
+        if (fds[0].revents) {
+            return;
+        }
+    }
+}
+
+/**
+ * @brief       Allocates memory from an arena. Memory is 16-byte aligned
+ *              and stays valid until the arena is reset.
+ * 
+ * @param a     The arena to allocate from.
+ * @param size  Number of bytes needed.
+ * @return void* 
+ *              The allocated memory. Does not return on failure.
+ */
+void *arena_alloc(struct arena *a, size_t size)
+{
+    size = (size + 15) & ~(size_t) 15;
+    struct arena_block *block = a->head;
+    if (block == NULL || block->size - block->used < size) {
+        size_t block_size = ARENA_BLOCK;
+        if (block != NULL && block->size * 2 > block_size) {
+            block_size = block->size * 2;
+        }
+        if (block_size < size) {
+            block_size = size;
+        }
+        block = malloc(sizeof(struct arena_block) + block_size);
+        if (block == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        block->next = a->head;
+        block->size = block_size;
+        block->used = 0;
+        a->head = block;
+    }
+    void *ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+/**
+ * @brief       Allocates zeroed memory from an arena.
+ * 
+ * @param a     The arena to allocate from.
+ * @param size  Number of bytes needed.
+ * @return void* 
+ *              The allocated memory.
+ */
+void *arena_calloc(struct arena *a, size_t size)
+{
+    return memset(arena_alloc(a, size), 0, size);
+}
+
+/**
+ * @brief       Appends an argument to a command. argv starts small and
+ *              doubles in the arena the command lives in, so a command
+ *              costs memory in proportion to its arguments; the kernel's
+ *              ARG_MAX is the only limit.
+ * 
+ * @param a     The arena the command is allocated from.
+ * @param cmd   The command.
+ * @param word  The argument, which must outlive the command.
+ */
+void add_argument(struct arena *a, struct command_line *cmd, char *word)
+{
+    if (cmd->argc + 1 >= cmd->argv_cap) {
+        int capacity = cmd->argv_cap ? cmd->argv_cap * 2 : ARGV_MIN;
+        char **argv = arena_alloc(a, capacity * sizeof(char *));
+        if (cmd->argc > 0) {
+            memcpy(argv, cmd->argv, cmd->argc * sizeof(char *));
+        }
+        cmd->argv = argv;
+        cmd->argv_cap = capacity;
+    }
+    cmd->argv[cmd->argc++] = word;
+    cmd->argv[cmd->argc] = NULL;
+}
+
+/**
+ * @brief       Releases everything allocated from an arena. If the arena
+ *              had to grow, its blocks are merged into one block big enough
+ *              for the high-water mark, so after a warm-up period resets
+ *              are O(1) and allocations never reach malloc. A high-water
+ *              mark over ARENA_KEEP_MAX is not kept: the arena goes back to
+ *              one ARENA_BLOCK.
+ * 
+ * @param a     The arena to reset.
+ */
+void arena_reset(struct arena *a)
+{
+    struct arena_block *block = a->head;
+    if (block == NULL) {
+        return;
+    }
+    if (block->next != NULL || block->size > ARENA_KEEP_MAX) {
+        size_t total = 0;
+        while (block != NULL) {
+            struct arena_block *next = block->next;
+            total += block->size;
+            free(block);
+            block = next;
+        }
+        a->head = NULL;
+        // one huge line should not pin its memory for the rest of the run
+        arena_alloc(a, total <= ARENA_KEEP_MAX ? total : ARENA_BLOCK);
+        block = a->head;
+    }
+    block->used = 0;
+}
+
+/**
+ * @brief       Remembers how much of an arena is in use, so that what is
+ *              allocated after can be freed without touching what came
+ *              before.
+ * 
+ * @param a     The arena.
+ * @return struct arena_mark 
+ *              The position, for arena_restore().
+ */
+struct arena_mark arena_save(struct arena *a)
+{
+    return (struct arena_mark) { a->head, a->head != NULL ? a->head->used : 0 };
+}
+
+/**
+ * @brief       Frees everything allocated from an arena since a mark.
+ *              Blocks added after the mark go back to malloc.
+ * 
+ * @param a     The arena.
+ * @param mark  From arena_save().
+ */
+void arena_restore(struct arena *a, struct arena_mark mark)
+{
+    while (a->head != mark.block) {
+        struct arena_block *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+    if (a->head != NULL) {
+        a->head->used = mark.used;
+    }
+}
+
+/**
+ * @brief           Makes room in a line reader's buffer for more input.
+ *                  Unread data is slid to the front; the buffer doubles
+ *                  only when a single line fills it.
+ * 
+ * @param r         The reader.
+ */
+void reader_make_room(struct line_reader *r)
+{
+    if (r->start > 0) {
+        memmove(r->buf, r->buf + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+    }
+    if (r->end == 0 && r->size > READ_CHUNK) {
+        // the long line that grew the buffer is done with
+        free(r->buf);
+        r->buf = NULL;
+        r->size = 0;
+    }
+    if (r->end == r->size) {
+        size_t size = r->size ? r->size * 2 : READ_CHUNK;
+        char *buf = realloc(r->buf, size);
+        if (buf == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        r->buf = buf;
+        r->size = size;
+    }
+}
+
+/**
+ * @brief           Returns the next line from a reader, without its
+ *                  newline. The line points into the reader's buffer and is
+ *                  only valid until the next call.
+ * 
+ * @param r         The reader.
+ * @param len       Receives the length of the line.
+ * @return char* 
+ *                  The NUL-terminated line, or NULL at end of input.
+ */
+char *read_line(struct line_reader *r, size_t *len)
+{
+    while (true) {
+        char *nl = memchr(r->buf + r->start + r->scan, '\n',
+                          r->end - r->start - r->scan);
+        if (nl != NULL) {
+            char *line = r->buf + r->start;
+            *nl = '\0';
+            *len = nl - line;
+            r->start += *len + 1;
+            r->scan = 0;
+            return line;
+        }
+        r->scan = r->end - r->start;
+
+        if (r->eof) {
+            if (r->start == r->end) {
+                return NULL;
+            }
+            // Last line without a newline
+            reader_make_room(r);
+            char *line = r->buf + r->start;
+            *len = r->end - r->start;
+            line[*len] = '\0';
+            r->start = r->end;
+            r->scan = 0;
+            return line;
+        }
+
+        // Always leave room for the terminating NUL of a final line
+        reader_make_room(r);
+        if (r->size - r->end < 2) {
+            continue;
+        }
+        if (interactive) {
+            wait_for_input();
+        }
+        ssize_t n = read(r->fd, r->buf + r->end, r->size - r->end - 1);
+        if (n > 0) {
+            r->end += n;
+        } else if (n == 0 || errno != EINTR) {
+            r->eof = true;
+        } else if (interactive) {
+            // SIGTSTP handler printed a message, show the prompt again
+            print_prompt();
+        }
+    }
+}
+
+/**
+ * @brief           Points a line reader at an in-memory script, as used by
+ *                  -c.
+ * 
+ * @param r         The reader.
+ * @param text      The script text.
+ */
+void reader_from_string(struct line_reader *r, const char *text)
+{
+    r->fd = -1;
+    r->buf = strdup(text);
+    if (r->buf == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+    r->size = strlen(text) + 1;
+    r->end = r->size - 1;
+    r->eof = true;
+}
+
+// Bytes that end an unquoted run of plain word characters
+static const bool word_delim[256] = {
+    ['\0'] = true, ['\t'] = true, ['\n'] = true, [' '] = true,
+    ['"'] = true, ['&'] = true, ['\''] = true, ['<'] = true,
+    ['>'] = true, ['\\'] = true, ['|'] = true, ['$'] = true,
+};
+
+/**
+ * @brief       Finds the length of the plain run at p: the bytes up to the
+ *              next blank, quote, backslash, $ or operator character. With
+ *              SSE2 the line is scanned 16 bytes at a time, so long
+ *              arguments are copied with a single memcpy.
+ * 
+ * @param p     Start of the run.
+ * @param end   End of the line.
+ * @return size_t 
+ */
+size_t plain_run(const char *p, const char *end)
+{
+    const char *start = p;
+#ifdef __SSE2__
+    const __m128i delims[] = {
+        _mm_set1_epi8('\0'), _mm_set1_epi8('\t'), _mm_set1_epi8('\n'),
+        _mm_set1_epi8(' '), _mm_set1_epi8('"'), _mm_set1_epi8('&'),
+        _mm_set1_epi8('\''), _mm_set1_epi8('<'), _mm_set1_epi8('>'),
+        _mm_set1_epi8('\\'), _mm_set1_epi8('|'), _mm_set1_epi8('$'),
+    };
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) p);
+        __m128i hits = _mm_setzero_si128();
+        for (size_t i = 0; i < sizeof(delims) / sizeof(delims[0]); i++) {
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, delims[i]));
+        }
+        int mask = _mm_movemask_epi8(hits);
+        if (mask != 0) {
+            return p - start + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    while (p < end && !word_delim[(unsigned char) *p]) {
+        p++;
+    }
+    return p - start;
+}
+
+/**
+ * @brief       Checks for a character that can appear in a variable name.
+ * 
+ * @param c     The character.
+ * @param first Whether it would be the first one, which cannot be a digit.
+ * @return bool 
+ */
+static inline bool is_name_char(char c, bool first)
+{
+    unsigned char u = c;
+    return u == '_' || (unsigned) ((u | 0x20) - 'a') < 26u
+           || (!first && (unsigned) (u - '0') < 10u);
+}
+
+/**
+ * @brief       Finds the ) that closes a $( ... ), skipping nested
+ *              parentheses, quotes and escapes.
+ * 
+ * @param p     Just after the (.
+ * @param end   End of the line.
+ * @return const char* 
+ *              The closing ), or NULL if there is none.
+ */
+static const char *find_subst_end(const char *p, const char *end)
+{
+    int depth = 1;
+    for (; p < end; p++) {
+        if (*p == '\\') {
+            p++;
+        } else if (*p == '\'') {
+            if ((p = memchr(p + 1, '\'', end - p - 1)) == NULL) {
+                return NULL;
+            }
+        } else if (*p == '"') {
+            for (p++; p < end && *p != '"'; p++) {
+                p += *p == '\\';
+            }
+            if (p >= end) {
+                return NULL;
+            }
+        } else if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && --depth == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief       Copies a $ reference into the lexer output behind a mark.
+ *              A NAME is ended with EXPAND_END while the quoting is still
+ *              known, so "$HOME"x does not look up HOMEx later. The text of
+ *              a $( ... ) is copied as it is, up to an EXPAND_END in place
+ *              of the ), and is only parsed when it runs.
+ * 
+ * @param out   Lexer output position.
+ * @param pp    Input position, at the $; moved past the reference.
+ * @param end   End of the line.
+ * @param mark  EXPAND_MARK or EXPAND_MARK_QUOTED.
+ * @return char* 
+ *              The new output position, or NULL if a $( is not closed.
+ */
+static char *lex_dollar(char *out, const char **pp, const char *end, char mark)
+{
+    const char *p = *pp + 1;
+    *out++ = mark;
+    if (p < end && *p == '(') {
+        const char *close = find_subst_end(p + 1, end);
+        if (close == NULL) {
+            return NULL;
+        }
+        memcpy(out, p, close - p);
+        out += close - p;
+        *out++ = EXPAND_END;
+        p = close + 1;
+    } else if (p < end && (*p == '$' || *p == '?' || *p == '!' || *p == '#'
+                           || (*p >= '0' && *p <= '9'))) {
+        *out++ = *p++;
+    } else if (p < end && is_name_char(*p, true)) {
+        while (p < end && is_name_char(*p, false)) {
+            *out++ = *p++;
+        }
+        *out++ = EXPAND_END;
+    }
+    *pp = p;
+    return out;
+}
+
+/**
+ * @brief       Reports a syntax error, unless a script is being compiled,
+ *              and empties the command so the line does nothing.
+ * 
+ * @param cmd   The command being parsed.
+ * @param fmt   printf() format of the message.
+ * @return struct command_line* 
+ *              cmd, emptied.
+ */
+struct command_line *syntax_error(struct command_line *cmd, const char *fmt, ...)
+{
+    syntax_errors.count++;
+    if (!syntax_errors.quiet) {
+        va_list ap;
+        va_start(ap, fmt);
+        vfprintf(stderr, fmt, ap);
+        va_end(ap);
+    }
+    return memset(cmd, 0, sizeof(*cmd));
+}
+
+/**
+ * @brief       Splits one input line into a command in a single pass. A
+ *              small state machine handles blanks, single and double
+ *              quotes, backslash escapes, comments and the operators
+ *              < > >> 2> 2>> 2>&1 & |, which do not need to be surrounded
+ *              by spaces. Words are unquoted into a buffer in line_arena.
+ *              A $ outside single quotes is marked for expand_command(),
+ *              including the $( ... ) of a command substitution.
+ * 
+ *              Syntax errors are reported and yield an empty command.
+ * 
+ * @param line  The line, which does not need to be NUL-terminated.
+ * @param len   Length of the line.
+ * @return struct command_line* 
+ *              The command, allocated in line_arena.
+ */
+struct command_line *parse_line(const char *line, size_t len)
+{
+    struct command_line *curr_command = arena_calloc(&line_arena, sizeof(struct command_line));
+    struct command_line *stage = curr_command;
+    // Unquoting only shrinks a word, but every marked $NAME gains an
+    // EXPAND_END, and each of those takes at least two bytes of input
+    char *out = arena_alloc(&line_arena, len + len / 2 + 1);
+    const char *p = line;
+    const char *end = line + len;
+    char **target = NULL;       // redirection waiting for its file name
+
+    while (true) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\0')) {
+            p++;
+        }
+        if (p == end || *p == '#') {
+            // end of line, or a comment that runs to it
+            break;
+        }
+
+        // Operators
+        if (*p == '|' || *p == '&' || *p == '<' || *p == '>'
+                || (*p == '2' && p + 1 < end && p[1] == '>')) {
+            if (target != NULL) {
+                break;
+            }
+            if (*p == '|') {
+                // start the next pipeline stage
+                stage->next = arena_calloc(&line_arena, sizeof(struct command_line));
+                stage = stage->next;
+                p++;
+            } else if (*p == '&') {
+                curr_command->is_bg = true;
+                p++;
+            } else if (*p == '<') {
+                target = &stage->input_file;
+                p++;
+            } else if (*p == '>') {
+                stage->append_output = p + 1 < end && p[1] == '>';
+                target = &stage->output_file;
+                p += stage->append_output ? 2 : 1;
+            } else if (end - p >= 4 && memcmp(p, "2>&1", 4) == 0) {
+                stage->merge_error = true;
+                stage->error_file = NULL;
+                p += 4;
+            } else {
+                stage->append_error = p + 2 < end && p[2] == '>';
+                stage->merge_error = false;
+                target = &stage->error_file;
+                p += stage->append_error ? 3 : 2;
+            }
+            continue;
+        }
+
+        // A word: plain runs, quoted strings and escapes up to a blank or
+        // an operator
+        char *word = out;
+        bool quoted = false;
+        while (p < end) {
+            size_t n = plain_run(p, end);
+            memcpy(out, p, n);
+            out += n;
+            p += n;
+            if (p == end) {
+                break;
+            }
+            if (*p == '$') {
+                if ((out = lex_dollar(out, &p, end, EXPAND_MARK)) == NULL) {
+                    return syntax_error(curr_command, "syntax error: unterminated $(\n");
+                }
+            } else if (*p == '\\') {
+                // an escaped newline joins lines, anything else is literal
+                if (++p < end && *p++ != '\n') {
+                    *out++ = p[-1];
+                }
+            } else if (*p == '\'') {
+                const char *close = memchr(p + 1, '\'', end - p - 1);
+                if (close == NULL) {
+                    return syntax_error(curr_command, "syntax error: unterminated quote\n");
+                }
+                memcpy(out, p + 1, close - p - 1);
+                out += close - p - 1;
+                p = close + 1;
+                quoted = true;
+            } else if (*p == '"') {
+                for (p++; p < end && *p != '"'; ) {
+                    // inside double quotes only \" \\ \$ \` and newline
+                    // are escapes
+                    if (*p == '\\' && p + 1 < end && p[1] != '\0'
+                            && strchr("\"\\$`\n", p[1]) != NULL) {
+                        if (*++p != '\n') {
+                            *out++ = *p;
+                        }
+                        p++;
+                    } else if (*p == '$') {
+                        out = lex_dollar(out, &p, end, EXPAND_MARK_QUOTED);
+                        if (out == NULL) {
+                            return syntax_error(curr_command, "syntax error: unterminated $(\n");
+                        }
+                    } else {
+                        *out++ = *p++;
+                    }
+                }
+                if (p == end) {
+                    return syntax_error(curr_command, "syntax error: unterminated quote\n");
+                }
+                p++;
+                quoted = true;
+            } else {
+                break;
+            }
+        }
+        if (out == word && !quoted) {
+            // only escaped newlines
+            continue;
+        }
+        *out++ = '\0';
+
+        if (target != NULL) {
+            *target = word;
+            target = NULL;
+        } else {
+            // words stay in the output buffer, which lives in the arena
+            add_argument(&line_arena, stage, word);
+        }
+    }
+
+    if (target != NULL) {
+        if (p == end || *p == '#') {
+            return syntax_error(curr_command, "syntax error near unexpected token `newline'\n");
+        }
+        return syntax_error(curr_command, "syntax error near unexpected token `%c'\n", *p);
+    }
+    return curr_command;
+}
+
+/**
+ * @brief       Finds a history line in the log.
+ * 
+ * @param off   Offset of the line in the log.
+ * @param len   Receives its length, without the newline.
+ * @return const char* 
+ *              The line, which is not NUL-terminated.
+ */
+const char *history_line(uint32_t off, size_t *len)
+{
+    const char *text = (const char *) history.log + off;
+    const char *nl = memchr(text, '\n', history.log_size - off);
+    *len = nl != NULL ? (size_t) (nl - text) : 0;
+    return text;
+}
+
+/**
+ * @brief       Compares a history line with a string, like memcmp but with
+ *              a shorter string sorting first.
+ * 
+ * @param off   Offset of the line.
+ * @param s     The string.
+ * @param n     Its length.
+ * @param plen  Only compare this many bytes of the line (prefix search),
+ *              or SIZE_MAX to compare whole lines.
+ * @return int  <0, 0 or >0.
+ */
+static int history_compare(uint32_t off, const char *s, size_t n, size_t plen)
+{
+    size_t len;
+    const char *text = history_line(off, &len);
+    if (len > plen) {
+        len = plen;
+    }
+    int c = memcmp(text, s, len < n ? len : n);
+    if (c != 0) {
+        return c;
+    }
+    return len < n ? -1 : len > n;
+}
+
+/**
+ * @brief       qsort comparison of two history offsets by their text.
+ */
+static int history_sort_cmp(const void *a, const void *b)
+{
+    size_t len;
+    const char *text = history_line(*(const uint32_t *) b, &len);
+    return history_compare(*(const uint32_t *) a, text, len, SIZE_MAX);
+}
+
+/**
+ * @brief       Finds the first index entry that does not sort before s.
+ * 
+ * @param s     The string.
+ * @param n     Its length.
+ * @param plen  As for history_compare().
+ * @param upper Find the first entry that sorts after s instead.
+ * @return uint32_t 
+ *              Position in the index.
+ */
+static uint32_t history_bound(const char *s, size_t n, size_t plen, bool upper)
+{
+    uint32_t lo = 0, hi = history.count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int c = history_compare(history.index[mid], s, n, plen);
+        if (c < 0 || (upper && c == 0)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * @brief       Looks a line up in the hash set of recent lines.
+ * 
+ * @param s     The line.
+ * @param n     Its length.
+ * @param hash  hash_bytes() of the line.
+ * @return struct history_slot* 
+ *              The slot holding the line, or the empty slot it would go in.
+ */
+static struct history_slot *history_tail_find(const char *s, size_t n, uint32_t hash)
+{
+    for (uint32_t i = hash & history.tail_mask; ; i = (i + 1) & history.tail_mask) {
+        struct history_slot *slot = &history.tail[i];
+        if (slot->offset == 0 || (slot->hash == hash
+                && history_compare(slot->offset, s, n, SIZE_MAX) == 0)) {
+            return slot;
+        }
+    }
+}
+
+/**
+ * @brief       Records that the line at off is the latest copy of its text,
+ *              growing the hash set at half load.
+ * 
+ * @param off   Offset of the line.
+ */
+static void history_tail_add(uint32_t off)
+{
+    if ((history.tail_count + 1) * 2 > history.tail_mask + 1) {
+        uint32_t old_size = history.tail_mask + 1;
+        struct history_slot *old = history.tail;
+        uint32_t size = old_size * 2;
+        history.tail = calloc(size, sizeof(struct history_slot));
+        if (history.tail == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        history.tail_mask = size - 1;
+        for (uint32_t i = 0; i < old_size; i++) {
+            if (old[i].offset != 0) {
+                uint32_t b = old[i].hash & history.tail_mask;
+                while (history.tail[b].offset != 0) {
+                    b = (b + 1) & history.tail_mask;
+                }
+                history.tail[b] = old[i];
+            }
+        }
+        free(old);
+    }
+
+    size_t len;
+    const char *text = history_line(off, &len);
+    uint32_t hash = hash_bytes(text, len);
+    struct history_slot *slot = history_tail_find(text, len, hash);
+    if (slot->offset == 0) {
+        history.tail_count++;
+    }
+    slot->offset = off;
+    slot->hash = hash;
+}
+
+/**
+ * @brief       Checks that the line at off is the most recent copy of its
+ *              text, so listings and searches show every line once.
+ * 
+ * @param off   Offset of the line.
+ * @return bool 
+ */
+static bool history_is_latest(uint32_t off)
+{
+    size_t len;
+    const char *text = history_line(off, &len);
+    struct history_slot *slot = history_tail_find(text, len, hash_bytes(text, len));
+    if (slot->offset != 0) {
+        return slot->offset == off;
+    }
+    if (off >= history.covered) {
+        // written by another shell since the last merge
+        return true;
+    }
+    uint32_t i = history_bound(text, len, SIZE_MAX, false);
+    return i < history.count && history.index[i] == off;
+}
+
+/**
+ * @brief       Makes sure the first need bytes of the log are mapped,
+ *              growing the file (never shrinking it, since other shells
+ *              may share it) and the mapping by doubling.
+ * 
+ * @param need  Bytes that must be mapped.
+ * @return bool False if the log could not grow.
+ */
+static bool history_map(size_t need)
+{
+    if (need <= history.log_size) {
+        return true;
+    }
+    size_t size = history.log_size * 2;
+    while (size < need) {
+        size *= 2;
+    }
+    struct stat st;
+    if (fstat(history.fd, &st) == -1) {
+        return false;
+    }
+    if ((size_t) st.st_size < size && fallocate(history.fd, 0, 0, size) == -1
+            && (errno != EOPNOTSUPP || ftruncate(history.fd, size) == -1)) {
+        return false;
+    }
+    void *map = mremap(history.log, history.log_size, size, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    history.log = map;
+    history.log_size = size;
+    return true;
+}
+
+/**
+ * @brief       Maps the index file and checks that it matches the log. An
+ *              index that does not is ignored and rebuilt by the next merge.
+ */
+static void history_load_index()
+{
+    if (history.index_map != NULL) {
+        munmap(history.index_map, history.index_map_size);
+    }
+    history.index_map = NULL;
+    history.index = NULL;
+    history.count = 0;
+    history.covered = sizeof(struct history_header);
+
+    int fd = open(history.index_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1) {
+        return;
+    }
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(struct history_index_header)) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        const struct history_index_header *header = map;
+        if (map != MAP_FAILED && memcmp(header->magic, HISTORY_INDEX_MAGIC, 8) == 0
+                && header->covered <= history.log->used
+                && st.st_size == (off_t) (sizeof(*header) + header->count * sizeof(uint32_t))) {
+            history.index_map = map;
+            history.index_map_size = st.st_size;
+            history.index = (const uint32_t *) (header + 1);
+            history.count = header->count;
+            history.covered = header->covered;
+        } else if (map != MAP_FAILED) {
+            munmap(map, st.st_size);
+        }
+    }
+    close(fd);
+}
+
+/**
+ * @brief       Folds the lines added since the last merge into the index:
+ *              the new lines are read from the log (including those of
+ *              other shells), sorted, and merged with the index in one
+ *              pass, keeping the newest copy of each text. The new index is
+ *              written beside the old one and renamed over it.
+ */
+void history_merge()
+{
+    if (history.fd == -1) {
+        return;
+    }
+    uint64_t used = __atomic_load_n(&history.log->used, __ATOMIC_ACQUIRE);
+    if (used <= history.covered || !history_map(used)) {
+        return;
+    }
+
+    // Rebuild the hash set from the log, stopping at a line another shell
+    // has reserved but not finished writing
+    memset(history.tail, 0, (history.tail_mask + 1) * sizeof(struct history_slot));
+    history.tail_count = 0;
+    const char *base = (const char *) history.log;
+    uint64_t end = history.covered;
+    while (end < used) {
+        const char *nl = memchr(base + end, '\n', used - end);
+        if (nl == NULL || memchr(base + end, '\0', nl - (base + end)) != NULL) {
+            break;
+        }
+        history_tail_add(end);
+        end = nl - base + 1;
+    }
+
+    uint32_t *fresh = malloc(history.tail_count * sizeof(uint32_t) + 1);
+    uint32_t *merged = malloc((history.count + history.tail_count) * sizeof(uint32_t) + 1);
+    if (fresh == NULL || merged == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    uint32_t nfresh = 0;
+    for (uint32_t i = 0; i <= history.tail_mask; i++) {
+        if (history.tail[i].offset != 0) {
+            fresh[nfresh++] = history.tail[i].offset;
+        }
+    }
+    qsort(fresh, nfresh, sizeof(uint32_t), history_sort_cmp);
+
+    // The new lines are few next to the index: find each one's place by
+    // binary search and copy the runs of the index between them
+    uint32_t n = 0, i = 0;
+    for (uint32_t j = 0; j < nfresh; j++) {
+        size_t len;
+        const char *text = history_line(fresh[j], &len);
+        uint32_t at = history_bound(text, len, SIZE_MAX, false);
+        memcpy(merged + n, history.index + i, (at - i) * sizeof(uint32_t));
+        n += at - i;
+        merged[n++] = fresh[j];
+        // equal texts keep the newer line
+        i = at < history.count && history.index[at] != fresh[j]
+            && history_compare(history.index[at], text, len, SIZE_MAX) == 0 ? at + 1 : at;
+    }
+    memcpy(merged + n, history.index + i, (history.count - i) * sizeof(uint32_t));
+    n += history.count - i;
+
+    char tmp[sizeof(history.index_path) + 16];
+    snprintf(tmp, sizeof(tmp), "%s.%d", history.index_path, (int) getpid());
+    struct history_index_header header = { .covered = end, .count = n };
+    memcpy(header.magic, HISTORY_INDEX_MAGIC, 8);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    bool ok = fd != -1
+              && write(fd, &header, sizeof(header)) == sizeof(header)
+              && write(fd, merged, n * sizeof(uint32_t)) == (ssize_t) (n * sizeof(uint32_t));
+    if (fd != -1) {
+        close(fd);
+    }
+    if (!ok || rename(tmp, history.index_path) == -1) {
+        perror(history.index_path);
+        unlink(tmp);
+    }
+    free(fresh);
+    free(merged);
+
+    history_load_index();
+    // whatever the new index does not cover stays in the hash set
+    memset(history.tail, 0, (history.tail_mask + 1) * sizeof(struct history_slot));
+    history.tail_count = 0;
+    for (uint64_t off = history.covered; off < end; ) {
+        history_tail_add(off);
+        off = (const char *) memchr(base + off, '\n', end - off) - base + 1;
+    }
+}
+
+/**
+ * @brief       Opens the history log named by SMALLSH_HISTORY, or
+ *              ~/.smallsh_history for an interactive shell, and its index.
+ *              An empty SMALLSH_HISTORY turns history off.
+ */
+void init_history()
+{
+    const char *path = getenv("SMALLSH_HISTORY");
+    const char *home = getenv("HOME");
+    char buf[PATH_MAX];
+    if (path == NULL && interactive && home != NULL) {
+        snprintf(buf, sizeof(buf), "%s/.smallsh_history", home);
+        path = buf;
+    }
+    if (path == NULL || *path == '\0') {
+        return;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(path);
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+    size_t size = HISTORY_MIN_SIZE;
+    while (size < (size_t) st.st_size) {
+        size *= 2;
+    }
+    if ((size_t) st.st_size < size && fallocate(fd, 0, 0, size) == -1
+            && (errno != EOPNOTSUPP || ftruncate(fd, size) == -1)) {
+        perror(path);
+        close(fd);
+        return;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return;
+    }
+    struct history_header *header = map;
+    if (st.st_size == 0 || header->used == 0) {
+        memcpy(header->magic, HISTORY_MAGIC, 8);
+        header->used = sizeof(*header);
+    } else if (memcmp(header->magic, HISTORY_MAGIC, 8) != 0 || header->used > size) {
+        fprintf(stderr, "history: %s: not a smallsh history file\n", path);
+        munmap(map, size);
+        close(fd);
+        return;
+    }
+
+    history.fd = fd;
+    history.log = header;
+    history.log_size = size;
+    snprintf(history.index_path, sizeof(history.index_path), "%s.idx", path);
+    history.tail_mask = HISTORY_TAIL_MIN - 1;
+    history.tail = calloc(HISTORY_TAIL_MIN, sizeof(struct history_slot));
+    if (history.tail == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    history_load_index();
+    history_merge();
+}
+
+/**
+ * @brief       Appends a line to the history. The space is reserved with an
+ *              atomic add on the shared header, so shells sharing the file
+ *              never overwrite each other, and the line is copied into the
+ *              mapping; the kernel writes it back, there is no fsync.
+ * 
+ * @param line  The line.
+ * @param len   Its length.
+ */
+void history_add(const char *line, size_t len)
+{
+    if (history.fd == -1 || len == 0 || memchr(line, '\n', len) != NULL) {
+        return;
+    }
+    size_t blanks = 0;
+    while (blanks < len && (line[blanks] == ' ' || line[blanks] == '\t')) {
+        blanks++;
+    }
+    if (blanks == len) {
+        return;
+    }
+
+    uint64_t off = __atomic_fetch_add(&history.log->used, len + 1, __ATOMIC_ACQ_REL);
+    if (off + len + 1 > UINT32_MAX || !history_map(off + len + 1)) {
+        // the space stays reserved but is never filled in
+        return;
+    }
+    char *dest = (char *) history.log + off;
+    memcpy(dest, line, len);
+    dest[len] = '\n';
+    history_tail_add(off);
+    if (history.tail_count >= HISTORY_TAIL_MAX) {
+        history_merge();
+    }
+}
+
+/**
+ * @brief       Finds the most recent history line that starts with prefix
+ *              and is older than before. Walking back through the log
+ *              finds it quickly when many lines match; when the index says
+ *              only a few do, they are checked directly instead, so rare
+ *              prefixes do not walk the whole log.
+ * 
+ * @param prefix    The prefix; an empty one matches every line.
+ * @param plen      Its length.
+ * @param before    Offset to search back from, or UINT32_MAX for the end.
+ * @return uint32_t 
+ *                  Offset of the line, or 0 if there is none. The text is
+ *                  returned by history_line().
+ */
+uint32_t history_search(const char *prefix, size_t plen, uint32_t before)
+{
+    if (history.fd == -1) {
+        return 0;
+    }
+    uint32_t lo = history_bound(prefix, plen, plen, false);
+    uint32_t hi = history_bound(prefix, plen, plen, true);
+    uint32_t best = 0;
+    if (hi - lo <= HISTORY_RANGE_MAX) {
+        for (uint32_t i = lo; i < hi; i++) {
+            uint32_t off = history.index[i];
+            if (off < before && off > best && history_is_latest(off)) {
+                best = off;
+            }
+        }
+        for (uint32_t i = 0; i <= history.tail_mask; i++) {
+            uint32_t off = history.tail[i].offset;
+            if (off != 0 && off < before && off > best
+                    && history_compare(off, prefix, plen, plen) == 0) {
+                best = off;
+            }
+        }
+        return best;
+    }
+
+    const char *base = (const char *) history.log;
+    uint64_t pos = __atomic_load_n(&history.log->used, __ATOMIC_ACQUIRE);
+    if (pos > before) {
+        pos = before;
+    }
+    if (pos > history.log_size) {
+        pos = history.log_size;
+    }
+    while (pos > sizeof(struct history_header)) {
+        // pos is just past a newline, unless another shell is mid-write
+        const char *start = memrchr(base + sizeof(struct history_header), '\n',
+                                    pos - 1 - sizeof(struct history_header));
+        uint32_t off = start != NULL ? (size_t) (start - base + 1)
+                                     : sizeof(struct history_header);
+        if (base[pos - 1] == '\n' && history_compare(off, prefix, plen, plen) == 0
+                && history_is_latest(off)) {
+            return off;
+        }
+        pos = off;
+    }
+    return 0;
+}
+
+/**
+ * @brief       Makes a heap array hold at least need entries, doubling it.
+ * 
+ * @param array The array, or NULL.
+ * @param cap   Its capacity in entries, updated.
+ * @param need  Entries it must hold.
+ * @param size  Size of an entry.
+ * @return void* 
+ *              The array, which may have moved.
+ */
+void *script_grow(void *array, size_t *cap, size_t need, size_t size)
+{
+    if (need <= *cap) {
+        return array;
+    }
+    size_t capacity = *cap > 0 ? *cap : 64;
+    while (capacity < need) {
+        capacity *= 2;
+    }
+    array = realloc(array, capacity * size);
+    if (array == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    *cap = capacity;
+    return array;
+}
+
+/**
+ * @brief       Finds a string in the string table of a script being
+ *              compiled, adding it the first time it is seen.
+ * 
+ * @param b     The script being compiled.
+ * @param s     The string, or NULL.
+ * @return uint32_t 
+ *              Its offset, or SCRIPT_CACHE_NONE for NULL.
+ */
+uint32_t script_intern(struct script_builder *b, const char *s)
+{
+    if (s == NULL) {
+        return SCRIPT_CACHE_NONE;
+    }
+    size_t len = strlen(s);
+    size_t i = hash_bytes(s, len) & b->set_mask;
+    for (; b->set[i] != 0; i = (i + 1) & b->set_mask) {
+        if (strcmp(b->strings + b->set[i] - 1, s) == 0) {
+            return b->set[i] - 1;
+        }
+    }
+
+    uint32_t off = b->nstrings;
+    b->strings = script_grow(b->strings, &b->strings_cap, b->nstrings + len + 1, 1);
+    memcpy(b->strings + off, s, len + 1);
+    b->nstrings += len + 1;
+    b->set[i] = off + 1;
+    if (++b->nset * 2 > b->set_mask) {
+        // rehash into twice the slots
+        size_t mask = b->set_mask * 2 + 1;
+        uint32_t *set = calloc(mask + 1, sizeof(uint32_t));
+        if (set == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        for (size_t j = 0; j <= b->set_mask; j++) {
+            if (b->set[j] != 0) {
+                const char *t = b->strings + b->set[j] - 1;
+                size_t k = hash_bytes(t, strlen(t)) & mask;
+                while (set[k] != 0) {
+                    k = (k + 1) & mask;
+                }
+                set[k] = b->set[j];
+            }
+        }
+        free(b->set);
+        b->set = set;
+        b->set_mask = mask;
+    }
+    return off;
+}
+
+/**
+ * @brief       Adds a parsed line to a script being compiled. Lines that
+ *              run nothing are left out.
+ * 
+ * @param b     The script being compiled.
+ * @param cmd   The line, as parse_line() returned it.
+ * @return true 
+ *              The line was added.
+ * @return false 
+ *              The line calls parallel without inputs, which reads the
+ *              lines after it from the script, so the script cannot be
+ *              run compiled.
+ */
+bool script_add_line(struct script_builder *b, struct command_line *cmd)
+{
+    if (cmd->argc == 0) {
+        return true;
+    }
+    struct script_cache_line line = { .stage = b->nstages, .count = 0 };
+    for (struct command_line *stage = cmd; stage; stage = stage->next) {
+        bool parallel = false;
+        bool inputs = stage->input_file != NULL;
+        struct script_cache_stage entry = {
+            .arg = b->nargs,
+            .argc = stage->argc,
+            .input_file = script_intern(b, stage->input_file),
+            .output_file = script_intern(b, stage->output_file),
+            .error_file = script_intern(b, stage->error_file),
+            .flags = (stage->append_output ? SCRIPT_STAGE_APPEND_OUTPUT : 0)
+                     | (stage->append_error ? SCRIPT_STAGE_APPEND_ERROR : 0)
+                     | (stage->merge_error ? SCRIPT_STAGE_MERGE_ERROR : 0)
+                     | (stage->is_bg ? SCRIPT_STAGE_BACKGROUND : 0),
+        };
+        b->args = script_grow(b->args, &b->args_cap, b->nargs + stage->argc, sizeof(uint32_t));
+        for (int i = 0; i < stage->argc; i++) {
+            b->args[b->nargs++] = script_intern(b, stage->argv[i]);
+            parallel |= strcmp(stage->argv[i], "parallel") == 0;
+            inputs |= strcmp(stage->argv[i], ":::") == 0;
+        }
+        if (parallel && !inputs) {
+            return false;
+        }
+        b->stages = script_grow(b->stages, &b->stages_cap, b->nstages + 1, sizeof(entry));
+        b->stages[b->nstages++] = entry;
+        line.count++;
+    }
+    b->lines = script_grow(b->lines, &b->lines_cap, b->nlines + 1, sizeof(line));
+    b->lines[b->nlines++] = line;
+    return true;
+}
+
+int batch_directive(const char *line, size_t len);
+
+/**
+ * @brief       Parses every line of a script once and lays the commands
+ *              out as a cache image.
+ * 
+ * @param text  The script.
+ * @param st    Its status, recorded in the header.
+ * @param size  Receives the size of the image.
+ * @return char* 
+ *              The image on the heap, or NULL if a line has a syntax
+ *              error or the script cannot be run compiled, e.g. because
+ *              it has batch directives.
+ */
+char *script_compile(const char *text, const struct stat *st, size_t *size)
+{
+    size_t len = st->st_size;
+    struct script_builder b = { .set_mask = SCRIPT_INTERN_MIN - 1 };
+    b.set = calloc(SCRIPT_INTERN_MIN, sizeof(uint32_t));
+    if (b.set == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    // Lines end where read_line() ends them, and errors are left for the
+    // uncompiled run to report in order
+    unsigned long errors = syntax_errors.count;
+    bool ok = true;
+    syntax_errors.quiet = true;
+    for (size_t start = 0; ok && start < len; ) {
+        const char *nl = memchr(text + start, '\n', len - start);
+        size_t end = nl != NULL ? (size_t) (nl - text) : len;
+        // a batch directive is a comment, which the cache would drop
+        ok = batch_directive(text + start, end - start) == -1
+             && script_add_line(&b, parse_line(text + start, end - start))
+             && syntax_errors.count == errors;
+        arena_reset(&line_arena);
+        start = end + 1;
+    }
+    syntax_errors.quiet = false;
+
+    char *image = NULL;
+    if (ok) {
+        struct script_cache_header header = {
+            .script_size = len,
+            .mtime_sec = st->st_mtim.tv_sec,
+            .mtime_nsec = st->st_mtim.tv_nsec,
+            .script_hash = hash_words(text, len),
+            .lines = b.nlines,
+            .stages = b.nstages,
+            .args = b.nargs,
+            .strings = b.nstrings,
+        };
+        memcpy(header.magic, SCRIPT_CACHE_MAGIC, 8);
+        size_t sizes[] = {
+            sizeof(header), b.nlines * sizeof(*b.lines), b.nstages * sizeof(*b.stages),
+            b.nargs * sizeof(*b.args), b.nstrings,
+        };
+        const void *parts[] = { &header, b.lines, b.stages, b.args, b.strings };
+        *size = 0;
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            *size += sizes[i];
+        }
+        image = malloc(*size);
+        if (image == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        char *p = image;
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            if (sizes[i] > 0) {
+                memcpy(p, parts[i], sizes[i]);
+            }
+            p += sizes[i];
+        }
+        ((struct script_cache_header *) image)->image_hash
+            = hash_words(image + sizeof(header), *size - sizeof(header));
+    }
+    free(b.lines);
+    free(b.stages);
+    free(b.args);
+    free(b.strings);
+    free(b.set);
+    return image;
+}
+
+/**
+ * @brief       Points script_cache at the tables of an image.
+ * 
+ * @param image The image, whose sizes have been checked.
+ */
+void script_use(char *image)
+{
+    const struct script_cache_header *header = (const void *) image;
+    script_cache.image = image;
+    script_cache.lines = (const void *) (header + 1);
+    script_cache.stages = (const void *) (script_cache.lines + header->lines);
+    script_cache.args = (const void *) (script_cache.stages + header->stages);
+    script_cache.strings = (char *) (script_cache.args + header->args);
+    script_cache.count = header->lines;
+    script_cache.next = 0;
+}
+
+/**
+ * @brief       Checks that a cache file was compiled from the script as it
+ *              is now and that every index in it is in range, then uses it.
+ *              The size and modification time turn away a stale cache
+ *              without reading the script; the script's hash catches an
+ *              edit that kept both, and the image's a damaged file.
+ * 
+ * @param image The mapped cache file.
+ * @param size  Its size.
+ * @param st    Status of the script.
+ * @param text  The script.
+ * @return true 
+ *              The cache is used.
+ * @return false 
+ *              The cache must be compiled again.
+ */
+bool script_load(char *image, size_t size, const struct stat *st, const char *text)
+{
+    const struct script_cache_header *header = (const void *) image;
+    if (size < sizeof(*header) || memcmp(header->magic, SCRIPT_CACHE_MAGIC, 8) != 0
+            || header->script_size != (uint64_t) st->st_size
+            || header->mtime_sec != st->st_mtim.tv_sec
+            || header->mtime_nsec != st->st_mtim.tv_nsec) {
+        return false;
+    }
+    uint64_t need = sizeof(*header)
+                    + (uint64_t) header->lines * sizeof(struct script_cache_line)
+                    + (uint64_t) header->stages * sizeof(struct script_cache_stage)
+                    + (uint64_t) header->args * sizeof(uint32_t) + header->strings;
+    if (need != size || (header->strings > 0 && image[size - 1] != '\0')
+            || hash_words(header + 1, size - sizeof(*header)) != header->image_hash) {
+        return false;
+    }
+
+    // Every string ends inside the table, since its last byte is a NUL
+    script_use(image);
+    bool ok = true;
+    for (uint32_t i = 0; ok && i < header->lines; i++) {
+        const struct script_cache_line *line = &script_cache.lines[i];
+        ok = line->count > 0 && line->stage <= header->stages
+             && line->count <= header->stages - line->stage;
+    }
+    for (uint32_t i = 0; ok && i < header->stages; i++) {
+        const struct script_cache_stage *stage = &script_cache.stages[i];
+        ok = stage->arg <= header->args && stage->argc <= header->args - stage->arg
+             && (stage->input_file == SCRIPT_CACHE_NONE || stage->input_file < header->strings)
+             && (stage->output_file == SCRIPT_CACHE_NONE || stage->output_file < header->strings)
+             && (stage->error_file == SCRIPT_CACHE_NONE || stage->error_file < header->strings);
+    }
+    for (uint32_t i = 0; ok && i < header->args; i++) {
+        ok = script_cache.args[i] < header->strings;
+    }
+    if (!ok || hash_words(text, st->st_size) != header->script_hash) {
+        memset(&script_cache, 0, sizeof(script_cache));
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief       With SMALLSH_CACHE set, runs a script file from the compiled
+ *              form cached next to it as FILE.smc. A missing or stale cache
+ *              is compiled again and written out for the next run; if it
+ *              cannot be written the compiled form is still used for this
+ *              one. Scripts whose lines go to the history, or that cannot
+ *              be compiled, are read line by line as usual.
+ */
+void init_script_cache()
+{
+    struct stat st;
+    if (script_path == NULL || getenv("SMALLSH_CACHE") == NULL || history.fd != -1
+            || fstat(input_reader.fd, &st) == -1 || !S_ISREG(st.st_mode)
+            || st.st_size == 0 || (uint64_t) st.st_size > SCRIPT_CACHE_MAX) {
+        return;
+    }
+    char *text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, input_reader.fd, 0);
+    char path[PATH_MAX];
+    int n = snprintf(path, sizeof(path), "%s.smc", script_path);
+    if (text == MAP_FAILED) {
+        return;
+    }
+    if (n < 0 || (size_t) n >= sizeof(path)) {
+        munmap(text, st.st_size);
+        return;
+    }
+
+    // The cache is mapped privately and writable, so its words can be
+    // changed in place like the ones parse_line() makes
+    struct stat cache_st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1 && fstat(fd, &cache_st) == 0 && cache_st.st_size > 0) {
+        char *image = mmap(NULL, cache_st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (image != MAP_FAILED && !script_load(image, cache_st.st_size, &st, text)) {
+            munmap(image, cache_st.st_size);
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    if (script_cache.image != NULL) {
+        munmap(text, st.st_size);
+        return;
+    }
+
+    size_t size;
+    char *image = script_compile(text, &st, &size);
+    munmap(text, st.st_size);
+    if (image == NULL) {
+        return;
+    }
+    script_use(image);
+
+    char tmp[PATH_MAX + 16];
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        // e.g. a read-only directory: compile on every run
+        return;
+    }
+    bool ok = write(fd, image, size) == (ssize_t) size;
+    close(fd);
+    if (!ok || rename(tmp, path) == -1) {
+        perror(path);
+        unlink(tmp);
+    }
+}
+
+/**
+ * @brief       Builds the next line of the compiled script in line_arena.
+ *              The words are not copied: argv points into the image.
+ * 
+ * @return struct command_line* 
+ *              The command, or NULL at the end of the script.
+ */
+struct command_line *script_next()
+{
+    if (script_cache.next == script_cache.count) {
+        return NULL;
+    }
+    const struct script_cache_line *line = &script_cache.lines[script_cache.next++];
+    struct command_line *first = NULL;
+    struct command_line **link = &first;
+    for (uint32_t i = 0; i < line->count; i++) {
+        const struct script_cache_stage *entry = &script_cache.stages[line->stage + i];
+        struct command_line *stage = arena_calloc(&line_arena, sizeof(struct command_line));
+        if (entry->argc > 0) {
+            stage->argv = arena_alloc(&line_arena, (entry->argc + 1) * sizeof(char *));
+            for (uint32_t j = 0; j < entry->argc; j++) {
+                stage->argv[j] = script_cache.strings + script_cache.args[entry->arg + j];
+            }
+            stage->argv[entry->argc] = NULL;
+            stage->argc = entry->argc;
+            stage->argv_cap = entry->argc + 1;
+        }
+        const uint32_t files[] = { entry->input_file, entry->output_file, entry->error_file };
+        char **targets[] = { &stage->input_file, &stage->output_file, &stage->error_file };
+        for (int j = 0; j < 3; j++) {
+            *targets[j] = files[j] == SCRIPT_CACHE_NONE ? NULL : script_cache.strings + files[j];
+        }
+        stage->append_output = entry->flags & SCRIPT_STAGE_APPEND_OUTPUT;
+        stage->append_error = entry->flags & SCRIPT_STAGE_APPEND_ERROR;
+        stage->merge_error = entry->flags & SCRIPT_STAGE_MERGE_ERROR;
+        stage->is_bg = entry->flags & SCRIPT_STAGE_BACKGROUND;
+        *link = stage;
+        link = &stage->next;
+    }
+    return first;
+}
+
+char *edit_line(size_t *len);
+
+/**
+ * @brief           Gets input from the user and parses it for commands. 
+ *                  Creates a command_line struct with data about the command.
+ *                  Parses I/O redirection and background process flags.
+ * 
+ *                  The prompt is only shown in interactive mode, where the
+ *                  line editor reads the line if it is enabled.
+ * 
+ * @return struct command_line* 
+ *                  Returns the command_line struct with the data about the 
+ *                  command, or NULL at the end of the input.
+ */
+struct command_line *parse_input()
+{
+    if (script_cache.image != NULL) {
+        // compiled script: nothing to read or tokenize
+        return script_next();
+    }
+
+    // Get input
+    size_t len;
+    char *line;
+    if (editor.enabled) {
+        line = edit_line(&len);
+    } else {
+        if (interactive) {
+            print_prompt();
+        }
+        line = read_line(&input_reader, &len);
+    }
+    prompt_shown = false;
+    if (line == NULL) {
+        return NULL;
+    }
+    history_add(line, len);
+    int directive = batch_directive(line, len);
+    if (directive != -1) {
+        batch.parallel = directive;
+    }
+
+    // Words are copied out of the reader's buffer, which is reused
+    return parse_line(line, len);
+}
+
+/**
+ * @brief       Marks the environment index stale. Anything that changes the
+ *              environment must call this.
+ */
+void invalidate_env_index()
+{
+    env_index.valid = false;
+}
+
+/**
+ * @brief       Rebuilds the environment index from environ. Like getenv,
+ *              the first entry wins if a name appears twice.
+ */
+void build_env_index()
+{
+    size_t count = 0;
+    for (char **env = environ; *env != NULL; env++) {
+        count++;
+    }
+    size_t capacity = ENV_INDEX_MIN;
+    while (capacity < count * 2) {
+        capacity *= 2;
+    }
+    if (capacity != env_index.capacity) {
+        free(env_index.entries);
+        env_index.entries = calloc(capacity, sizeof(char *));
+        if (env_index.entries == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        env_index.capacity = capacity;
+    } else {
+        memset(env_index.entries, 0, capacity * sizeof(char *));
+    }
+
+    size_t mask = capacity - 1;
+    for (char **env = environ; *env != NULL; env++) {
+        const char *eq = strchr(*env, '=');
+        if (eq == NULL) {
+            continue;
+        }
+        size_t len = eq - *env + 1;
+        size_t i = hash_bytes(*env, len - 1) & mask;
+        while (env_index.entries[i] != NULL
+                && strncmp(env_index.entries[i], *env, len) != 0) {
+            i = (i + 1) & mask;
+        }
+        if (env_index.entries[i] == NULL) {
+            env_index.entries[i] = *env;
+        }
+    }
+    env_index.valid = true;
+}
+
+/**
+ * @brief       Looks up an environment variable through the index.
+ * 
+ * @param name  The variable name, which does not need to be terminated.
+ * @param len   Length of the name.
+ * @return const char* 
+ *              The value, or NULL if the variable is not set.
+ */
+const char *lookup_variable(const char *name, size_t len)
+{
+    if (!env_index.valid) {
+        build_env_index();
+    }
+    size_t mask = env_index.capacity - 1;
+    for (size_t i = hash_bytes(name, len) & mask; env_index.entries[i] != NULL;
+            i = (i + 1) & mask) {
+        const char *entry = env_index.entries[i];
+        if (strncmp(entry, name, len) == 0 && entry[len] == '=') {
+            return entry + len + 1;
+        }
+    }
+    return NULL;
+}
+
+struct command_line *expand_command(struct command_line *cmd);
+void run_command(struct command_line *cmd);
+bool is_compound(const struct command_line *cmd);
+void run_compound(struct command_line *cmd);
+struct function *find_function(const char *name);
+const struct builtin *find_builtin(const char *name);
+
+/**
+ * @brief       Tells whether the command of a $(...) can run in the shell
+ *              itself: programs run in the foreground, and the built-ins
+ *              that have a program of the same name, which only write
+ *              output. Anything else could change the shell (cd, export,
+ *              &, a function, a compound command) and needs a subshell.
+ * 
+ * @param cmd   The parsed, not yet expanded, command.
+ * @return bool True if the command leaves the shell as it was.
+ */
+bool substitution_in_process(const struct command_line *cmd)
+{
+    if (cmd->is_bg || is_compound(cmd)) {
+        return false;
+    }
+    for (const struct command_line *stage = cmd; stage; stage = stage->next) {
+        if (stage->argc == 0) {
+            continue;
+        }
+        const char *name = stage->argv[0];
+        const struct builtin *b = find_builtin(name);
+        // time and limit prefix some other command
+        if ((b != NULL && !b->has_program) || find_function(name) != NULL
+                || strcmp(name, "time") == 0 || strcmp(name, "limit") == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief       Runs a $(...) command in a forked copy of the shell, so that
+ *              whatever it changes is thrown away with the copy. The copy
+ *              reads no more input, so a compound command cannot take the
+ *              shell's next lines, and its status becomes $?.
+ * 
+ * @param cmd   The parsed, not yet expanded, command.
+ */
+void run_subshell(struct command_line *cmd)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork()");
+        set_exit_status(1);
+        return;
+    }
+    if (pid == 0) {
+        substitution_depth++;
+        interactive = false;
+        editor.enabled = false;
+        history.fd = -1;
+        script_cache.image = NULL;
+        input_reader.start = input_reader.end;
+        input_reader.scan = 0;
+        input_reader.eof = true;
+        if (is_compound(cmd)) {
+            run_compound(cmd);
+        } else {
+            run_command(expand_command(cmd));
+        }
+        fflush(stdout);
+        _exit(prev_fg_status.exited ? prev_fg_status.code : 128 + prev_fg_status.code);
+    }
+    int status;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+    }
+    if (WIFSIGNALED(status)) {
+        prev_fg_status = (struct last_status) { .terminated = true, .code = WTERMSIG(status) };
+    } else {
+        set_exit_status(WEXITSTATUS(status));
+    }
+}
+
+/**
+ * @brief       Runs the command of a $(...) and captures its output, with
+ *              stdout pointed at a memfd, so children write straight into
+ *              its pages and nothing goes through a pipe. A command that
+ *              only writes output runs in the shell like any other line;
+ *              the rest run in a subshell. Small outputs are read into
+ *              line_arena; large ones are mapped, so they are never copied
+ *              whole onto the heap. Trailing newlines are removed.
+ * 
+ * @param text  The command text between the parentheses.
+ * @param len   Its length.
+ * @param cap   Receives the output. release_capture() undoes the mapping.
+ */
+void run_substitution(const char *text, size_t len, struct capture *cap)
+{
+    *cap = (struct capture) { .data = "", .len = 0, .map = NULL };
+    int fd = memfd_create("smallsh-subst", MFD_CLOEXEC);
+    if (fd == -1) {
+        perror("memfd_create");
+        return;
+    }
+    struct command_line *cmd = parse_line(text, len);
+
+    fflush(stdout);
+    int saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    dup2(fd, STDOUT_FILENO);
+    if (substitution_in_process(cmd)) {
+        substitution_depth++;
+        run_command(expand_command(cmd));
+        substitution_depth--;
+    } else {
+        run_subshell(cmd);
+    }
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        size_t size = st.st_size;
+        if (size <= CAPTURE_READ_MAX) {
+            char *data = arena_alloc(&line_arena, size);
+            ssize_t n = pread(fd, data, size, 0);
+            cap->data = data;
+            cap->len = n > 0 ? n : 0;
+        } else {
+            void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                cap->data = cap->map = map;
+                cap->len = cap->map_len = size;
+            } else {
+                perror("mmap");
+            }
+        }
+    }
+    close(fd);
+    while (cap->len > 0 && cap->data[cap->len - 1] == '\n') {
+        cap->len--;
+    }
+}
+
+/**
+ * @brief       Unmaps a large captured output once its words are copied.
+ * 
+ * @param cap   The capture.
+ */
+void release_capture(struct capture *cap)
+{
+    if (cap->map != NULL) {
+        munmap(cap->map, cap->map_len);
+        cap->map = NULL;
+    }
+}
+
+/**
+ * @brief       Runs every $(...) of a word, left to right.
+ * 
+ * @param word  The word.
+ * @param count Receives the number of substitutions.
+ * @return struct capture* 
+ *              Their outputs in line_arena, or NULL if there are none.
+ */
+struct capture *run_captures(const char *word, int *count)
+{
+    *count = 0;
+    for (const char *p = word; (p = strpbrk(p, "\x01\x02")) != NULL; p++) {
+        *count += p[1] == '(';
+    }
+    if (*count == 0) {
+        return NULL;
+    }
+    struct capture *caps = arena_alloc(&line_arena, *count * sizeof(struct capture));
+    int i = 0;
+    for (const char *p = word; (p = strpbrk(p, "\x01\x02")) != NULL; p++) {
+        if (p[1] == '(') {
+            const char *close = strchr(p + 2, EXPAND_END);
+            run_substitution(p + 2, close - p - 2, &caps[i++]);
+            p = close;
+        }
+    }
+    return caps;
+}
+
+/**
+ * @brief       Expands the $ references the lexer marked in a word: $$, $?,
+ *              $!, $#, $0 to $9, $NAME, ${NAME} and $(...). Unset variables
+ *              expand to nothing, and a $ that starts none of these stays as
+ *              it is.
+ * 
+ *              With split, the output of an unquoted $(...) is split into
+ *              fields: each run of blanks and newlines in it is written as
+ *              a single NUL.
+ * 
+ * @param out   Receives the expansion, or NULL to only measure it.
+ * @param word  The word.
+ * @param caps  Outputs of the word's $(...), from run_captures().
+ * @param split Split unquoted substitutions into fields.
+ * @return size_t 
+ *              Length of the expansion, without a terminator. Measuring
+ *              gives an upper bound when splitting.
+ */
+size_t expand_word(char *out, const char *word, const struct capture *caps, bool split)
+{
+    size_t len = 0;
+    const char *p = word;
+
+    while (*p != '\0') {
+        if (*p != EXPAND_MARK && *p != EXPAND_MARK_QUOTED) {
+            if (out != NULL) {
+                out[len] = *p;
+            }
+            len++;
+            p++;
+            continue;
+        }
+        char mark = *p++;
+
+        char number[24];
+        const char *value = number;
+        size_t n = 0;
+        if (*p == '(') {
+            const struct capture *cap = caps++;
+            p = strchr(p, EXPAND_END) + 1;
+            if (split && mark == EXPAND_MARK && out != NULL) {
+                bool blank = false;
+                for (size_t i = 0; i < cap->len; i++) {
+                    char c = cap->data[i];
+                    if (c == ' ' || c == '\t' || c == '\n') {
+                        blank = true;
+                        continue;
+                    }
+                    if (blank) {
+                        out[len++] = '\0';
+                        blank = false;
+                    }
+                    out[len++] = c;
+                }
+                if (blank) {
+                    out[len++] = '\0';
+                }
+                continue;
+            }
+            value = cap->data;
+            n = cap->len;
+        } else if (*p == '$') {
+            n = snprintf(number, sizeof(number), "%d", shell_pid);
+            p++;
+        } else if (*p == '?') {
+            int code = prev_fg_status.code;
+            if (prev_fg_status.terminated) {
+                code += 128;
+            }
+            n = snprintf(number, sizeof(number), "%d", code);
+            p++;
+        } else if (*p == '!') {
+            if (last_bg_pid != 0) {
+                n = snprintf(number, sizeof(number), "%d", last_bg_pid);
+            }
+            p++;
+        } else if (*p == '#') {
+            n = snprintf(number, sizeof(number), "%d", compound.nargs);
+            p++;
+        } else if (*p >= '0' && *p <= '9') {
+            int i = *p++ - '0';
+            value = i == 0 ? compound.arg0 : i <= compound.nargs ? compound.args[i - 1] : NULL;
+            n = value != NULL ? strlen(value) : 0;
+        } else {
+            // ${NAME} or $NAME
+            bool braced = *p == '{';
+            const char *name = braced ? p + 1 : p;
+            const char *name_end = name;
+            if (is_name_char(*name_end, true)) {
+                while (is_name_char(*name_end, false)) {
+                    name_end++;
+                }
+            }
+            if (name_end == name || (braced && *name_end != '}')) {
+                // not a reference, keep the $
+                value = "$";
+                n = 1;
+            } else {
+                value = lookup_variable(name, name_end - name);
+                n = value != NULL ? strlen(value) : 0;
+                // skip the } or the EXPAND_END
+                p = name_end + 1;
+            }
+        }
+        if (out != NULL && n > 0) {
+            memcpy(out + len, value, n);
+        }
+        len += n;
+    }
+    return len;
+}
+
+/**
+ * @brief       Expands one word into line_arena, without field splitting.
+ * 
+ * @param word  The word.
+ * @param drop  Set if the word was an unquoted expansion that came out
+ *              empty and should be removed, as sh does.
+ * @return char*
+ *              The expansion, or word itself if it has no references.
+ */
+char *expand_string(char *word, bool *drop)
+{
+    *drop = false;
+    if (strpbrk(word, "\x01\x02") == NULL) {
+        return word;
+    }
+    int ncaps;
+    struct capture *caps = run_captures(word, &ncaps);
+    size_t len = expand_word(NULL, word, caps, false);
+    char *out = arena_alloc(&line_arena, len + 1);
+    expand_word(out, word, caps, false);
+    out[len] = '\0';
+    for (int i = 0; i < ncaps; i++) {
+        release_capture(&caps[i]);
+    }
+    *drop = len == 0 && strchr(word, EXPAND_MARK_QUOTED) == NULL;
+    return out;
+}
+
+/**
+ * @brief       Expands a word into one or more arguments of a command. The
+ *              output of an unquoted $(...) is split on blanks and
+ *              newlines; the fields are written straight into line_arena.
+ * 
+ * @param cmd   The command to append the arguments to.
+ * @param word  The word.
+ */
+void expand_argument(struct command_line *cmd, char *word)
+{
+    bool split = false;
+    for (const char *p = word; !split && (p = strchr(p, EXPAND_MARK)) != NULL; p++) {
+        split = p[1] == '(';
+    }
+    if (!split) {
+        bool drop;
+        char *field = expand_string(word, &drop);
+        if (!drop) {
+            add_argument(&line_arena, cmd, field);
+        }
+        return;
+    }
+
+    int ncaps;
+    struct capture *caps = run_captures(word, &ncaps);
+    size_t len = expand_word(NULL, word, caps, true);
+    char *out = arena_alloc(&line_arena, len + 1);
+    len = expand_word(out, word, caps, true);
+    out[len] = '\0';
+    for (int i = 0; i < ncaps; i++) {
+        release_capture(&caps[i]);
+    }
+    // fields are NUL separated; a blank at either end leaves an empty one
+    for (char *field = out; field < out + len; field += strlen(field) + 1) {
+        if (*field != '\0') {
+            add_argument(&line_arena, cmd, field);
+        }
+    }
+}
+
+/**
+ * @brief       Expansion phase between parsing and running a command. The
+ *              parsed command is left untouched, so it can be run again;
+ *              if any word has a reference, an expanded copy is built in
+ *              line_arena.
+ * 
+ * @param cmd   The parsed command.
+ * @return struct command_line* 
+ *              The command to run.
+ */
+struct command_line *expand_command(struct command_line *cmd)
+{
+    bool needed = false;
+    for (struct command_line *stage = cmd; stage && !needed; stage = stage->next) {
+        for (int i = 0; i < stage->argc && !needed; i++) {
+            needed = strpbrk(stage->argv[i], "\x01\x02") != NULL;
+        }
+        char *files[] = { stage->input_file, stage->output_file, stage->error_file };
+        for (int i = 0; i < 3 && !needed; i++) {
+            needed = files[i] != NULL && strpbrk(files[i], "\x01\x02") != NULL;
+        }
+    }
+    if (!needed) {
+        return cmd;
+    }
+
+    struct command_line *first = NULL;
+    struct command_line **link = &first;
+    bool drop;
+    for (struct command_line *stage = cmd; stage; stage = stage->next) {
+        struct command_line *copy = arena_alloc(&line_arena, sizeof(*copy));
+        *copy = *stage;
+        copy->argv = NULL;
+        copy->argc = 0;
+        copy->argv_cap = 0;
+        for (int i = 0; i < stage->argc; i++) {
+            expand_argument(copy, stage->argv[i]);
+        }
+        // File names are never dropped, an empty one fails to open
+        if (copy->input_file != NULL) {
+            copy->input_file = expand_string(copy->input_file, &drop);
+        }
+        if (copy->output_file != NULL) {
+            copy->output_file = expand_string(copy->output_file, &drop);
+        }
+        if (copy->error_file != NULL) {
+            copy->error_file = expand_string(copy->error_file, &drop);
+        }
+        *link = copy;
+        link = &copy->next;
+    }
+    return first;
+}
+
+/**
+ * @brief       Checks that every stage of a pipeline has a command.
+ * 
+ * @param cmd   The first stage of the command.
+ * @return bool True if the pipeline can be run.
+ */
+bool valid_pipeline(struct command_line *cmd)
+{
+    for (struct command_line *stage = cmd; stage; stage = stage->next) {
+        if (stage->argc == 0) {
+            fprintf(stderr, "syntax error near unexpected token `|'\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief       Frees the command line struct from memory. All of it lives
+ *              in the line arena, so this is a single O(1) reset.
+ * 
+ * @param cmd   Command to be freed.
+ */
+void free_command(struct command_line *cmd)
+{
+    (void) cmd;
+    arena_reset(&line_arena);
+}
+
+/**
+ * @brief       FNV-1a hash of a byte string.
+ * 
+ * @param data  The bytes to hash.
+ * @param len   The number of bytes.
+ * @return uint64_t 
+ *              The hash.
+ */
+uint64_t hash_bytes(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint64_t h = 1469598103934665603ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+/**
+ * @brief       Hashes a large buffer eight bytes at a time. It mixes less
+ *              than hash_bytes() but is several times faster, for checking
+ *              that a file has not changed.
+ * 
+ * @param data  The bytes to hash.
+ * @param len   The number of bytes.
+ * @return uint64_t 
+ *              The hash.
+ */
+uint64_t hash_words(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint64_t h = 1469598103934665603ull ^ len;
+    uint64_t w;
+    for (; len >= 8; p += 8, len -= 8) {
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0x9e3779b97f4a7c15ull;
+        h ^= h >> 29;
+    }
+    w = 0;
+    memcpy(&w, p, len);
+    h = (h ^ w) * 0x9e3779b97f4a7c15ull;
+    return h ^ h >> 32;
+}
+
+/**
+ * @brief       Empties the PATH cache.
+ */
+void clear_path_cache()
+{
+    for (int i = 0; i <= path_cache.mask; i++) {
+        free(path_cache.entries[i].name);
+        free(path_cache.entries[i].path);
+    }
+    free(path_cache.entries);
+    free(path_cache.path_value);
+    for (size_t i = 0; i < path_cache.ncommands; i++) {
+        free(path_cache.commands[i]);
+    }
+    free(path_cache.commands);
+    path_cache.commands = NULL;
+    path_cache.ncommands = 0;
+    path_cache.entries = NULL;
+    path_cache.mask = -1;
+    path_cache.count = 0;
+    path_cache.path_value = NULL;
+}
+
+/**
+ * @brief       Finds the bucket for a command name.
+ * 
+ * @param name  The command name.
+ * @param hash  hash_bytes() of the name.
+ * @return struct path_entry* 
+ *              The bucket holding name, or the empty bucket where it would
+ *              go. NULL if the cache has no buckets yet.
+ */
+struct path_entry *find_path_bucket(const char *name, uint64_t hash)
+{
+    if (path_cache.entries == NULL) {
+        return NULL;
+    }
+    int b = (int) (hash & path_cache.mask);
+    while (path_cache.entries[b].name != NULL) {
+        if (path_cache.entries[b].hash == hash
+                && strcmp(path_cache.entries[b].name, name) == 0) {
+            break;
+        }
+        b = (b + 1) & path_cache.mask;
+    }
+    return &path_cache.entries[b];
+}
+
+/**
+ * @brief       Adds a resolved command to the PATH cache, growing the
+ *              table when it becomes half full.
+ * 
+ * @param name  The command name.
+ * @param hash  hash_bytes() of the name.
+ * @param path  The absolute path it resolved to.
+ * @return struct path_entry* 
+ *              The new entry.
+ */
+struct path_entry *add_path_entry(const char *name, uint64_t hash, const char *path)
+{
+    if ((path_cache.count + 1) * 2 > path_cache.mask + 1) {
+        int old_size = path_cache.mask + 1;
+        int size = old_size > 0 ? old_size * 2 : PATH_CACHE_MIN;
+        struct path_entry *old = path_cache.entries;
+        path_cache.entries = calloc(size, sizeof(struct path_entry));
+        if (path_cache.entries == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        path_cache.mask = size - 1;
+        for (int i = 0; i < old_size; i++) {
+            if (old[i].name != NULL) {
+                *find_path_bucket(old[i].name, old[i].hash) = old[i];
+            }
+        }
+        free(old);
+    }
+    struct path_entry *entry = find_path_bucket(name, hash);
+    entry->name = strdup(name);
+    entry->path = strdup(path);
+    entry->hash = hash;
+    entry->hits = 0;
+    if (entry->name == NULL || entry->path == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+    path_cache.count++;
+    return entry;
+}
+
+/**
+ * @brief       Removes a command from the PATH cache, e.g. after the
+ *              cached file disappeared.
+ * 
+ * @param name  The command name.
+ */
+void forget_path_entry(const char *name)
+{
+    uint64_t hash = hash_bytes(name, strlen(name));
+    struct path_entry *entry = find_path_bucket(name, hash);
+    if (entry == NULL || entry->name == NULL) {
+        return;
+    }
+    free(entry->name);
+    free(entry->path);
+    memset(entry, 0, sizeof(*entry));
+    path_cache.count--;
+
+    // Reinsert the rest of the probe chain so no lookup stops early
+    int b = (int) ((entry - path_cache.entries + 1) & path_cache.mask);
+    while (path_cache.entries[b].name != NULL) {
+        struct path_entry moved = path_cache.entries[b];
+        memset(&path_cache.entries[b], 0, sizeof(moved));
+        *find_path_bucket(moved.name, moved.hash) = moved;
+        b = (b + 1) & path_cache.mask;
+    }
+}
+
+/**
+ * @brief       Returns PATH, or the default search path when it is not set.
+ *              The PATH cache is dropped if it was built for another value.
+ * 
+ * @return const char* 
+ */
+const char *current_path()
+{
+    const char *path = lookup_variable("PATH", 4);
+    if (path == NULL) {
+        path = "/bin:/usr/bin";
+    }
+    if (path_cache.path_value != NULL && strcmp(path_cache.path_value, path) != 0) {
+        clear_path_cache();
+    }
+    if (path_cache.path_value == NULL) {
+        path_cache.path_value = strdup(path);
+    }
+    return path;
+}
+
+/**
+ * @brief       Resolves a command name to the executable execvp would run,
+ *              using the cache when possible. Names containing a slash are
+ *              returned unchanged. The cache is dropped whenever PATH no
+ *              longer matches the value it was built for. Matches found
+ *              through relative PATH entries depend on the working
+ *              directory and are not cached.
+ * 
+ * @param name  The command name.
+ * @param count Whether to count this lookup as a hit.
+ * @return const char* 
+ *              The path to execute, or NULL if the command was not found.
+ *              Uncached results are only valid until the next call.
+ */
+const char *lookup_command(const char *name, bool count)
+{
+    static char found[PATH_MAX];
+
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+
+    const char *path = current_path();
+    uint64_t hash = hash_bytes(name, strlen(name));
+    struct path_entry *entry = find_path_bucket(name, hash);
+    if (entry != NULL && entry->name != NULL) {
+        if (count) {
+            entry->hits++;
+        }
+        return entry->path;
+    }
+
+    // Walk PATH the way execvp would
+    size_t name_len = strlen(name);
+    for (const char *dir = path; ; ) {
+        const char *sep = strchrnul(dir, ':');
+        size_t dir_len = sep - dir;
+        if (dir_len + name_len + 2 <= sizeof(found)) {
+            struct stat st;
+            if (dir_len == 0) {
+                // an empty entry means the current directory
+                memcpy(found, name, name_len + 1);
+            } else {
+                memcpy(found, dir, dir_len);
+                found[dir_len] = '/';
+                memcpy(found + dir_len + 1, name, name_len + 1);
+            }
+            if (access(found, X_OK) == 0 && stat(found, &st) == 0
+                    && S_ISREG(st.st_mode)) {
+                if (found[0] != '/') {
+                    return found;
+                }
+                entry = add_path_entry(name, hash, found);
+                if (count) {
+                    entry->hits++;
+                }
+                return entry->path;
+            }
+        }
+        if (*sep == '\0') {
+            return NULL;
+        }
+        dir = sep + 1;
+    }
+}
+
+/**
+ * @brief       Replaces the process image with a command, exec'ing the
+ *              cached path directly. Falls back to execvp so failures are
+ *              reported exactly as before. Only returns on error.
+ * 
+ * @param cmd   The command to run.
+ */
+void exec_command(struct command_line *cmd)
+{
+    const char *path = lookup_command(cmd->argv[0], false);
+    if (path != NULL) {
+        execv(path, cmd->argv);
+    }
+    execvp(cmd->argv[0], cmd->argv);
+}
+
+/**
+ * @brief       Built-in `hash`. With no arguments, lists the cached
+ *              commands and their hit counts; `-r` empties the cache;
+ *              `-d NAME` forgets one command; `NAME...` resolves and caches
+ *              the named commands.
+ * 
+ * @param cmd   The parsed hash command.
+ */
+void run_hash(struct command_line *cmd)
+{
+    int code = 0;
+
+    if (cmd->argc == 1) {
+        if (path_cache.count == 0) {
+            printf("hash: hash table empty\n");
+        } else {
+            printf("hits\tcommand\n");
+            for (int i = 0; i <= path_cache.mask; i++) {
+                if (path_cache.entries[i].name != NULL) {
+                    printf("%4lu\t%s\n", path_cache.entries[i].hits,
+                           path_cache.entries[i].path);
+                }
+            }
+        }
+    } else if (strcmp(cmd->argv[1], "-r") == 0) {
+        clear_path_cache();
+    } else if (strcmp(cmd->argv[1], "-d") == 0) {
+        for (int i = 2; i < cmd->argc; i++) {
+            forget_path_entry(cmd->argv[i]);
+        }
+    } else {
+        for (int i = 1; i < cmd->argc; i++) {
+            if (lookup_command(cmd->argv[i], false) == NULL) {
+                fprintf(stderr, "hash: %s: not found\n", cmd->argv[i]);
+                code = 1;
+            }
+        }
+    }
+    fflush(stdout);
+    set_exit_status(code);
+}
+
+/**
+ * @brief       Returns the shell's shared /dev/null descriptor, opening it
+ *              on first use. It is O_CLOEXEC and only ever reaches a child
+ *              through dup2, so background jobs do not open it themselves.
+ * 
+ * @return int  The descriptor, or -1 if /dev/null cannot be opened.
+ */
+int dev_null()
+{
+    if (null_fd == -1) {
+        null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+    }
+    return null_fd;
+}
+
+/**
+ * @brief       Open flags for an output redirection.
+ * 
+ * @param append    True for >> and 2>>.
+ * @return int
+ */
+int output_flags(bool append)
+{
+    return O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
+}
+
+/**
+ * @brief       Opens a file and moves it onto a standard stream. The file
+ *              is opened O_CLOEXEC and closed after dup2, so the exec'd
+ *              program only sees the standard stream.
+ * 
+ * @param path      The file to open.
+ * @param flags     open(2) flags.
+ * @param target    The stream to replace.
+ * @return int      0 on success, -1 if open failed, -2 if dup2 failed.
+ */
+int redirect_stream(const char *path, int flags, int target)
+{
+    int fd = open(path, flags | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    if (fd == target) {
+        // open() reused the closed stream, keep it across exec
+        return fcntl(fd, F_SETFD, 0) == -1 ? -2 : 0;
+    }
+    int result = dup2(fd, target);
+    close(fd);
+    return result == -1 ? -2 : 0;
+}
+
+/**
+ * @brief       Sets up the standard streams of a forked child the same way
+ *              build_spawn_actions() does for the spawn path. On failure
+ *              the child prints the usual diagnostic and exits.
+ * 
+ * @param cmd    The command being run.
+ * @param is_bg  Background commands default stdin/stdout to /dev/null.
+ * @param in_fd  Pipe to read stdin from, or -1.
+ * @param out_fd Pipe to write stdout to, or -1.
+ */
+void redirect_child(struct command_line *cmd, bool is_bg, int in_fd, int out_fd)
+{
+    if (cmd->input_file != NULL) {
+        int result = redirect_stream(cmd->input_file, O_RDONLY, STDIN_FILENO);
+        if (result == -1 && !is_bg) {
+            printf("cannot open %s for input\n", cmd->input_file);
+            exit(1);
+        }
+        if (result != 0) {
+            perror(cmd->input_file);
+            exit(result == -1 ? 1 : 2);
+        }
+    } else if (in_fd != -1 || is_bg) {
+        int fd = in_fd != -1 ? in_fd : dev_null();
+        if (fd == -1) {
+            perror("/dev/null");
+            exit(1);
+        }
+        if (dup2(fd, STDIN_FILENO) == -1) {
+            perror("dup2");
+            exit(2);
+        }
+    }
+
+    if (cmd->output_file != NULL) {
+        int result = redirect_stream(cmd->output_file,
+                                     output_flags(cmd->append_output),
+                                     STDOUT_FILENO);
+        if (result != 0) {
+            perror(cmd->output_file);
+            exit(result == -1 ? 1 : 2);
+        }
+    } else if (out_fd != -1 || is_bg) {
+        int fd = out_fd != -1 ? out_fd : dev_null();
+        if (fd == -1) {
+            perror("/dev/null");
+            exit(1);
+        }
+        if (dup2(fd, STDOUT_FILENO) == -1) {
+            perror("dup2");
+            exit(2);
+        }
+    }
+
+    if (cmd->merge_error) {
+        if (dup2(STDOUT_FILENO, STDERR_FILENO) == -1) {
+            perror("dup2");
+            exit(2);
+        }
+    } else if (cmd->error_file != NULL) {
+        int result = redirect_stream(cmd->error_file,
+                                     output_flags(cmd->append_error),
+                                     STDERR_FILENO);
+        if (result != 0) {
+            perror(cmd->error_file);
+            exit(result == -1 ? 1 : 2);
+        }
+    }
+}
+
+/**
+ * @brief           Builds the posix_spawn file actions for a command. The
+ *                  redirections are the same ones the fork path performs
+ *                  in the child, but they are carried out by the spawn
+ *                  implementation so the shell's page tables are never
+ *                  copied.
+ *
+ * @param actions   Initialized file actions object to fill in.
+ * @param cmd       The command whose redirections should be applied.
+ * @param is_bg     Background commands default stdin/stdout to /dev/null.
+ * @param in_fd     Pipe to read stdin from, or -1.
+ * @param out_fd    Pipe to write stdout to, or -1.
+ * @return int      0 on success, an error number otherwise.
+ */
+int build_spawn_actions(posix_spawn_file_actions_t *actions,
+                        struct command_line *cmd, bool is_bg,
+                        int in_fd, int out_fd)
+{
+    int err = 0;
+
+    // Files named on the command line win over pipes, and pipes win over
+    // the /dev/null default of background commands
+    if (cmd->input_file != NULL) {
+        err = posix_spawn_file_actions_addopen(actions, STDIN_FILENO,
+                                               cmd->input_file, O_RDONLY, 0);
+    } else if (in_fd != -1) {
+        err = posix_spawn_file_actions_adddup2(actions, in_fd, STDIN_FILENO);
+    } else if (is_bg && dev_null() != -1) {
+        err = posix_spawn_file_actions_adddup2(actions, null_fd, STDIN_FILENO);
+    }
+    if (err != 0) {
+        return err;
+    }
+
+    if (cmd->output_file != NULL) {
+        err = posix_spawn_file_actions_addopen(actions, STDOUT_FILENO,
+                                               cmd->output_file,
+                                               output_flags(cmd->append_output),
+                                               0644);
+    } else if (out_fd != -1) {
+        err = posix_spawn_file_actions_adddup2(actions, out_fd, STDOUT_FILENO);
+    } else if (is_bg && dev_null() != -1) {
+        err = posix_spawn_file_actions_adddup2(actions, null_fd, STDOUT_FILENO);
+    }
+    if (err != 0) {
+        return err;
+    }
+
+    // stdout is final at this point, so 2>&1 follows it
+    if (cmd->merge_error) {
+        err = posix_spawn_file_actions_adddup2(actions, STDOUT_FILENO,
+                                               STDERR_FILENO);
+    } else if (cmd->error_file != NULL) {
+        err = posix_spawn_file_actions_addopen(actions, STDERR_FILENO,
+                                               cmd->error_file,
+                                               output_flags(cmd->append_error),
+                                               0644);
+    }
+    return err;
+}
+
+/**
+ * @brief       Launches a command with posix_spawn. glibc implements it
+ *              with clone(CLONE_VM | CLONE_VFORK), so the cost of a launch
+ *              does not grow with the size of the shell. The executable
+ *              comes from the PATH cache, so PATH is not walked on every
+ *              launch; if the cached file has disappeared the entry is
+ *              dropped and the name resolved again.
+ *
+ *              Any failure (a redirection that cannot be opened, a command
+ *              that cannot be executed, ...) is reported back to the caller
+ *              without printing anything, so the fork path can rerun the
+ *              command and produce its usual diagnostics and exit status.
+ *
+ * @param cmd    The command to launch.
+ * @param is_bg  Whether the command runs in the background.
+ * @param in_fd  Pipe to read stdin from, or -1.
+ * @param out_fd Pipe to write stdout to, or -1.
+ * @return pid_t 
+ *               The child pid, or -1 if the spawn path could not run it.
+ */
+pid_t spawn_process(struct command_line *cmd, bool is_bg, int in_fd, int out_fd)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t no_signals;
+    pid_t childPid = -1;
+
+    if (posix_spawn_file_actions_init(&actions) != 0) {
+        return -1;
+    }
+    if (posix_spawnattr_init(&attr) != 0) {
+        posix_spawn_file_actions_destroy(&actions);
+        return -1;
+    }
+
+    // Children always start with an empty signal mask
+    sigemptyset(&no_signals);
+    int err = posix_spawnattr_setsigmask(&attr, &no_signals);
+    short flags = POSIX_SPAWN_SETSIGMASK;
+    if (err == 0 && job_control) {
+        // The shell ignores the terminal stop signals, its children must not
+        sigset_t tty_signals;
+        sigemptyset(&tty_signals);
+        sigaddset(&tty_signals, SIGTTIN);
+        sigaddset(&tty_signals, SIGTTOU);
+        err = posix_spawnattr_setsigdefault(&attr, &tty_signals);
+        flags |= POSIX_SPAWN_SETSIGDEF;
+    }
+    if (err == 0 && launch_pgid != -1) {
+        err = posix_spawnattr_setpgroup(&attr, launch_pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    if (err == 0) {
+        err = posix_spawnattr_setflags(&attr, flags);
+    }
+#ifdef HAVE_SPAWN_TCSETPGRP
+    // Before the redirections, while stdin is still the terminal
+    if (err == 0 && launch_tty) {
+        err = posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+    }
+#endif
+    if (err == 0) {
+        err = build_spawn_actions(&actions, cmd, is_bg, in_fd, out_fd);
+    }
+    for (int attempt = 0; err == 0 && attempt < 2; attempt++) {
+        const char *path = lookup_command(cmd->argv[0], true);
+        if (path == NULL) {
+            err = ENOENT;
+            break;
+        }
+        err = posix_spawn(&childPid, path, &actions, &attr, cmd->argv, environ);
+        // ENOENT can also come from a redirection, so only retry when the
+        // cached file itself is gone
+        if (err != ENOENT || access(path, X_OK) == 0 || path == cmd->argv[0]) {
+            break;
+        }
+        forget_path_entry(cmd->argv[0]);
+        err = 0;
+    }
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (err != 0) {
+        return -1;
+    }
+    launch_stats.spawned++;
+    return childPid;
+}
+
+/**
+ * @brief       Child side of the fork path for a foreground command. Sets
+ *              up the redirections and replaces the process image.
+ *
+ * @param cmd    The command to run.
+ * @param in_fd  Pipe to read stdin from, or -1.
+ * @param out_fd Pipe to write stdout to, or -1.
+ */
+void exec_foreground_child(struct command_line *cmd, int in_fd, int out_fd)
+{
+    redirect_child(cmd, false, in_fd, out_fd);
+    exec_command(cmd);
+    // exec only returns if there is an error
+    metrics_exec_failed(errno);
+    perror(cmd->argv[0]);
+    exit(2);
+}
+
+/**
+ * @brief       Child side of the fork path for a background command. Any
+ *              stream that is not redirected or piped is attached to
+ *              /dev/null.
+ *
+ * @param cmd    The command to run.
+ * @param in_fd  Pipe to read stdin from, or -1.
+ * @param out_fd Pipe to write stdout to, or -1.
+ */
+void exec_background_child(struct command_line *cmd, int in_fd, int out_fd)
+{
+    redirect_child(cmd, true, in_fd, out_fd);
+    exec_command(cmd);
+    // exec only returns if there is an error
+    metrics_exec_failed(errno);
+    perror(cmd->argv[0]);
+    exit(2);
+}
+
+/**
+ * @brief       Checks whether a pipeline stage can run as a built-in
+ *              splice stage: `cat` with no arguments, or `tee FILE` between
+ *              two pipes, reading from a pipe and without file
+ *              redirections.
+ *
+ * @param cmd    The stage to check.
+ * @param in_fd  Pipe the stage reads from, or -1.
+ * @param out_fd Pipe the stage writes to, or -1.
+ * @return bool  True if the stage can be handled by run_splice_stage().
+ */
+bool is_splice_stage(struct command_line *cmd, int in_fd, int out_fd)
+{
+    if (!splice_stages || in_fd == -1
+            || cmd->input_file != NULL || cmd->output_file != NULL
+            || cmd->error_file != NULL || cmd->merge_error) {
+        return false;
+    }
+    if (strcmp(cmd->argv[0], "cat") == 0) {
+        return cmd->argc == 1;
+    }
+    if (strcmp(cmd->argv[0], "tee") == 0) {
+        return cmd->argc == 2 && out_fd != -1;
+    }
+    return false;
+}
+
+/**
+ * @brief       Copies stdin to stdout with read/write, for the cases splice
+ *              cannot handle (e.g. stdout is a terminal).
+ */
+void copy_stage()
+{
+    char buf[1 << 16];
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
+        for (ssize_t off = 0; off < n; ) {
+            ssize_t w = write(STDOUT_FILENO, buf + off, n - off);
+            if (w == -1) {
+                exit(1);
+            }
+            off += w;
+        }
+    }
+    exit(n == 0 ? 0 : 1);
+}
+
+/**
+ * @brief       Runs a built-in splice stage in a forked child. `cat` moves
+ *              pages from the stdin pipe to stdout with splice(2); `tee`
+ *              duplicates them into the stdout pipe with tee(2) and then
+ *              splices them into the file. Data never passes through user
+ *              space.
+ *
+ * @param cmd    The stage to run.
+ * @param is_bg  Whether the pipeline runs in the background.
+ * @param in_fd  Pipe to read stdin from.
+ * @param out_fd Pipe to write stdout to, or -1.
+ */
+void run_splice_stage(struct command_line *cmd, bool is_bg, int in_fd, int out_fd)
+{
+    // Behave like an exec'd child: default signals, nothing blocked
+    sigset_t no_signals;
+    sigemptyset(&no_signals);
+    sigprocmask(SIG_SETMASK, &no_signals, NULL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+
+    dup2(in_fd, STDIN_FILENO);
+    if (out_fd != -1) {
+        dup2(out_fd, STDOUT_FILENO);
+    } else if (is_bg) {
+        dup2(dev_null(), STDOUT_FILENO);
+    }
+    // No exec follows, so O_CLOEXEC does not help: drop the other pipe
+    // ends explicitly or readers downstream would never see EOF
+    close_range(3, ~0U, 0);
+
+    if (strcmp(cmd->argv[0], "cat") == 0) {
+        ssize_t n;
+        bool moved = false;
+        while ((n = splice(STDIN_FILENO, NULL, STDOUT_FILENO, NULL, 1 << 16,
+                           SPLICE_F_MOVE | SPLICE_F_MORE)) > 0) {
+            moved = true;
+        }
+        if (n == -1 && errno == EINVAL && !moved) {
+            copy_stage();
+        }
+        exit(n == 0 ? 0 : 1);
+    }
+
+    int fileFD = open(cmd->argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fileFD == -1) {
+        perror(cmd->argv[1]);
+        exit(1);
+    }
+    ssize_t n;
+    while ((n = tee(STDIN_FILENO, STDOUT_FILENO, 1 << 16, 0)) > 0) {
+        // tee() only copied the pages, consume the same amount from stdin
+        while (n > 0) {
+            ssize_t moved = splice(STDIN_FILENO, NULL, fileFD, NULL, n,
+                                   SPLICE_F_MOVE);
+            if (moved <= 0) {
+                perror(cmd->argv[1]);
+                exit(1);
+            }
+            n -= moved;
+        }
+    }
+    exit(n == 0 ? 0 : 1);
+}
+
+/**
+ * @brief       Serializes a launch request for the zygote helper.
+ * 
+ * @param buf    Buffer of ZYGOTE_MSG_MAX bytes.
+ * @param cmd    The command to launch.
+ * @param is_bg  Whether the command runs in the background.
+ * @param in_fd  Pipe to read stdin from, or -1.
+ * @param out_fd Pipe to write stdout to, or -1.
+ * @return size_t 
+ *               The message size, or 0 if it does not fit.
+ */
+size_t pack_zygote_request(char *buf, struct command_line *cmd, bool is_bg,
+                           int in_fd, int out_fd)
+{
+    struct zygote_request *req = (struct zygote_request *) buf;
+    size_t len = sizeof(*req);
+    char cwd[PATH_MAX];
+
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        return 0;
+    }
+    memset(req, 0, sizeof(*req));
+    req->argc = cmd->argc;
+    req->pgid = launch_pgid;
+    req->is_bg = is_bg;
+    req->has_input = cmd->input_file != NULL;
+    req->has_output = cmd->output_file != NULL;
+    req->has_error = cmd->error_file != NULL;
+    req->append_output = cmd->append_output;
+    req->append_error = cmd->append_error;
+    req->merge_error = cmd->merge_error;
+    req->has_in_fd = in_fd != -1;
+    req->has_out_fd = out_fd != -1;
+
+    // Strings in the order the helper unpacks them
+    const char *files[] = { cmd->input_file, cmd->output_file, cmd->error_file, cwd };
+    for (int i = 0; i < cmd->argc + 4; i++) {
+        const char *str = i < cmd->argc ? cmd->argv[i] : files[i - cmd->argc];
+        if (str == NULL) {
+            continue;
+        }
+        size_t n = strlen(str) + 1;
+        if (len + n > ZYGOTE_MSG_MAX) {
+            return 0;
+        }
+        memcpy(buf + len, str, n);
+        len += n;
+    }
+    for (char **env = environ; *env != NULL; env++) {
+        size_t n = strlen(*env) + 1;
+        if (len + n > ZYGOTE_MSG_MAX) {
+            return 0;
+        }
+        memcpy(buf + len, *env, n);
+        len += n;
+        req->nenv++;
+    }
+    return len;
+}
+
+/**
+ * @brief       Child side of a zygote launch. Rebuilds the command from
+ *              the request and runs it through the same child code as the
+ *              fork path.
+ * 
+ * @param req   The request.
+ * @param len   Size of the request in bytes.
+ * @param fds   Received descriptors: stdin, stdout, stderr, then the
+ *              optional pipes.
+ */
+void zygote_child(struct zygote_request *req, size_t len, int *fds)
+{
+    struct command_line cmd = { 0 };
+    char *p = (char *) (req + 1);
+    char *end = (char *) req + len;
+
+    sigset_t no_signals;
+    sigemptyset(&no_signals);
+    sigprocmask(SIG_SETMASK, &no_signals, NULL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+
+    for (int i = 0; i < 3; i++) {
+        dup2(fds[i], i);
+    }
+    int in_fd = req->has_in_fd ? fds[3] : -1;
+    int out_fd = req->has_out_fd ? fds[3 + req->has_in_fd] : -1;
+
+    cmd.argv = malloc((req->argc + 1) * sizeof(char *));
+    if (cmd.argv == NULL) {
+        perror("malloc");
+        _exit(1);
+    }
+    for (uint32_t i = 0; i < req->argc && p < end; i++) {
+        cmd.argv[cmd.argc++] = p;
+        p += strlen(p) + 1;
+    }
+    cmd.argv[cmd.argc] = NULL;
+    if (req->has_input) {
+        cmd.input_file = p;
+        p += strlen(p) + 1;
+    }
+    if (req->has_output) {
+        cmd.output_file = p;
+        p += strlen(p) + 1;
+    }
+    if (req->has_error) {
+        cmd.error_file = p;
+        p += strlen(p) + 1;
+    }
+    cmd.append_output = req->append_output;
+    cmd.append_error = req->append_error;
+    cmd.merge_error = req->merge_error;
+    if (chdir(p) == -1) {
+        perror(p);
+    }
+    p += strlen(p) + 1;
+
+    char **env = malloc((req->nenv + 1) * sizeof(char *));
+    if (env != NULL) {
+        for (uint32_t i = 0; i < req->nenv && p < end; i++) {
+            env[i] = p;
+            p += strlen(p) + 1;
+        }
+        env[req->nenv] = NULL;
+        environ = env;
+    }
+
+    if (req->is_bg) {
+        exec_background_child(&cmd, in_fd, out_fd);
+    } else {
+        exec_foreground_child(&cmd, in_fd, out_fd);
+    }
+}
+
+/**
+ * @brief       Main loop of the zygote helper. Forks a child for every
+ *              request, answers with its pid, and reports its exit status
+ *              and resource usage once it has been reaped. Exits when the
+ *              shell closes the socket.
+ * 
+ * @param sock  The helper's end of the socket pair.
+ */
+void zygote_main(int sock)
+{
+    helper_ignore_terminal_signals();
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    char *buf = malloc(ZYGOTE_MSG_MAX);
+    if (buf == NULL || sig_fd == -1) {
+        _exit(1);
+    }
+    struct pollfd fds[2] = {
+        { .fd = sock,   .events = POLLIN },
+        { .fd = sig_fd, .events = POLLIN },
+    };
+
+    while (true) {
+        if (poll(fds, 2, -1) == -1) {
+            continue;
+        }
+        if (fds[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            struct zygote_reply reply = { .type = ZYGOTE_EXITED };
+            while (read(sig_fd, &info, sizeof(info)) == sizeof(info)) {
+            }
+            while ((reply.pid = wait4(-1, &reply.status, WNOHANG, &reply.usage)) > 0) {
+                send(sock, &reply, sizeof(reply), MSG_NOSIGNAL);
+            }
+        }
+        if (fds[0].revents == 0) {
+            continue;
+        }
+
+        union {
+            char data[CMSG_SPACE(5 * sizeof(int))];
+            struct cmsghdr align;
+        } control;
+        struct iovec iov = { .iov_base = buf, .iov_len = ZYGOTE_MSG_MAX };
+        struct msghdr msg = {
+            .msg_iov = &iov, .msg_iovlen = 1,
+            .msg_control = control.data, .msg_controllen = sizeof(control.data),
+        };
+        ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n <= 0) {
+            // the shell is gone
+            _exit(0);
+        }
+
+        int recv_fds[5];
+        int nfds = 0;
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS) {
+            nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(recv_fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+        }
+
+        struct zygote_reply reply = { .type = ZYGOTE_STARTED };
+        if ((size_t) n < sizeof(struct zygote_request) || nfds < 3) {
+            reply.pid = -1;
+            reply.status = EINVAL;
+        } else {
+            struct zygote_request *req = (struct zygote_request *) buf;
+            reply.pid = fork();
+            if (reply.pid == 0) {
+                if (req->pgid != -1) {
+                    setpgid(0, req->pgid);
+                }
+                zygote_child(req, n, recv_fds);
+            }
+            reply.status = reply.pid == -1 ? errno : 0;
+            // on both sides of the fork, as launch_process() does
+            if (reply.pid > 0 && req->pgid != -1) {
+                setpgid(reply.pid, req->pgid != 0 ? req->pgid : reply.pid);
+            }
+        }
+        for (int i = 0; i < nfds; i++) {
+            close(recv_fds[i]);
+        }
+        send(sock, &reply, sizeof(reply), MSG_NOSIGNAL);
+    }
+}
+
+/**
+ * @brief       Starts the zygote helper if SMALLSH_ZYGOTE is set and job
+ *              control is off. This runs early in main, while the shell is
+ *              still small, so the helper's own forks stay cheap for the
+ *              life of the shell.
+ */
+void init_zygote()
+{
+    // The helper's children could not be stopped and resumed as jobs
+    if (getenv("SMALLSH_ZYGOTE") == NULL || job_control) {
+        return;
+    }
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("socketpair");
+        return;
+    }
+    int bufsize = ZYGOTE_MSG_MAX + 4096;
+    for (int i = 0; i < 2; i++) {
+        setsockopt(sv[i], SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+        setsockopt(sv[i], SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork()");
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        zygote_main(sv[1]);
+    }
+    close(sv[1]);
+    zygote.fd = sv[0];
+    zygote.pid = pid;
+}
+
+/**
+ * @brief       Turns zygote mode off after the helper went away. Launches
+ *              fall back to the spawn and fork paths.
+ */
+void close_zygote()
+{
+    if (zygote.fd != -1) {
+        close(zygote.fd);
+        zygote.fd = -1;
+    }
+}
+
+/**
+ * @brief       Handles an exit reported by the zygote. Background jobs go
+ *              through the job table like any reaped child; exits of
+ *              foreground processes are kept until zygote_wait asks.
+ * 
+ * @param reply The EXITED reply.
+ * @return bool True if a background job was reported.
+ */
+bool zygote_exited(const struct zygote_reply *reply)
+{
+    if (find_job(reply->pid) != NULL) {
+        return handle_exited_child(reply->pid, reply->status, &reply->usage);
+    }
+    if (zygote.nstash == zygote.stash_cap) {
+        int cap = zygote.stash_cap ? zygote.stash_cap * 2 : 8;
+        struct zygote_reply *stash = realloc(zygote.stash, cap * sizeof(*stash));
+        if (stash == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        zygote.stash = stash;
+        zygote.stash_cap = cap;
+    }
+    zygote.stash[zygote.nstash++] = *reply;
+    return false;
+}
+
+/**
+ * @brief       Reads one reply from the zygote.
+ * 
+ * @param reply Receives the reply.
+ * @param flags recv flags, e.g. MSG_DONTWAIT.
+ * @return bool True if a reply was read.
+ */
+bool read_zygote_reply(struct zygote_reply *reply, int flags)
+{
+    while (true) {
+        ssize_t n = recv(zygote.fd, reply, sizeof(*reply), flags);
+        if (n == sizeof(*reply)) {
+            return true;
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == 0 || (n == -1 && errno != EAGAIN)) {
+            close_zygote();
+        }
+        return false;
+    }
+}
+
+/**
+ * @brief       Passes stashed exits to the jobs they belong to. A stage of a
+ *              background pipeline can exit while zygote_launch() waits to
+ *              start the next one, before the job is in the table, and is
+ *              stashed like a foreground exit until then.
+ * 
+ * @return int  The number of background jobs reported.
+ */
+int replay_zygote_stash()
+{
+    int reported = 0;
+    for (int i = 0; i < zygote.nstash; ) {
+        struct zygote_reply reply = zygote.stash[i];
+        if (find_job(reply.pid) == NULL) {
+            i++;
+            continue;
+        }
+        zygote.stash[i] = zygote.stash[--zygote.nstash];
+        if (handle_exited_child(reply.pid, reply.status, &reply.usage)) {
+            reported++;
+        }
+    }
+    return reported;
+}
+
+/**
+ * @brief       Processes every exit the zygote has reported so far,
+ *              without blocking.
+ * 
+ * @return int  The number of background jobs reported.
+ */
+int drain_zygote()
+{
+    struct zygote_reply reply;
+    int reported = replay_zygote_stash();
+    while (zygote.fd != -1 && read_zygote_reply(&reply, MSG_DONTWAIT)) {
+        if (reply.type == ZYGOTE_EXITED && zygote_exited(&reply)) {
+            reported++;
+        }
+    }
+    return reported;
+}
+
+/**
+ * @brief       Launches a command through the zygote helper. The shell's
+ *              standard streams and any pipes are passed with SCM_RIGHTS,
+ *              so the shell itself never forks.
+ * 
+ * @param cmd    The command to launch.
+ * @param is_bg  Whether the command runs in the background.
+ * @param in_fd  Pipe to read stdin from, or -1.
+ * @param out_fd Pipe to write stdout to, or -1.
+ * @return pid_t 
+ *               The child pid, or -1 if the zygote could not launch it.
+ */
+pid_t zygote_launch(struct command_line *cmd, bool is_bg, int in_fd, int out_fd)
+{
+    static char *buf = NULL;
+    if (buf == NULL && (buf = malloc(ZYGOTE_MSG_MAX)) == NULL) {
+        return -1;
+    }
+    size_t len = pack_zygote_request(buf, cmd, is_bg, in_fd, out_fd);
+    if (len == 0) {
+        return -1;
+    }
+
+    int fds[5] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    int nfds = 3;
+    if (in_fd != -1) {
+        fds[nfds++] = in_fd;
+    }
+    if (out_fd != -1) {
+        fds[nfds++] = out_fd;
+    }
+    union {
+        char data[CMSG_SPACE(5 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control.data, .msg_controllen = CMSG_SPACE(nfds * sizeof(int)),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(zygote.fd, &msg, MSG_NOSIGNAL);
+    } while (sent == -1 && errno == EINTR);
+    if (sent == -1) {
+        if (errno != EMSGSIZE) {
+            close_zygote();
+        }
+        return -1;
+    }
+
+    // Exits of earlier children may be queued ahead of our answer
+    struct zygote_reply reply;
+    while (read_zygote_reply(&reply, 0)) {
+        if (reply.type == ZYGOTE_STARTED) {
+            return reply.pid;
+        }
+        zygote_exited(&reply);
+    }
+    return -1;
+}
+
+/**
+ * @brief       Waits for a foreground process started by the zygote.
+ * 
+ * @param pid       The pid to wait for.
+ * @param status    Receives its wait status.
+ * @param usage     Receives its resource usage.
+ * @return bool     True if the exit was received, false if the helper died.
+ */
+bool zygote_wait(pid_t pid, int *status, struct rusage *usage)
+{
+    struct zygote_reply reply;
+    while (true) {
+        for (int i = 0; i < zygote.nstash; i++) {
+            if (zygote.stash[i].pid == pid) {
+                *status = zygote.stash[i].status;
+                *usage = zygote.stash[i].usage;
+                zygote.stash[i] = zygote.stash[--zygote.nstash];
+                return true;
+            }
+        }
+        if (zygote.fd == -1 || !read_zygote_reply(&reply, 0)) {
+            return false;
+        }
+        if (reply.type == ZYGOTE_EXITED) {
+            zygote_exited(&reply);
+        }
+    }
+}
+
+/**
+ * @brief       Appends bytes to the log helper's output, in blocks that are
+ *              written out together with writev().
+ * 
+ * @param out   The output queue.
+ * @param data  The bytes.
+ * @param len   Their number.
+ */
+static void bglog_append(struct bglog_output *out, const char *data, size_t len)
+{
+    while (len > 0) {
+        struct bglog_block *tail = out->tail;
+        if (tail == NULL || tail->len == BGLOG_BLOCK) {
+            tail = out->spare;
+            if (tail != NULL) {
+                out->spare = NULL;
+            } else if ((tail = malloc(sizeof(struct bglog_block))) == NULL) {
+                _exit(1);
+            }
+            tail->next = NULL;
+            tail->len = tail->sent = 0;
+            if (out->tail != NULL) {
+                out->tail->next = tail;
+            } else {
+                out->head = tail;
+            }
+            out->tail = tail;
+        }
+        size_t n = BGLOG_BLOCK - tail->len < len ? BGLOG_BLOCK - tail->len : len;
+        memcpy(tail->data + tail->len, data, n);
+        tail->len += n;
+        out->pending += n;
+        data += n;
+        len -= n;
+    }
+}
+
+/**
+ * @brief       Adds one line of a job to the log, tagged with the job id,
+ *              e.g. "[3] compiling" or "[3 err] warning".
+ * 
+ * @param out   The output queue.
+ * @param s     The stream the line came from.
+ * @param a     The line, or its first part.
+ * @param alen  Length of a.
+ * @param b     The rest of the line, or NULL.
+ * @param blen  Length of b.
+ */
+static void bglog_line(struct bglog_output *out, const struct bglog_stream *s,
+                       const char *a, size_t alen, const char *b, size_t blen)
+{
+    char tag[32];
+    int n = snprintf(tag, sizeof(tag), s->err ? "[%d err] " : "[%d] ", s->job);
+    bglog_append(out, tag, n);
+    bglog_append(out, a, alen);
+    if (b != NULL) {
+        bglog_append(out, b, blen);
+    }
+    bglog_append(out, "\n", 1);
+}
+
+/**
+ * @brief       Writes as much of the queued output as the log takes, in
+ *              one writev() of up to BGLOG_IOV blocks per call.
+ * 
+ * @param out   The output queue.
+ * @param fd    The log.
+ * @return bool False if the log would block.
+ */
+static bool bglog_flush(struct bglog_output *out, int fd)
+{
+    while (out->pending > 0) {
+        struct iovec iov[BGLOG_IOV];
+        int n = 0;
+        for (struct bglog_block *b = out->head; b != NULL && n < BGLOG_IOV; b = b->next) {
+            iov[n].iov_base = b->data + b->sent;
+            iov[n].iov_len = b->len - b->sent;
+            n++;
+        }
+        ssize_t written = writev(fd, iov, n);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written == -1 && errno == EAGAIN) {
+            return false;
+        }
+        // Nobody reads the log any more: drop the output, the jobs must
+        // not block on it
+        size_t left = written == -1 ? out->pending : (size_t) written;
+        out->pending -= left;
+        while (out->head != NULL) {
+            struct bglog_block *b = out->head;
+            size_t n = b->len - b->sent < left ? b->len - b->sent : left;
+            b->sent += n;
+            left -= n;
+            if (b->sent < b->len) {
+                break;
+            }
+            if (b == out->tail) {
+                // the last block is reused
+                b->len = b->sent = 0;
+                break;
+            }
+            out->head = b->next;
+            if (out->spare == NULL) {
+                out->spare = b;
+            } else {
+                free(b);
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief       Reads what a job wrote to one of its log pipes and queues
+ *              its complete lines. A partial line waits for the rest, up
+ *              to BGLOG_LINE_MAX bytes; at end of file it is ended.
+ * 
+ * @param out   The output queue.
+ * @param s     The stream.
+ * @return bool False at end of file.
+ */
+static bool bglog_read(struct bglog_output *out, struct bglog_stream *s)
+{
+    char buf[BGLOG_READ];
+    ssize_t n = read(s->fd, buf, sizeof(buf));
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return true;
+    }
+    if (n <= 0) {
+        if (s->partial_len > 0) {
+            bglog_line(out, s, s->partial, s->partial_len, NULL, 0);
+        }
+        return false;
+    }
+
+    char *p = buf, *end = buf + n, *nl;
+    while ((nl = memchr(p, '\n', end - p)) != NULL) {
+        if (s->partial_len > 0) {
+            bglog_line(out, s, s->partial, s->partial_len, p, nl - p);
+            s->partial_len = 0;
+        } else {
+            bglog_line(out, s, p, nl - p, NULL, 0);
+        }
+        p = nl + 1;
+    }
+    while (p < end) {
+        size_t room = BGLOG_LINE_MAX - s->partial_len;
+        size_t take = (size_t) (end - p) < room ? (size_t) (end - p) : room;
+        if (s->partial == NULL && (s->partial = malloc(BGLOG_LINE_MAX)) == NULL) {
+            _exit(1);
+        }
+        memcpy(s->partial + s->partial_len, p, take);
+        s->partial_len += take;
+        p += take;
+        if (s->partial_len == BGLOG_LINE_MAX) {
+            // an overlong line is broken up
+            bglog_line(out, s, s->partial, s->partial_len, NULL, 0);
+            s->partial_len = 0;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief       Takes every job the shell has sent to the log helper and
+ *              starts watching its pipes.
+ * 
+ * @param sock      Socket to the shell.
+ * @param pipes_fd  Epoll set of the pipes.
+ * @param t         The helper's streams.
+ * @return bool     False once the shell is gone.
+ */
+static bool bglog_receive(int sock, int pipes_fd, struct bglog_table *t)
+{
+    while (true) {
+        int32_t job;
+        union {
+            char data[CMSG_SPACE(2 * sizeof(int))];
+            struct cmsghdr align;
+        } control;
+        struct iovec iov = { .iov_base = &job, .iov_len = sizeof(job) };
+        struct msghdr msg = {
+            .msg_iov = &iov, .msg_iovlen = 1,
+            .msg_control = control.data, .msg_controllen = sizeof(control.data),
+        };
+        ssize_t len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+        if (len == -1 && (errno == EAGAIN || errno == EINTR)) {
+            return true;
+        }
+        if (len <= 0) {
+            return false;
+        }
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (len != sizeof(job) || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        // stdout comes first, then stderr; either may be missing
+        int fds[2];
+        int nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+        for (int f = 0; f < nfds; f++) {
+            if (t->nfree == 0 && t->count == t->capacity) {
+                t->capacity = t->capacity ? t->capacity * 2 : JOB_TABLE_MIN;
+                t->streams = realloc(t->streams, t->capacity * sizeof(*t->streams));
+                t->free_list = realloc(t->free_list, t->capacity * sizeof(int));
+                if (t->streams == NULL || t->free_list == NULL) {
+                    _exit(1);
+                }
+            }
+            int index = t->nfree > 0 ? t->free_list[--t->nfree] : t->count++;
+            struct bglog_stream *s = calloc(1, sizeof(*s));
+            if (s == NULL) {
+                _exit(1);
+            }
+            s->fd = fds[f];
+            s->job = job & BGLOG_JOB_MASK;
+            s->err = (job & BGLOG_ERR_FIRST) || f == 1;
+            fcntl(s->fd, F_SETFL, O_NONBLOCK);
+            t->streams[index] = s;
+            t->open++;
+            struct epoll_event ev = { .events = EPOLLIN, .data.u64 = index };
+            epoll_ctl(pipes_fd, EPOLL_CTL_ADD, s->fd, &ev);
+        }
+    }
+}
+
+/**
+ * @brief       Main loop of the background log helper. The shell sends it
+ *              the read ends of each background job's stdout and stderr
+ *              pipes; it waits on all of them with one epoll set, nested
+ *              in a second set with the shell's socket and the log, so
+ *              reading every pipe can be paused with a single call while
+ *              the log is over BGLOG_OUT_MAX behind. After the shell is
+ *              gone it runs until every pipe is closed and the log is
+ *              written.
+ * 
+ * @param sock  Socket to the shell.
+ * @param log   The log file.
+ */
+void bglog_main(int sock, int log)
+{
+    helper_ignore_terminal_signals();
+    signal(SIGPIPE, SIG_IGN);
+    fcntl(log, F_SETFL, fcntl(log, F_GETFL) | O_NONBLOCK);
+    // thousands of jobs keep two pipes each open here
+    raise_nofile_limit();
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    int pipes_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1 || pipes_fd == -1) {
+        _exit(1);
+    }
+    enum { BGLOG_SHELL, BGLOG_PIPES, BGLOG_LOG };
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = BGLOG_SHELL };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev);
+    ev.data.u64 = BGLOG_PIPES;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pipes_fd, &ev);
+    ev = (struct epoll_event) { .events = 0, .data.u64 = BGLOG_LOG };
+    bool log_watched = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, log, &ev) == 0;
+
+    struct bglog_table table = { 0 };
+    struct bglog_output out = { 0 };
+    bool shell_gone = false, paused = false, blocked = false;
+
+    while (!shell_gone || table.open > 0 || (out.pending > 0 && log_watched)) {
+        struct epoll_event events[BGLOG_EVENTS];
+        int n = epoll_wait(epoll_fd, events, BGLOG_EVENTS, -1);
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.u64 == BGLOG_SHELL) {
+                if (!bglog_receive(sock, pipes_fd, &table)) {
+                    shell_gone = true;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sock, NULL);
+                }
+            } else if (events[i].data.u64 == BGLOG_PIPES) {
+                struct epoll_event ready[BGLOG_EVENTS];
+                int m = epoll_wait(pipes_fd, ready, BGLOG_EVENTS, 0);
+                for (int k = 0; k < m; k++) {
+                    int index = ready[k].data.u64;
+                    struct bglog_stream *s = table.streams[index];
+                    if (!bglog_read(&out, s)) {
+                        // a child that has not exec'd yet may hold the pipe
+                        // too, and with it the epoll registration
+                        epoll_ctl(pipes_fd, EPOLL_CTL_DEL, s->fd, NULL);
+                        close(s->fd);
+                        free(s->partial);
+                        free(s);
+                        table.streams[index] = NULL;
+                        table.free_list[table.nfree++] = index;
+                        table.open--;
+                    }
+                }
+            } else {
+                blocked = false;
+            }
+        }
+
+        // Everything read in this round goes out together
+        if (!blocked && out.pending > 0) {
+            blocked = !bglog_flush(&out, log);
+        }
+        if (log_watched) {
+            ev = (struct epoll_event) { .events = blocked ? EPOLLOUT : 0, .data.u64 = BGLOG_LOG };
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, log, &ev);
+        } else if (blocked) {
+            // a file epoll cannot watch never blocks for long
+            blocked = false;
+        }
+        if (paused != (out.pending > BGLOG_OUT_MAX)) {
+            paused = !paused;
+            ev = (struct epoll_event) { .events = paused ? 0 : EPOLLIN, .data.u64 = BGLOG_PIPES };
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, pipes_fd, &ev);
+        }
+    }
+    _exit(0);
+}
+
+/**
+ * @brief       Starts the background log helper if SMALLSH_BGLOG names a
+ *              file. Output of background jobs that is not redirected is
+ *              then appended to that file, one tagged line at a time,
+ *              instead of going to /dev/null and the terminal.
+ */
+void init_bglog()
+{
+    const char *path = getenv("SMALLSH_BGLOG");
+    if (path == NULL || *path == '\0') {
+        return;
+    }
+    int log = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log == -1) {
+        perror(path);
+        return;
+    }
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("socketpair");
+        close(log);
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork()");
+        close(sv[0]);
+        close(sv[1]);
+        close(log);
+        return;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        bglog_main(sv[1], log);
+    }
+    close(sv[1]);
+    close(log);
+    bglog.fd = sv[0];
+    bglog.pid = pid;
+}
+
+/**
+ * @brief       Creates the log pipes for a background command about to be
+ *              launched: stdout of the last stage unless it is redirected,
+ *              and stderr of every stage unless all of them redirect it.
+ *              The stdout pipe becomes the last stage's output and the
+ *              stderr pipe the shell's stderr for the launch, which
+ *              bglog_attach() undoes.
+ * 
+ * @param cmd   The command.
+ * @param p     Receives the stdout and stderr pipes, -1 if not made.
+ */
+void bglog_pipes(struct command_line *cmd, int p[2][2])
+{
+    p[0][0] = p[0][1] = p[1][0] = p[1][1] = -1;
+    if (bglog.fd == -1) {
+        return;
+    }
+    struct command_line *last = cmd;
+    bool all_err = true;
+    for (struct command_line *stage = cmd; stage; stage = stage->next) {
+        all_err = all_err && (stage->error_file != NULL || stage->merge_error);
+        last = stage;
+    }
+    if (last->output_file == NULL && pipe2(p[0], O_CLOEXEC) == 0) {
+        launch_bg_out = p[0][1];
+    }
+    if (!all_err && pipe2(p[1], O_CLOEXEC) == 0) {
+        fflush(stderr);
+        bglog.saved_err = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 10);
+        dup2(p[1][1], STDERR_FILENO);
+        close(p[1][1]);
+    }
+}
+
+/**
+ * @brief       Hands the log pipes of a launched background job to the
+ *              helper and restores the shell's stderr. The helper reads its
+ *              socket whatever the state of the log, so a send only waits
+ *              for it to catch up with a burst of launches.
+ * 
+ * @param id    The job id.
+ * @param p     The pipes from bglog_pipes().
+ */
+void bglog_attach(int id, int p[2][2])
+{
+    launch_bg_out = -1;
+    if (p[1][0] != -1) {
+        dup2(bglog.saved_err, STDERR_FILENO);
+        close(bglog.saved_err);
+    }
+    int fds[2];
+    int nfds = 0;
+    int32_t job = id;
+    if (p[0][0] != -1) {
+        fds[nfds++] = p[0][0];
+    } else {
+        job |= BGLOG_ERR_FIRST;
+    }
+    if (p[1][0] != -1) {
+        fds[nfds++] = p[1][0];
+    }
+    if (nfds == 0) {
+        return;
+    }
+    union {
+        char data[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = { .iov_base = &job, .iov_len = sizeof(job) };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control.data, .msg_controllen = CMSG_SPACE(nfds * sizeof(int)),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    while (sendmsg(bglog.fd, &msg, MSG_NOSIGNAL) == -1 && errno == EINTR) {
+    }
+    for (int i = 0; i < nfds; i++) {
+        close(fds[i]);
+    }
+}
+
+/**
+ * @brief       Starts a command, preferring the spawn path and falling back
+ *              to fork() whenever the spawn path cannot run it. The fork
+ *              path is also what produces the error messages and exit
+ *              statuses for commands that fail to start.
+ *
+ * @param cmd    The command to launch.
+ * @param is_bg  Whether the command runs in the background.
+ * @param in_fd  Pipe to read stdin from, or -1.
+ * @param out_fd Pipe to write stdout to, or -1.
+ * @return pid_t 
+ *               The pid of the child process.
+ */
+pid_t launch_process(struct command_line *cmd, bool is_bg, int in_fd, int out_fd)
+{
+    bool splice_stage = is_splice_stage(cmd, in_fd, out_fd);
+    // Limits are applied in the child, so only the fork path can honour them
+    bool fork_only = launch_limits != NULL;
+    pid_t childPid;
+
+    if (!splice_stage && !fork_only && zygote.fd != -1) {
+        childPid = zygote_launch(cmd, is_bg, in_fd, out_fd);
+        if (childPid > 0) {
+            launch_stats.zygote++;
+            last_launch_path = TRACE_ZYGOTE;
+            return childPid;
+        }
+    }
+    if (!splice_stage && !fork_only) {
+        childPid = spawn_process(cmd, is_bg, in_fd, out_fd);
+        if (childPid > 0) {
+            last_launch_path = TRACE_SPAWN;
+            return childPid;
+        }
+    }
+
+    // Fork a new process
+    childPid = fork();
+
+    switch(childPid){
+
+        case -1:
+            perror("fork()\n");
+            exit(1);
+            break;
+
+        case 0:
+            if (launch_pgid != -1) {
+                setpgid(0, launch_pgid);
+                if (launch_tty) {
+                    tcsetpgrp(STDIN_FILENO, getpgrp());
+                }
+            }
+            if (job_control) {
+                signal(SIGTTIN, SIG_DFL);
+                signal(SIGTTOU, SIG_DFL);
+            }
+            if (launch_limits != NULL) {
+                apply_limits(launch_limits);
+            }
+            if (splice_stage) {
+                run_splice_stage(cmd, is_bg, in_fd, out_fd);
+            }
+            // The shell keeps SIGCHLD blocked for its signalfd
+            sigset_t no_signals;
+            sigemptyset(&no_signals);
+            sigprocmask(SIG_SETMASK, &no_signals, NULL);
+            if (is_bg) {
+                exec_background_child(cmd, in_fd, out_fd);
+            } else {
+                exec_foreground_child(cmd, in_fd, out_fd);
+            }
+            break;
+
+        default:
+            // Also set in the parent, so the group exists whichever side
+            // runs first
+            if (launch_pgid != -1) {
+                setpgid(childPid, launch_pgid != 0 ? launch_pgid : childPid);
+            }
+            if (splice_stage) {
+                launch_stats.spliced++;
+                last_launch_path = TRACE_SPLICE;
+            } else {
+                launch_stats.forked++;
+                last_launch_path = TRACE_FORK;
+            }
+            break;
+    }
+    return childPid;
+}
+
+/**
+ * @brief       Counts the stages of a pipeline.
+ * 
+ * @param cmd   The first stage.
+ * @return int  The number of stages.
+ */
+int count_stages(struct command_line *cmd)
+{
+    int n = 0;
+    for (; cmd; cmd = cmd->next) {
+        n++;
+    }
+    return n;
+}
+
+/**
+ * @brief       Launches every stage of a pipeline at once, connecting
+ *              neighbouring stages with pipes. Each pipe is created just
+ *              before the stage that writes to it, and the shell closes its
+ *              copies as soon as both sides are running.
+ *
+ *              When tracing is on, the launch is timed and described in
+ *              trace; this only costs vDSO clock reads.
+ *
+ * @param cmd   The first stage of the pipeline.
+ * @param is_bg Whether the pipeline runs in the background.
+ * @param pids  Receives one pid per stage.
+ * @param paths Receives the TRACE_* launch path of each stage.
+ * @param trace Receives the trace data for the launch.
+ */
+void launch_pipeline(struct command_line *cmd, bool is_bg, pid_t *pids,
+                     uint16_t *paths, struct trace_info *trace)
+{
+    int in_fd = -1;
+    int n = 0;
+    struct timespec start, end;
+
+    // Anything the shell printed must appear before the children's output.
+    // Nothing is written if the buffer is empty.
+    fflush(stdout);
+    if (trace_log.header != NULL) {
+        trace_begin(trace, cmd, is_bg);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+    // The first stage starts the job's process group, so a signal to the
+    // group reaches its children too; with job control a foreground job
+    // also takes the terminal
+    launch_pgid = job_control || is_bg ? 0 : -1;
+    launch_tty = job_control && !is_bg;
+    if (metrics != NULL) {
+        __atomic_fetch_add(&metrics->commands[is_bg], 1, __ATOMIC_RELAXED);
+    }
+    for (struct command_line *stage = cmd; stage; stage = stage->next) {
+        int fds[2] = { -1, -1 };
+        struct timespec launch_start;
+        if (stage->next != NULL && pipe2(fds, O_CLOEXEC) == -1) {
+            perror("pipe()");
+            exit(1);
+        }
+        if (metrics != NULL) {
+            clock_gettime(CLOCK_MONOTONIC, &launch_start);
+        }
+        if (stage->next == NULL && launch_bg_out != -1) {
+            // the background log's pipe
+            fds[1] = launch_bg_out;
+        }
+        pids[n++] = launch_process(stage, is_bg, in_fd, fds[1]);
+        if (metrics != NULL) {
+            metrics_launched(&launch_start);
+        }
+        if (launch_pgid != -1) {
+            launch_pgid = pids[0];
+        }
+        if (in_fd != -1) {
+            close(in_fd);
+        }
+        if (fds[1] != -1) {
+            close(fds[1]);
+        }
+        in_fd = fds[0];
+        paths[n - 1] = last_launch_path;
+        trace->flags |= last_launch_path;
+    }
+    launch_pgid = -1;
+    launch_tty = false;
+    if (trace_log.header != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        trace->launch_ns = elapsed_seconds(&start, &end) * 1e9;
+    }
+}
+
+/**
+ * @brief       Builds the text of a command for job listings, e.g.
+ *              "sort data | uniq -c".
+ * 
+ * @param cmd   The first stage of the command.
+ * @return char* 
+ *              The text, allocated with malloc.
+ */
+char *command_text(struct command_line *cmd)
+{
+    size_t len = 1;
+    for (struct command_line *stage = cmd; stage; stage = stage->next) {
+        for (int i = 0; i < stage->argc; i++) {
+            len += strlen(stage->argv[i]) + 3;
+        }
+    }
+    char *text = malloc(len);
+    if (text == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    char *p = text;
+    for (struct command_line *stage = cmd; stage; stage = stage->next) {
+        for (int i = 0; i < stage->argc; i++) {
+            p += sprintf(p, "%s%s", p == text ? "" : " ", stage->argv[i]);
+        }
+        if (stage->next != NULL) {
+            p += sprintf(p, " |");
+        }
+    }
+    *p = '\0';
+    return text;
+}
+
+/**
+ * @brief       Hands the limits of the command being launched to its job,
+ *              which then owns the cgroup and removes it when done.
+ * 
+ * @param job   The job.
+ */
+void take_limits(struct job *job)
+{
+    if (launch_limits != NULL) {
+        job->cgroup = launch_limits->cgroup;
+        job->cpu_limited = launch_limits->cpu != RLIM_INFINITY;
+        launch_limits->cgroup = NULL;
+    }
+}
+
+/**
+ * @brief       Takes the terminal back after a foreground job exited or
+ *              stopped, and restores the shell's terminal modes.
+ */
+void take_terminal()
+{
+    if (job_control) {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+    }
+}
+
+/**
+ * @brief       Waits for a process of the foreground job. With job control
+ *              stops are returned too, except SIGTTIN/SIGTTOU stops: those
+ *              only happen if the job touched the terminal before the shell
+ *              handed it over, so the job is resumed instead. A process
+ *              killed by SIGINT sets fg_interrupted.
+ * 
+ * @param pid       The process to wait for, or -pgid for any of the job.
+ * @param pgid      The job's process group.
+ * @param status    Receives the wait status.
+ * @param usage     Receives the resource usage.
+ * @return pid_t    The process, or -1 on error.
+ */
+pid_t wait_foreground(pid_t pid, pid_t pgid, int *status, struct rusage *usage)
+{
+    int options = job_control ? WUNTRACED : 0;
+    struct pollfd fds = { .fd = sigchld_fd, .events = POLLIN };
+    while (true) {
+        // With jobs in the background, sleep on the signalfd instead, so
+        // their exits are read as they happen
+        bool watch = job_table.count > 0 && sigchld_fd != -1;
+        pid_t result = wait4(pid, status, options | (watch ? WNOHANG : 0), usage);
+        if (result == 0) {
+            if (poll(&fds, 1, -1) == 1) {
+                reap_during_foreground(pid < 0 ? -pid : 0);
+            }
+            continue;
+        }
+        if (result == -1 && errno == EINTR) {
+            continue;
+        }
+        if (result > 0 && WIFSTOPPED(*status)
+                && (WSTOPSIG(*status) == SIGTTIN || WSTOPSIG(*status) == SIGTTOU)) {
+            kill(-pgid, SIGCONT);
+            continue;
+        }
+        if (result > 0 && WIFSIGNALED(*status) && WTERMSIG(*status) == SIGINT) {
+            fg_interrupted = true;
+        }
+        return result;
+    }
+}
+
+/**
+ * @brief       Creates a child process in the foreground. Since it is a 
+ *              foreground process, the parent process waits for the child
+ *              to finish before continuing.
+ * 
+ *              If the command contains input and output redirection, the
+ *              stdin and stdout are redirected. A pipeline is waited on as
+ *              a whole and its status is the status of the last stage.
+ *              Resource usage is collected with wait4 and summed over the
+ *              stages.
+ * 
+ * @param cmd   The command_line struct that contains the data needed to 
+ *              run the command. 
+ * @param timed Print the resource usage when the command is done.
+ */
+void foreground_process(struct command_line *cmd, bool timed)
+{
+    int fgStatus = 0;
+    int nstages = count_stages(cmd);
+    pid_t pids[nstages];
+    uint16_t paths[nstages];
+    struct trace_info trace = { 0 };
+
+    prev_fg_status.has_usage = true;
+    memset(&prev_fg_status.usage, 0, sizeof(prev_fg_status.usage));
+    clock_gettime(CLOCK_MONOTONIC, &prev_fg_status.start);
+    launch_pipeline(cmd, false, pids, paths, &trace);
+    if (job_control) {
+        // in case the spawn path could not do it in the child
+        tcsetpgrp(STDIN_FILENO, pids[0]);
+    }
+
+    // Wait for the termination of every stage
+    for (int i = 0; i < nstages; i++) {
+        struct rusage usage;
+        int stageStatus;
+        pid_t result;
+        if (paths[i] == TRACE_ZYGOTE) {
+            // the zygote is the parent and reports the exit
+            result = zygote_wait(pids[i], &stageStatus, &usage) ? pids[i] : -1;
+            if (result > 0 && WIFSIGNALED(stageStatus) && WTERMSIG(stageStatus) == SIGINT) {
+                fg_interrupted = true;
+            }
+        } else {
+            result = wait_foreground(pids[i], pids[0], &stageStatus, &usage);
+        }
+        if (result == -1) {
+            perror("wait");
+            continue;
+        }
+        if (WIFSTOPPED(stageStatus)) {
+            // Ctrl+Z: the stages that are still around become a stopped job
+            int id = add_bg_job(pids + i, nstages - i);
+            struct job *job = &job_table.slots[id - 1];
+            job->pgid = pids[0];
+            job->stopped = true;
+            job->timed = timed;
+            job->trace = trace;
+            job->start = prev_fg_status.start;
+            job->usage = prev_fg_status.usage;
+            job->command = command_text(cmd);
+            job->has_tmodes = tcgetattr(STDIN_FILENO, &job->tmodes) == 0;
+            take_limits(job);
+            current_job = id;
+            take_terminal();
+            report_job(job, "Stopped");
+            set_exit_status(128 + WSTOPSIG(stageStatus));
+            fflush(stdout);
+            return;
+        }
+        add_rusage(&prev_fg_status.usage, &usage);
+        if (i == nstages - 1) {
+            fgStatus = stageStatus;
+        }
+    }
+    take_terminal();
+    clock_gettime(CLOCK_MONOTONIC, &prev_fg_status.end);
+    set_wait_status(&prev_fg_status, fgStatus);
+    if (launch_limits != NULL) {
+        prev_fg_status.limit = limit_reason(launch_limits->cgroup,
+                                            launch_limits->cpu != RLIM_INFINITY, fgStatus);
+    }
+    trace_command(&trace, pids[nstages - 1], fgStatus,
+                  &prev_fg_status.start, &prev_fg_status.end);
+    if (prev_fg_status.terminated) {
+        print_termination(&prev_fg_status);
+    }
+    if (timed) {
+        print_usage(stdout, &prev_fg_status);
+        fflush(stdout);
+    }
+}
+
+/**
+ * @brief       Creates a child process in the background. Since it is a 
+ *              background process, the parent process does not wait for 
+ *              the child to finish before continuing.
+ * 
+ *              If the command contains input and output redirection, the
+ *              stdin and stdout are redirected, otherwise /dev/null is
+ *              used. A pipeline becomes a single job.
+ * 
+ * @param cmd   The command_line struct that contains the data needed to 
+ *              run the command. 
+ * @param timed Print the resource usage when the job is reaped.
+ */
+void background_process(struct command_line *cmd, bool timed)
+{
+    int nstages = count_stages(cmd);
+    pid_t pids[nstages];
+    uint16_t paths[nstages];
+    struct trace_info trace = { 0 };
+    int log_pipes[2][2];
+
+    bglog_pipes(cmd, log_pipes);
+    launch_pipeline(cmd, true, pids, paths, &trace);
+
+    int id = add_bg_job(pids, nstages);
+    bglog_attach(id, log_pipes);
+    job_table.slots[id - 1].timed = timed;
+    job_table.slots[id - 1].trace = trace;
+    job_table.slots[id - 1].pgid = pids[0];
+    job_table.slots[id - 1].command = command_text(cmd);
+    take_limits(&job_table.slots[id - 1]);
+    current_job = id;
+    if (substitution_depth == 0) {
+        // not part of the output of a $(...)
+        printf("background pid is %d\n", pids[nstages - 1]);
+    }
+    last_bg_pid = pids[nstages - 1];
+    fflush(stdout);
+}
+
+/**
+ * @brief       Builds the command for one parallel input: every `{}` in the
+ *              template is replaced by the input, or the input is appended
+ *              as the last argument if the template has no `{}`. The
+ *              command is allocated from the scratch arena.
+ * 
+ * @param tmpl  Template arguments, NULL terminated.
+ * @param input The input line.
+ * @return struct command_line* 
+ *              The command to launch.
+ */
+struct command_line *parallel_command(char **tmpl, const char *input)
+{
+    struct command_line *cmd = arena_calloc(&scratch_arena, sizeof(struct command_line));
+    size_t input_len = strlen(input);
+    bool substituted = false;
+
+    for (int i = 0; tmpl[i] != NULL; i++) {
+        const char *arg = tmpl[i];
+        const char *hole = strstr(arg, "{}");
+        if (hole == NULL) {
+            add_argument(&scratch_arena, cmd, (char *) arg);
+            continue;
+        }
+        substituted = true;
+
+        // Worst case every other byte starts a {}
+        char *out = arena_alloc(&scratch_arena, strlen(arg) / 2 * input_len + strlen(arg) + 1);
+        char *p = out;
+        while (hole != NULL) {
+            memcpy(p, arg, hole - arg);
+            p += hole - arg;
+            memcpy(p, input, input_len);
+            p += input_len;
+            arg = hole + 2;
+            hole = strstr(arg, "{}");
+        }
+        strcpy(p, arg);
+        add_argument(&scratch_arena, cmd, out);
+    }
+    if (!substituted) {
+        add_argument(&scratch_arena, cmd, (char *) input);
+    }
+    return cmd;
+}
+
+/**
+ * @brief       Returns the next input for the parallel built-in.
+ * 
+ * @param args  Inputs given after :::, or NULL to use the reader.
+ * @param next  Index of the next argument in args.
+ * @param r     Reader to take input lines from.
+ * @return char* 
+ *              The next input, or NULL when there are no more.
+ */
+char *next_parallel_input(char **args, int *next, struct line_reader *r)
+{
+    if (args != NULL) {
+        return args[*next] ? args[(*next)++] : NULL;
+    }
+    size_t len;
+    char *line;
+    do {
+        line = read_line(r, &len);
+    } while (line != NULL && len == 0);
+    return line;
+}
+
+/**
+ * @brief       Built-in `parallel [-j N] [-a FILE] COMMAND [ARGS...]
+ *              [::: INPUTS...]`. Runs COMMAND once per input while keeping
+ *              at most N jobs running (one per online CPU by default).
+ *              Inputs come from the arguments after :::, from FILE, from
+ *              the command's < redirection, or else from the shell's own
+ *              input. Jobs are tracked in the job table, and a new job
+ *              starts as soon as the reaper sees one finish.
+ * 
+ *              Job output goes to the shell's stdout (or the > file) and
+ *              stdin is /dev/null. A throughput summary is printed at the
+ *              end and the status is the number of failed jobs, capped at
+ *              101.
+ * 
+ * @param cmd   The parsed parallel command.
+ */
+void run_parallel(struct command_line *cmd)
+{
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *input_file = cmd->input_file;
+    int i = 1;
+
+    for (; i < cmd->argc && cmd->argv[i][0] == '-'; i++) {
+        if (strcmp(cmd->argv[i], "-j") == 0 && i + 1 < cmd->argc) {
+            jobs = strtol(cmd->argv[++i], NULL, 10);
+        } else if (strcmp(cmd->argv[i], "-a") == 0 && i + 1 < cmd->argc) {
+            input_file = cmd->argv[++i];
+        } else {
+            break;
+        }
+    }
+    if (i >= cmd->argc || strcmp(cmd->argv[i], ":::") == 0 || jobs < 1) {
+        fprintf(stderr, "usage: parallel [-j N] [-a FILE] COMMAND [ARGS...] [::: INPUTS...]\n");
+        set_exit_status(2);
+        return;
+    }
+
+    // Split the template from the ::: inputs
+    char **tmpl = &cmd->argv[i];
+    char **args = NULL;
+    for (int j = i; j < cmd->argc; j++) {
+        if (strcmp(cmd->argv[j], ":::") == 0) {
+            cmd->argv[j] = NULL;
+            args = &cmd->argv[j + 1];
+            break;
+        }
+    }
+
+    struct line_reader file_reader = { .fd = -1 };
+    struct line_reader *reader = &input_reader;
+    bool was_interactive = interactive;
+    if (args == NULL && input_file != NULL) {
+        file_reader.fd = open(input_file, O_RDONLY | O_CLOEXEC);
+        if (file_reader.fd == -1) {
+            printf("cannot open %s for input\n", input_file);
+            set_exit_status(1);
+            return;
+        }
+        reader = &file_reader;
+    }
+
+    int out_fd = -1;
+    if (cmd->output_file != NULL) {
+        out_fd = open(cmd->output_file, output_flags(cmd->append_output) | O_CLOEXEC, 0644);
+        if (out_fd == -1) {
+            perror(cmd->output_file);
+            set_exit_status(1);
+            return;
+        }
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    parallel_state.running = 0;
+    parallel_state.done = 0;
+    parallel_state.failed = 0;
+    unsigned long started = 0;
+    int next_arg = 0;
+    bool inputs_left = true;
+    struct pollfd pfd[2] = {
+        { .fd = sigchld_fd, .events = POLLIN },
+        { .fd = -1,         .events = POLLIN },
+    };
+
+    // The reader must not prompt while it supplies inputs
+    interactive = false;
+    while (inputs_left || parallel_state.running > 0) {
+        while (inputs_left && parallel_state.running < jobs) {
+            char *input = next_parallel_input(args, &next_arg, reader);
+            if (input == NULL) {
+                inputs_left = false;
+                break;
+            }
+            struct command_line *job_cmd = parallel_command(tmpl, input);
+            struct trace_info trace = { 0 };
+            struct timespec launch_start, launch_end;
+            if (trace_log.header != NULL || metrics != NULL) {
+                clock_gettime(CLOCK_MONOTONIC, &launch_start);
+            }
+            if (trace_log.header != NULL) {
+                trace_begin(&trace, job_cmd, false);
+            }
+            pid_t pid = launch_process(job_cmd, false, dev_null(), out_fd);
+            if (metrics != NULL) {
+                __atomic_fetch_add(&metrics->commands[1], 1, __ATOMIC_RELAXED);
+                metrics_launched(&launch_start);
+            }
+            if (trace_log.header != NULL) {
+                clock_gettime(CLOCK_MONOTONIC, &launch_end);
+                trace.launch_ns = elapsed_seconds(&launch_start, &launch_end) * 1e9;
+                trace.flags |= last_launch_path;
+            }
+            arena_reset(&scratch_arena);
+
+            add_bg_process(pid);
+            find_job(pid)->parallel = true;
+            find_job(pid)->trace = trace;
+            parallel_state.running++;
+            started++;
+        }
+        if (parallel_state.running > 0
+                && (parallel_state.running >= jobs || !inputs_left)) {
+            // Sleep until a child exits
+            pfd[1].fd = zygote.fd;
+            if (poll(pfd, 2, -1) == -1 && errno != EINTR) {
+                perror("poll");
+                break;
+            }
+            metrics_watched();
+        }
+        reap_background_processes();
+    }
+    interactive = was_interactive;
+    if (reader == &input_reader && interactive) {
+        // Ctrl+D only ended the inputs, not the shell
+        input_reader.eof = false;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (file_reader.fd != -1) {
+        close(file_reader.fd);
+        free(file_reader.buf);
+    }
+    if (out_fd != -1) {
+        close(out_fd);
+    }
+
+    double elapsed = elapsed_seconds(&start, &end);
+    printf("parallel: %lu jobs, %lu failed, %ld slots, %.3f s, %.1f jobs/s\n",
+           started, parallel_state.failed, jobs, elapsed,
+           elapsed > 0 ? started / elapsed : 0.0);
+    fflush(stdout);
+
+    int failed = parallel_state.failed > 101 ? 101 : (int) parallel_state.failed;
+    set_exit_status(failed);
+}
+
+/**
+ * @brief       Built-in `status [-v]`. Prints how the most recent
+ *              foreground command ended. With -v it also prints its wall
+ *              time and resource usage, followed by the same report for
+ *              the most recently completed background job.
+ * 
+ * @param cmd   The parsed status command.
+ */
+void run_status(struct command_line *cmd)
+{
+    bool verbose = cmd->argc > 1 && strcmp(cmd->argv[1], "-v") == 0;
+
+    // print most recent fg process status
+    if (prev_fg_status.exited) {
+        printf("exit value %d\n", prev_fg_status.code);
+    } else if (prev_fg_status.terminated) {
+        print_termination(&prev_fg_status);
+    } else {
+        printf("exit status 0\n");
+    }
+    if (verbose && prev_fg_status.has_usage) {
+        print_usage(stdout, &prev_fg_status);
+    }
+    if (verbose && prev_bg_pid != 0) {
+        printf("background pid %d: ", prev_bg_pid);
+        if (prev_bg_status.exited) {
+            printf("exit value %d\n", prev_bg_status.code);
+        } else {
+            print_termination(&prev_bg_status);
+        }
+        print_usage(stdout, &prev_bg_status);
+    }
+    fflush(stdout);
+}
+
+/**
+ * @brief       Strips a leading `time` prefix from a command.
+ * 
+ * @param cmd   The command, modified in place.
+ * @return bool True if the command was prefixed with `time`.
+ */
+bool strip_time_prefix(struct command_line *cmd)
+{
+    if (cmd->argc == 0 || strcmp(cmd->argv[0], "time") != 0) {
+        return false;
+    }
+    memmove(cmd->argv, cmd->argv + 1, cmd->argc * sizeof(char *));
+    cmd->argc--;
+    return true;
+}
+
+/**
+ * @brief       Strips a leading `limit` prefix from a command, e.g.
+ *              `limit -m 1G -t 60 make`. Creates the command's cgroup if
+ *              -M or -c is given.
+ * 
+ *              -m SIZE     address space (RLIMIT_AS)
+ *              -t SECONDS  CPU time (RLIMIT_CPU)
+ *              -n FILES    open files (RLIMIT_NOFILE)
+ *              -M SIZE     cgroup memory.max
+ *              -c PERCENT  cgroup cpu.max, in percent of one CPU
+ * 
+ * @param cmd       The command, modified in place.
+ * @param limits    Receives the limits.
+ * @return int      1 if the command had limits, 0 if not, -1 after
+ *                  printing an error.
+ */
+int strip_limit_prefix(struct command_line *cmd, struct command_limits *limits)
+{
+    if (cmd->argc == 0 || strcmp(cmd->argv[0], "limit") != 0) {
+        return 0;
+    }
+    *limits = (struct command_limits) {
+        .as = RLIM_INFINITY, .cpu = RLIM_INFINITY, .nofile = RLIM_INFINITY,
+        .procs_fd = -1,
+    };
+
+    int i = 1;
+    for (; i + 1 < cmd->argc && cmd->argv[i][0] == '-'; i += 2) {
+        const char *opt = cmd->argv[i];
+        const char *arg = cmd->argv[i + 1];
+        unsigned long long value;
+        bool ok = opt[1] != '\0' && opt[2] == '\0';
+        if (ok && (opt[1] == 'm' || opt[1] == 'M')) {
+            ok = parse_size(arg, &value) && value > 0;
+        } else if (ok) {
+            char *end;
+            errno = 0;
+            value = strtoull(arg, &end, 10);
+            ok = end != arg && *end == '\0' && errno == 0 && arg[0] != '-' && value > 0;
+        }
+        switch (ok ? opt[1] : 0) {
+        case 'm': limits->as = value; break;
+        case 't': limits->cpu = value; break;
+        case 'n': limits->nofile = value; break;
+        case 'M': limits->memory_max = value; break;
+        case 'c': ok = value <= 100000; limits->cpu_percent = value; break;
+        default: ok = false; break;
+        }
+        if (!ok) {
+            fprintf(stderr, "limit: %s %s: invalid limit\n", opt, arg);
+            return -1;
+        }
+    }
+    if (i >= cmd->argc) {
+        fprintf(stderr, "limit: usage: limit [-m SIZE] [-t SECONDS] [-n FILES] "
+                "[-M SIZE] [-c PERCENT] command...\n");
+        return -1;
+    }
+    if ((limits->memory_max != 0 || limits->cpu_percent != 0)
+            && create_cgroup(limits) == -1) {
+        return -1;
+    }
+    memmove(cmd->argv, cmd->argv + i, (cmd->argc - i + 1) * sizeof(char *));
+    cmd->argc -= i;
+    return 1;
+}
+
+/**
+ * @brief       Prints the launch path counters to stderr when SMALLSH_DEBUG
+ *              is set in the environment.
+ */
+void report_launch_stats()
+{
+    if (getenv("SMALLSH_DEBUG") == NULL) {
+        return;
+    }
+    fprintf(stderr, "launch: spawn %lu, fork %lu, splice %lu, zygote %lu\n",
+            launch_stats.spawned, launch_stats.forked, launch_stats.spliced,
+            launch_stats.zygote);
+}
+
+/**
+ * @brief       Sends a signal to every process of every tracked job. Jobs
+ *              with their own process group get one kill on the group; the
+ *              others are signalled pid by pid from the index, so the whole
+ *              pass is O(jobs + pids).
+ * 
+ * @param sig   The signal.
+ */
+void signal_all_jobs(int sig)
+{
+    for (int slot = 0; slot < job_table.used; slot++) {
+        struct job *job = &job_table.slots[slot];
+        if (job->pid != 0 && job->pgid != 0) {
+            kill(-job->pgid, sig);
+            if (job->stopped) {
+                kill(-job->pgid, SIGCONT);
+            }
+        }
+    }
+    for (int b = 0; b <= job_table.index_mask; b++) {
+        struct job_index_entry *entry = &job_table.index[b];
+        struct job *job = &job_table.slots[entry->slot];
+        if (entry->pid != 0 && job->pgid == 0) {
+            kill(entry->pid, sig);
+            if (job->stopped) {
+                kill(entry->pid, SIGCONT);
+            }
+        }
+    }
+}
+
+/**
+ * @brief           Reaps jobs until none are left or the deadline passes,
+ *                  sleeping in poll on the SIGCHLD signalfd (and the zygote
+ *                  socket) in between, so every child is waited on at once.
+ * 
+ * @param deadline  Monotonic time to give up at.
+ */
+void reap_until(const struct timespec *deadline)
+{
+    struct pollfd fds[2] = {
+        { .fd = sigchld_fd, .events = POLLIN },
+        { .fd = zygote.fd,  .events = POLLIN },
+    };
+
+    reap_background_processes();
+    while (job_table.count > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long ms = (deadline->tv_sec - now.tv_sec) * 1000
+                  + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+        if (ms <= 0) {
+            return;
+        }
+        fds[1].fd = zygote.fd;
+        if (poll(fds, 2, ms) == -1 && errno != EINTR) {
+            perror("poll");
+            return;
+        }
+        metrics_watched();
+        reap_background_processes();
+    }
+}
+
+/**
+ * @brief           Shuts down every background and stopped job before the
+ *                  shell exits: SIGTERM to all of them, then up to timeout
+ *                  milliseconds for them to exit, then SIGKILL for the rest.
+ *                  Prints a one-line summary if there was anything to stop.
+ * 
+ * @param timeout   Grace period in milliseconds.
+ */
+void shutdown_jobs(long timeout)
+{
+    int total = job_table.count;
+    if (total == 0) {
+        return;
+    }
+    // one summary line instead of a report per job
+    quiet_reports = true;
+    signal_all_jobs(SIGTERM);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    reap_until(&deadline);
+
+    int killed = job_table.count;
+    if (killed > 0) {
+        signal_all_jobs(SIGKILL);
+        // SIGKILL cannot be caught, a second short wait is enough
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += 1;
+        reap_until(&deadline);
+    }
+    fprintf(stderr, "exit: %d job%s terminated", total - killed,
+            total - killed == 1 ? "" : "s");
+    if (killed > 0) {
+        fprintf(stderr, ", %d killed after %ld ms", killed, timeout);
+    }
+    if (job_table.count > 0) {
+        fprintf(stderr, ", %d not reaped", job_table.count);
+    }
+    fprintf(stderr, "\n");
+}
+
+/**
+ * @brief       Reads the shutdown grace period from SMALLSH_EXIT_TIMEOUT, in
+ *              seconds (fractions allowed). Defaults to EXIT_TIMEOUT_MS.
+ * 
+ * @return long The grace period in milliseconds.
+ */
+long exit_timeout()
+{
+    const char *value = getenv("SMALLSH_EXIT_TIMEOUT");
+    if (value != NULL) {
+        char *end;
+        double seconds = strtod(value, &end);
+        if (end != value && *end == '\0' && seconds >= 0) {
+            return (long) (seconds * 1000);
+        }
+        fprintf(stderr, "SMALLSH_EXIT_TIMEOUT: %s: invalid timeout\n", value);
+    }
+    return EXIT_TIMEOUT_MS;
+}
+
+/**
+ * @brief       Built-in `exit [-t SECONDS]`. Stops the remaining jobs with
+ *              shutdown_jobs; `-t` overrides SMALLSH_EXIT_TIMEOUT.
+ * 
+ * @param cmd   The parsed exit command.
+ */
+void run_exit(struct command_line *cmd)
+{
+    if (substitution_depth > 0) {
+        // only the subshell of a $(...) ends
+        fflush(stdout);
+        _exit(0);
+    }
+    long timeout = exit_timeout();
+    if (cmd->argc > 2 && strcmp(cmd->argv[1], "-t") == 0) {
+        char *end;
+        double seconds = strtod(cmd->argv[2], &end);
+        if (end == cmd->argv[2] || *end != '\0' || seconds < 0) {
+            fprintf(stderr, "exit: %s: invalid timeout\n", cmd->argv[2]);
+            set_exit_status(1);
+            return;
+        }
+        timeout = (long) (seconds * 1000);
+    }
+    shutdown_jobs(timeout);
+    history_merge();
+    report_launch_stats();
+    exit(0);
+}
+
+/**
+ * @brief       Built-in `cd`. With no argument, changes to $HOME.
+ * 
+ * @param cmd   The parsed cd command.
+ */
+void run_cd(struct command_line *cmd)
+{
+    if (cmd->argv[1] != NULL) {
+        chdir(cmd->argv[1]);
+    } else {
+        chdir(lookup_variable("HOME", 4));
+    }
+}
+
+/**
+ * @brief       Built-ins `true` and `false`.
+ * 
+ * @param cmd   The parsed command.
+ */
+void run_true(struct command_line *cmd)
+{
+    set_exit_status(cmd->argv[0][0] == 'f');
+}
+
+bool print_escaped(const char *s, bool quote);
+
+/**
+ * @brief       Built-in `echo`. Prints its arguments separated by spaces.
+ *              Leading `-n`, `-e` and `-E` options, alone or run together
+ *              as in `-ne`, suppress the newline and turn backslash
+ *              escapes on and off as they do for /bin/echo.
+ *
+ * @param cmd   The parsed echo command.
+ */
+void run_echo(struct command_line *cmd)
+{
+    int i = 1;
+    bool newline = true;
+    bool escapes = false;
+    for (; i < cmd->argc; i++) {
+        const char *opt = cmd->argv[i];
+        if (opt[0] != '-' || opt[1] == '\0' || opt[strspn(opt + 1, "neE") + 1] != '\0') {
+            break;
+        }
+        for (opt++; *opt != '\0'; opt++) {
+            if (*opt == 'n') {
+                newline = false;
+            } else {
+                escapes = *opt == 'e';
+            }
+        }
+    }
+    for (; i < cmd->argc; i++) {
+        if (!escapes) {
+            fputs(cmd->argv[i], stdout);
+        } else if (!print_escaped(cmd->argv[i], false)) {
+            // \c ends the output, newline and all
+            set_exit_status(0);
+            return;
+        }
+        if (i + 1 < cmd->argc) {
+            putchar(' ');
+        }
+    }
+    if (newline) {
+        putchar('\n');
+    }
+    set_exit_status(0);
+}
+
+/**
+ * @brief       Built-in `pwd`.
+ * 
+ * @param cmd   The parsed pwd command.
+ */
+void run_pwd(struct command_line *cmd)
+{
+    (void) cmd;
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("pwd");
+        set_exit_status(1);
+        return;
+    }
+    puts(cwd);
+    set_exit_status(0);
+}
+
+/**
+ * @brief       Built-in `export`. `NAME=value` sets a variable in the
+ *              environment of the shell and its children; with no
+ *              arguments the environment is listed.
+ * 
+ * @param cmd   The parsed export command.
+ */
+void run_export(struct command_line *cmd)
+{
+    int code = 0;
+    if (cmd->argc == 1) {
+        for (char **env = environ; *env != NULL; env++) {
+            printf("export %s\n", *env);
+        }
+    }
+    for (int i = 1; i < cmd->argc; i++) {
+        char *eq = strchr(cmd->argv[i], '=');
+        size_t len = eq != NULL ? (size_t) (eq - cmd->argv[i]) : strlen(cmd->argv[i]);
+        bool valid = len > 0 && is_name_char(cmd->argv[i][0], true);
+        for (size_t j = 1; valid && j < len; j++) {
+            valid = is_name_char(cmd->argv[i][j], false);
+        }
+        if (!valid) {
+            fprintf(stderr, "export: `%s': not a valid identifier\n", cmd->argv[i]);
+            code = 1;
+        } else if (eq != NULL) {
+            // there are no unexported variables, so NAME alone does nothing
+            *eq = '\0';
+            if (setenv(cmd->argv[i], eq + 1, 1) == -1) {
+                perror("export");
+                code = 1;
+            }
+            *eq = '=';
+        }
+    }
+    invalidate_env_index();
+    set_exit_status(code);
+}
+
+/**
+ * @brief       Evaluates a unary or binary `test` expression.
+ * 
+ * @param argc  Number of operands, 1 to 3.
+ * @param argv  The operands.
+ * @return int  0 if true, 1 if false, 2 on a usage error.
+ */
+int eval_test(int argc, char **argv)
+{
+    if (argc == 0) {
+        return 1;
+    }
+    if (strcmp(argv[0], "!") == 0) {
+        int result = eval_test(argc - 1, argv + 1);
+        return result == 2 ? 2 : !result;
+    }
+    if (argc == 1) {
+        return argv[0][0] == '\0';
+    }
+
+    if (argc == 2 && argv[0][0] == '-' && argv[0][1] != '\0' && argv[0][2] == '\0') {
+        struct stat st;
+        const char *arg = argv[1];
+        switch (argv[0][1]) {
+        case 'n': return arg[0] == '\0';
+        case 'z': return arg[0] != '\0';
+        case 'e': return stat(arg, &st) != 0;
+        case 'f': return stat(arg, &st) != 0 || !S_ISREG(st.st_mode);
+        case 'd': return stat(arg, &st) != 0 || !S_ISDIR(st.st_mode);
+        case 's': return stat(arg, &st) != 0 || st.st_size == 0;
+        case 'h':
+        case 'L': return lstat(arg, &st) != 0 || !S_ISLNK(st.st_mode);
+        case 'p': return stat(arg, &st) != 0 || !S_ISFIFO(st.st_mode);
+        case 'S': return stat(arg, &st) != 0 || !S_ISSOCK(st.st_mode);
+        case 'b': return stat(arg, &st) != 0 || !S_ISBLK(st.st_mode);
+        case 'c': return stat(arg, &st) != 0 || !S_ISCHR(st.st_mode);
+        case 'u': return stat(arg, &st) != 0 || !(st.st_mode & S_ISUID);
+        case 'g': return stat(arg, &st) != 0 || !(st.st_mode & S_ISGID);
+        case 'k': return stat(arg, &st) != 0 || !(st.st_mode & S_ISVTX);
+        case 'O': return stat(arg, &st) != 0 || st.st_uid != geteuid();
+        case 'G': return stat(arg, &st) != 0 || st.st_gid != getegid();
+        case 'r': return access(arg, R_OK) != 0;
+        case 'w': return access(arg, W_OK) != 0;
+        case 'x': return access(arg, X_OK) != 0;
+        case 't': return !isatty(atoi(arg));
+        }
+    }
+
+    if (argc == 3) {
+        const char *op = argv[1];
+        if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+            return strcmp(argv[0], argv[2]) != 0;
+        }
+        if (strcmp(op, "!=") == 0) {
+            return strcmp(argv[0], argv[2]) == 0;
+        }
+        if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+            // a file that does not exist is older than one that does
+            struct stat a, b;
+            bool has_a = stat(argv[0], &a) == 0;
+            bool has_b = stat(argv[2], &b) == 0;
+            if (op[1] == 'e') {
+                return !(has_a && has_b && a.st_dev == b.st_dev && a.st_ino == b.st_ino);
+            }
+            int order = has_a - has_b;
+            if (has_a && has_b && a.st_mtim.tv_sec != b.st_mtim.tv_sec) {
+                order = a.st_mtim.tv_sec > b.st_mtim.tv_sec ? 1 : -1;
+            } else if (has_a && has_b) {
+                order = (a.st_mtim.tv_nsec > b.st_mtim.tv_nsec)
+                        - (a.st_mtim.tv_nsec < b.st_mtim.tv_nsec);
+            }
+            return op[1] == 'n' ? order <= 0 : order >= 0;
+        }
+        static const char *ops[] = { "-eq", "-ne", "-lt", "-le", "-gt", "-ge" };
+        for (int i = 0; i < 6; i++) {
+            if (strcmp(op, ops[i]) != 0) {
+                continue;
+            }
+            char *end1, *end2;
+            long a = strtol(argv[0], &end1, 10);
+            long b = strtol(argv[2], &end2, 10);
+            if (argv[0][0] == '\0' || *end1 != '\0' || argv[2][0] == '\0' || *end2 != '\0') {
+                fprintf(stderr, "test: integer expression expected\n");
+                return 2;
+            }
+            bool results[] = { a == b, a != b, a < b, a <= b, a > b, a >= b };
+            return !results[i];
+        }
+    }
+    fprintf(stderr, "test: unsupported expression\n");
+    return 2;
+}
+
+/**
+ * @brief       Tells whether eval_test() understands an expression: one
+ *              to three operands after any leading `!`, with a unary or
+ *              binary operator it knows. `-a`, `-o`, parentheses and
+ *              longer expressions are left to the test program.
+ *
+ * @param cmd   The parsed test or [ command.
+ * @return bool True if run_test() gives the answer the program would.
+ */
+bool test_supported(const struct command_line *cmd)
+{
+    static const char *const binary[] = {
+        "=", "==", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef",
+    };
+    int argc = cmd->argc - 1;
+    char **argv = cmd->argv + 1;
+    if (cmd->argv[0][0] == '[') {
+        if (argc == 0 || strcmp(argv[argc - 1], "]") != 0) {
+            // run_test() reports it
+            return true;
+        }
+        argc--;
+    }
+    for (; argc > 0 && strcmp(argv[0], "!") == 0; argc--, argv++) {
+    }
+    if (argc <= 1) {
+        return true;
+    }
+    if (argc == 2) {
+        return argv[0][0] == '-' && argv[0][1] != '\0' && argv[0][2] == '\0'
+               && strchr("nzefdshLpSbcugkOGrwxt", argv[0][1]) != NULL;
+    }
+    for (size_t i = 0; argc == 3 && i < sizeof(binary) / sizeof(binary[0]); i++) {
+        if (strcmp(argv[1], binary[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief       Built-ins `test` and `[`. Supports string tests, integer
+ *              comparisons, the file tests and `!`; test_supported()
+ *              sends anything else to the program.
+ *
+ * @param cmd   The parsed test command.
+ */
+void run_test(struct command_line *cmd)
+{
+    int argc = cmd->argc - 1;
+    if (cmd->argv[0][0] == '[') {
+        if (argc == 0 || strcmp(cmd->argv[argc], "]") != 0) {
+            fprintf(stderr, "[: missing `]'\n");
+            set_exit_status(2);
+            return;
+        }
+        argc--;
+    }
+    set_exit_status(eval_test(argc, cmd->argv + 1));
+}
+
+/**
+ * @brief       Value of a digit in base 8 or 16.
+ * 
+ * @param c     The character.
+ * @param base  8 or 16.
+ * @return int  The value, or -1 if c is not a digit of the base.
+ */
+int digit_value(char c, int base)
+{
+    int lower = c | 0x20;
+    if (c >= '0' && c <= (base == 16 ? '9' : '7')) {
+        return c - '0';
+    }
+    if (base == 16 && lower >= 'a' && lower <= 'f') {
+        return lower - 'a' + 10;
+    }
+    return -1;
+}
+
+/**
+ * @brief       Prints one backslash escape. An octal escape is up to 3
+ *              digits; in a `%b` argument or for `echo -e` it may also
+ *              start with a 0 that does not count, as for the programs.
+ * 
+ * @param p         Points at the backslash.
+ * @param argument  Whether p is in a `%b` argument or an echo operand
+ *                  rather than in a format.
+ * @param quote     Whether `\"` is a quote, as it is for printf.
+ * @return const char* 
+ *              The rest of the string, or NULL after `\c`, which ends
+ *              the output.
+ */
+const char *print_escape(const char *p, bool argument, bool quote)
+{
+    static const char from[] = "abefnrtv\\\"";
+    static const char to[] = "\a\b\033\f\n\r\t\v\\\"";
+    const char *hit = p[1] != '\0' && (p[1] != '"' || quote) ? strchr(from, p[1]) : NULL;
+    if (hit != NULL) {
+        putchar(to[hit - from]);
+        return p + 2;
+    }
+    if (p[1] == 'c') {
+        return NULL;
+    }
+
+    // \xHH, \NNN or \0NNN
+    const char *q = p + 1;
+    int base = *q == 'x' ? 16 : 8;
+    bool zero = argument && *q == '0';
+    if (base == 16 || zero) {
+        q++;
+    }
+    int value = 0;
+    int n = 0;
+    for (int digit; n < (base == 16 ? 2 : 3) && (digit = digit_value(*q, base)) != -1; n++, q++) {
+        value = value * base + digit;
+    }
+    if (n == 0 && !zero) {
+        putchar('\\');
+        return p + 1;
+    }
+    putchar(value);
+    return q;
+}
+
+/**
+ * @brief       Prints a string, expanding backslash escapes the way `%b`
+ *              and `echo -e` do.
+ * 
+ * @param s     The string.
+ * @param quote Whether `\"` is a quote.
+ * @return bool False if a `\c` ended the output.
+ */
+bool print_escaped(const char *s, bool quote)
+{
+    while (*s != '\0') {
+        if (*s != '\\') {
+            putchar(*s++);
+        } else if ((s = print_escape(s, true, quote)) == NULL) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief       Tells whether run_printf() understands a format: only the
+ *              conversions it lists, without `*` widths, `%N$` or length
+ *              modifiers, a bare `%b`, and escapes other than `\u`, `\U`
+ *              and a `\x` without digits. Anything else is left to the
+ *              printf program.
+ * 
+ * @param cmd   The parsed printf command.
+ * @return bool True if run_printf() prints what the program would.
+ */
+bool printf_supported(const struct command_line *cmd)
+{
+    int f = cmd->argc > 1 && strcmp(cmd->argv[1], "--") == 0 ? 2 : 1;
+    if (f >= cmd->argc) {
+        // run_printf() reports it
+        return true;
+    }
+    for (const char *p = cmd->argv[f]; *p != '\0'; ) {
+        if (*p == '\\') {
+            if (p[1] == 'u' || p[1] == 'U' || (p[1] == 'x' && digit_value(p[2], 16) == -1)) {
+                return false;
+            }
+            p += p[1] != '\0' ? 2 : 1;
+        } else if (*p == '%' && p[1] == '%') {
+            p += 2;
+        } else if (*p == '%') {
+            size_t n = strspn(p + 1, "-+ #0123456789.") + 1;
+            if (p[n] == '\0' || n + 3 > 32 || strchr("sbcdiuoxXfFeEgGaA", p[n]) == NULL
+                    || (p[n] == 'b' && n > 1)) {
+                return false;
+            }
+            p += n + 1;
+        } else {
+            p++;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief       Built-in `printf`. Handles %s %b %c %d %i %u %o %x %X %f
+ *              %F %e %E %g %G %a %A and %% with flags, width and precision,
+ *              and the backslash escapes; printf_supported() sends other
+ *              formats to the program. The format is reused until the
+ *              arguments run out.
+ * 
+ * @param cmd   The parsed printf command.
+ */
+void run_printf(struct command_line *cmd)
+{
+    // the program takes -- before the format
+    int f = cmd->argc > 1 && strcmp(cmd->argv[1], "--") == 0 ? 2 : 1;
+    if (cmd->argc <= f) {
+        fprintf(stderr, "printf: usage: printf FORMAT [ARGUMENTS...]\n");
+        set_exit_status(2);
+        return;
+    }
+    const char *format = cmd->argv[f];
+    int next = f + 1;
+    int code = 0;
+    do {
+        int first = next;
+        for (const char *p = format; *p != '\0'; ) {
+            if (*p == '\\') {
+                if ((p = print_escape(p, false, true)) == NULL) {
+                    // \c ends the output
+                    set_exit_status(code);
+                    return;
+                }
+                continue;
+            }
+            if (*p != '%') {
+                putchar(*p++);
+                continue;
+            }
+            if (p[1] == '%') {
+                putchar('%');
+                p += 2;
+                continue;
+            }
+
+            // Copy the conversion spec, leaving room for an 'l' or 'L'
+            char spec[32];
+            size_t n = strspn(p + 1, "-+ #0123456789.") + 1;
+            char conv = p[n];
+            if (conv == '\0' || n + 3 > sizeof(spec) || strchr("sbcdiuoxXfFeEgGaA", conv) == NULL) {
+                fprintf(stderr, "printf: invalid format\n");
+                set_exit_status(1);
+                return;
+            }
+            memcpy(spec, p, n);
+            p += n + 1;
+            const char *arg = next < cmd->argc ? cmd->argv[next++] : NULL;
+            // 'c and "c stand for the code of c
+            bool quoted = arg != NULL && (arg[0] == '\'' || arg[0] == '"');
+
+            if (conv == 'b') {
+                if (arg != NULL && !print_escaped(arg, true)) {
+                    set_exit_status(code);
+                    return;
+                }
+            } else if (conv == 's') {
+                spec[n] = 's';
+                spec[n + 1] = '\0';
+                printf(spec, arg != NULL ? arg : "");
+            } else if (conv == 'c') {
+                spec[n] = 'c';
+                spec[n + 1] = '\0';
+                printf(spec, arg != NULL ? arg[0] : '\0');
+            } else if (strchr("fFeEgGaA", conv) != NULL) {
+                char *end = NULL;
+                long double value = 0;
+                if (quoted) {
+                    value = (unsigned char) arg[1];
+                } else if (arg != NULL) {
+                    errno = 0;
+                    value = strtold(arg, &end);
+                    if (*end != '\0' || errno != 0) {
+                        fprintf(stderr, "printf: %s: invalid number\n", arg);
+                        code = 1;
+                    }
+                }
+                spec[n] = 'L';
+                spec[n + 1] = conv;
+                spec[n + 2] = '\0';
+                printf(spec, value);
+            } else {
+                char *end = NULL;
+                long value = 0;
+                if (quoted) {
+                    value = (unsigned char) arg[1];
+                } else if (arg != NULL) {
+                    errno = 0;
+                    value = strtol(arg, &end, 0);
+                    if (*end != '\0' || errno != 0) {
+                        fprintf(stderr, "printf: %s: invalid number\n", arg);
+                        code = 1;
+                    }
+                }
+                spec[n] = 'l';
+                spec[n + 1] = conv;
+                spec[n + 2] = '\0';
+                if (conv == 'd' || conv == 'i') {
+                    printf(spec, value);
+                } else {
+                    printf(spec, (unsigned long) value);
+                }
+            }
+        }
+        // Stop if the format consumed nothing
+        if (next == first) {
+            break;
+        }
+    } while (next < cmd->argc);
+    set_exit_status(code);
+}
+
+/**
+ * @brief       Finds the job a `%N` argument names. With no argument, `%`,
+ *              `%%` or `%+`, this is the current job: the one most recently
+ *              stopped or started in the background, or else the newest.
+ * 
+ * @param spec      The argument, or NULL.
+ * @param builtin   Name of the calling built-in, for messages.
+ * @return struct job* 
+ *              The job, or NULL after printing an error.
+ */
+struct job *parse_job_spec(const char *spec, const char *builtin)
+{
+    bool current = spec == NULL || strcmp(spec, "%") == 0
+                   || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0;
+    int id = current_job;
+    if (!current) {
+        char *end;
+        const char *digits = spec[0] == '%' ? spec + 1 : spec;
+        id = strtol(digits, &end, 10);
+        if (end == digits || *end != '\0') {
+            id = 0;
+        }
+    }
+
+    struct job *job = NULL;
+    if (id >= 1 && id <= job_table.used) {
+        job = &job_table.slots[id - 1];
+    }
+    if ((job == NULL || job->pid == 0 || job->parallel) && current) {
+        job = NULL;
+        for (int slot = job_table.used - 1; slot >= 0 && job == NULL; slot--) {
+            struct job *j = &job_table.slots[slot];
+            if (j->pid != 0 && !j->parallel) {
+                job = j;
+            }
+        }
+    }
+    if (job == NULL || job->pid == 0 || job->parallel) {
+        fprintf(stderr, "%s: %s: no such job\n", builtin, current ? "current" : spec);
+        return NULL;
+    }
+    return job;
+}
+
+/**
+ * @brief       Built-in `jobs`. Lists background and stopped jobs; `-l`
+ *              adds the pid of the last stage.
+ * 
+ * @param cmd   The parsed jobs command.
+ */
+void run_jobs(struct command_line *cmd)
+{
+    bool pids = cmd->argc > 1 && strcmp(cmd->argv[1], "-l") == 0;
+    for (int slot = 0; slot < job_table.used; slot++) {
+        struct job *job = &job_table.slots[slot];
+        if (job->pid == 0 || job->parallel) {
+            continue;
+        }
+        if (pids) {
+            printf("[%d]%c %d %-8s %s\n", job->id, job->id == current_job ? '+' : ' ',
+                   job->pid, job->stopped ? "Stopped" : "Running", job->command);
+        } else {
+            printf("[%d]%c %-8s %s\n", job->id, job->id == current_job ? '+' : ' ',
+                   job->stopped ? "Stopped" : "Running", job->command);
+        }
+    }
+    set_exit_status(0);
+}
+
+/**
+ * @brief       Built-in `fg`. Gives a job the terminal, resumes it if it
+ *              was stopped and waits for it like a foreground command. Its
+ *              status becomes the foreground status.
+ * 
+ * @param cmd   The parsed fg command.
+ */
+void run_fg(struct command_line *cmd)
+{
+    if (!job_control) {
+        fprintf(stderr, "fg: no job control\n");
+        set_exit_status(1);
+        return;
+    }
+    struct job *job = parse_job_spec(cmd->argv[1], "fg");
+    if (job == NULL) {
+        set_exit_status(1);
+        return;
+    }
+    printf("%s\n", job->command);
+    fflush(stdout);
+
+    if (job->has_tmodes) {
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &job->tmodes);
+    }
+    tcsetpgrp(STDIN_FILENO, job->pgid);
+    if (job->stopped) {
+        kill(-job->pgid, SIGCONT);
+        job->stopped = false;
+    }
+
+    while (true) {
+        struct rusage usage;
+        int status;
+        pid_t pid = wait_foreground(-job->pgid, job->pgid, &status, &usage);
+        // the job's own exits are collected as they happen
+        metrics_watched();
+        if (pid == -1) {
+            perror("wait");
+            break;
+        }
+        if (WIFSTOPPED(status)) {
+            job->stopped = true;
+            job->has_tmodes = tcgetattr(STDIN_FILENO, &job->tmodes) == 0;
+            current_job = job->id;
+            take_terminal();
+            report_job(job, "Stopped");
+            set_exit_status(128 + WSTOPSIG(status));
+            fflush(stdout);
+            return;
+        }
+        if (reap_bg_process(pid, status, &usage) == NULL) {
+            continue;
+        }
+
+        // Every stage is done: report it like a foreground command
+        prev_fg_status.has_usage = true;
+        prev_fg_status.usage = job->usage;
+        prev_fg_status.start = job->start;
+        clock_gettime(CLOCK_MONOTONIC, &prev_fg_status.end);
+        set_wait_status(&prev_fg_status, job->status);
+        prev_fg_status.limit = limit_reason(job->cgroup, job->cpu_limited, job->status);
+        trace_command(&job->trace, job->pid, job->status,
+                      &prev_fg_status.start, &prev_fg_status.end);
+        if (prev_fg_status.terminated) {
+            print_termination(&prev_fg_status);
+        }
+        if (job->timed) {
+            print_usage(stdout, &prev_fg_status);
+        }
+        remove_job(job);
+        break;
+    }
+    take_terminal();
+}
+
+/**
+ * @brief       Built-in `bg`. Resumes a stopped job in the background.
+ * 
+ * @param cmd   The parsed bg command.
+ */
+void run_bg(struct command_line *cmd)
+{
+    if (!job_control) {
+        fprintf(stderr, "bg: no job control\n");
+        set_exit_status(1);
+        return;
+    }
+    struct job *job = parse_job_spec(cmd->argv[1], "bg");
+    if (job == NULL) {
+        set_exit_status(1);
+        return;
+    }
+    if (!job->stopped) {
+        fprintf(stderr, "bg: job %d already in background\n", job->id);
+        set_exit_status(0);
+        return;
+    }
+    kill(-job->pgid, SIGCONT);
+    job->stopped = false;
+    current_job = job->id;
+    printf("[%d]  %s &\n", job->id, job->command);
+    set_exit_status(0);
+}
+
+// Signals kill knows by name
+static const struct
+{
+    const char *name;
+    int number;
+} signal_names[] = {
+    { "HUP", SIGHUP },   { "INT", SIGINT },   { "QUIT", SIGQUIT },
+    { "ILL", SIGILL },   { "ABRT", SIGABRT }, { "KILL", SIGKILL },
+    { "USR1", SIGUSR1 }, { "SEGV", SIGSEGV }, { "USR2", SIGUSR2 },
+    { "PIPE", SIGPIPE }, { "ALRM", SIGALRM }, { "TERM", SIGTERM },
+    { "CHLD", SIGCHLD }, { "CONT", SIGCONT }, { "STOP", SIGSTOP },
+    { "TSTP", SIGTSTP }, { "TTIN", SIGTTIN }, { "TTOU", SIGTTOU },
+};
+
+/**
+ * @brief       Parses a signal given as a number or a name, with or
+ *              without the SIG prefix.
+ * 
+ * @param name  The signal.
+ * @return int  The signal number, or -1.
+ */
+int parse_signal(const char *name)
+{
+    char *end;
+    long number = strtol(name, &end, 10);
+    if (end != name && *end == '\0') {
+        return number >= 0 && number < NSIG ? (int) number : -1;
+    }
+    if (strncmp(name, "SIG", 3) == 0) {
+        name += 3;
+    }
+    for (size_t i = 0; i < sizeof(signal_names) / sizeof(signal_names[0]); i++) {
+        if (strcmp(name, signal_names[i].name) == 0) {
+            return signal_names[i].number;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief       Built-in `kill`. Sends a signal (SIGTERM by default) to
+ *              pids or to every process of a `%N` job. A stopped job is
+ *              also sent SIGCONT so it can act on the signal.
+ * 
+ * @param cmd   The parsed kill command.
+ */
+void run_kill(struct command_line *cmd)
+{
+    int sig = SIGTERM;
+    int i = 1;
+    if (i < cmd->argc && strcmp(cmd->argv[i], "-l") == 0) {
+        for (size_t j = 0; j < sizeof(signal_names) / sizeof(signal_names[0]); j++) {
+            printf("%2d) SIG%s\n", signal_names[j].number, signal_names[j].name);
+        }
+        set_exit_status(0);
+        return;
+    }
+    if (i < cmd->argc && cmd->argv[i][0] == '-' && cmd->argv[i][1] != '\0') {
+        const char *name = cmd->argv[i] + 1;
+        if (strcmp(cmd->argv[i], "-s") == 0 && i + 1 < cmd->argc) {
+            name = cmd->argv[++i];
+        }
+        i++;
+        if ((sig = parse_signal(name)) == -1) {
+            fprintf(stderr, "kill: %s: invalid signal specification\n", name);
+            set_exit_status(1);
+            return;
+        }
+    }
+    if (i >= cmd->argc) {
+        fprintf(stderr, "kill: usage: kill [-s SIGNAL | -SIGNAL] PID | %%JOB...\n");
+        set_exit_status(2);
+        return;
+    }
+
+    int code = 0;
+    for (; i < cmd->argc; i++) {
+        const char *arg = cmd->argv[i];
+        struct job *job = NULL;
+        pid_t target;
+        if (arg[0] == '%') {
+            if ((job = parse_job_spec(arg, "kill")) == NULL) {
+                code = 1;
+                continue;
+            }
+            // without job control the job shares the shell's group
+            target = job->pgid != 0 ? -job->pgid : job->pid;
+        } else {
+            char *end;
+            target = strtol(arg, &end, 10);
+            if (end == arg || *end != '\0') {
+                fprintf(stderr, "kill: %s: arguments must be process or job IDs\n", arg);
+                code = 1;
+                continue;
+            }
+        }
+        if (kill(target, sig) == -1) {
+            fprintf(stderr, "kill: (%s) - %s\n", arg, strerror(errno));
+            code = 1;
+        } else if (job != NULL && job->stopped && sig != SIGSTOP && sig != SIGTSTP
+                   && sig != SIGTTIN && sig != SIGTTOU && sig != 0) {
+            kill(target, SIGCONT);
+        }
+    }
+    set_exit_status(code);
+}
+
+/**
+ * @brief       Built-in `history [-p PREFIX] [N]`. Prints the distinct
+ *              lines of the history, oldest first, each once at the place
+ *              it was last used. -p keeps the lines that start with
+ *              PREFIX, and N keeps the newest N.
+ * 
+ * @param cmd   The parsed history command.
+ */
+void run_history(struct command_line *cmd)
+{
+    const char *prefix = "";
+    size_t limit = SIZE_MAX;
+    int i = 1;
+    if (i + 1 < cmd->argc && strcmp(cmd->argv[i], "-p") == 0) {
+        prefix = cmd->argv[i + 1];
+        i += 2;
+    }
+    if (i < cmd->argc) {
+        char *end;
+        limit = strtoull(cmd->argv[i], &end, 10);
+        if (end == cmd->argv[i] || *end != '\0') {
+            fprintf(stderr, "history: usage: history [-p PREFIX] [N]\n");
+            set_exit_status(2);
+            return;
+        }
+    }
+
+    // Collected newest first, printed oldest first
+    size_t plen = strlen(prefix);
+    uint32_t *found = NULL;
+    size_t count = 0, capacity = 0;
+    for (uint32_t off = UINT32_MAX; count < limit
+            && (off = history_search(prefix, plen, off)) != 0; ) {
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            found = realloc(found, capacity * sizeof(uint32_t));
+            if (found == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        found[count++] = off;
+    }
+    while (count > 0) {
+        size_t len;
+        const char *text = history_line(found[--count], &len);
+        printf("%.*s\n", (int) len, text);
+    }
+    free(found);
+    set_exit_status(0);
+}
+
+/**
+ * @brief       Bytes held by an arena's blocks.
+ * 
+ * @param a     The arena.
+ * @return size_t 
+ */
+size_t arena_size(const struct arena *a)
+{
+    size_t total = 0;
+    for (const struct arena_block *block = a->head; block; block = block->next) {
+        total += sizeof(*block) + block->size;
+    }
+    return total;
+}
+
+/**
+ * @brief       Built-in `meminfo [-b SIZE]`. Prints the resident set size
+ *              of the shell and the heap and mapped memory held by each of
+ *              its tables, in bytes. With -b the status is 1 when the RSS
+ *              is over SIZE, which takes the K, M and G suffixes of limit.
+ * 
+ * @param cmd   The parsed meminfo command.
+ */
+void run_meminfo(struct command_line *cmd)
+{
+    unsigned long long budget = 0;
+    if (cmd->argc == 3 && strcmp(cmd->argv[1], "-b") == 0) {
+        if (!parse_size(cmd->argv[2], &budget) || budget == 0) {
+            fprintf(stderr, "meminfo: %s: invalid size\n", cmd->argv[2]);
+            set_exit_status(2);
+            return;
+        }
+    } else if (cmd->argc != 1) {
+        fprintf(stderr, "meminfo: usage: meminfo [-b SIZE]\n");
+        set_exit_status(2);
+        return;
+    }
+
+    unsigned long long rss = 0;
+    FILE *statm = fopen("/proc/self/statm", "re");
+    unsigned long long pages;
+    if (statm != NULL && fscanf(statm, "%*u %llu", &pages) == 1) {
+        rss = pages * sysconf(_SC_PAGESIZE);
+    }
+    if (statm != NULL) {
+        fclose(statm);
+    }
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+
+    size_t commands = 0;
+    for (int i = 0; i < job_table.used; i++) {
+        if (job_table.slots[i].pid != 0 && job_table.slots[i].command != NULL) {
+            commands += strlen(job_table.slots[i].command) + 1;
+        }
+    }
+    size_t paths = 0;
+    for (int i = 0; i <= path_cache.mask; i++) {
+        if (path_cache.entries[i].name != NULL) {
+            paths += strlen(path_cache.entries[i].name) + strlen(path_cache.entries[i].path) + 2;
+        }
+    }
+    for (size_t i = 0; i < path_cache.ncommands; i++) {
+        paths += strlen(path_cache.commands[i]) + 1 + sizeof(char *);
+    }
+
+    printf("rss             %12llu\n", rss);
+    printf("peak rss        %12llu\n", (unsigned long long) ru.ru_maxrss * 1024);
+    printf("line arena      %12zu\n", arena_size(&line_arena));
+    printf("scratch arena   %12zu\n", arena_size(&scratch_arena));
+    printf("input buffer    %12zu\n", input_reader.size);
+    printf("job table       %12zu  %d slots, %d jobs\n",
+           job_table.capacity * sizeof(struct job) + commands
+           + (job_table.index_mask + 1) * sizeof(struct job_index_entry),
+           job_table.capacity, job_table.count);
+    printf("path cache      %12zu  %d commands, %zu on PATH\n",
+           (path_cache.mask + 1) * sizeof(struct path_entry) + paths,
+           path_cache.count, path_cache.ncommands);
+    printf("env index       %12zu\n", env_index.capacity * sizeof(char *));
+    printf("history tail    %12zu  %u lines\n",
+           history.tail != NULL ? (history.tail_mask + 1) * sizeof(struct history_slot) : 0,
+           history.tail_count);
+    printf("history mapped  %12zu  %u indexed\n",
+           history.log_size + history.index_map_size, history.count);
+    printf("line editor     %12zu\n", editor.cap + editor.shown_cap + editor.out_cap);
+    printf("batch queue     %12zu\n", batch.capacity * sizeof(struct batch_entry));
+    fflush(stdout);
+
+    if (budget != 0 && rss > budget) {
+        fprintf(stderr, "meminfo: rss %llu is over the budget of %llu\n", rss, budget);
+        set_exit_status(1);
+        return;
+    }
+    set_exit_status(0);
+}
+
+enum {
+    BUILTIN_BRACKET, BUILTIN_BG, BUILTIN_CD, BUILTIN_FG, BUILTIN_PWD,
+    BUILTIN_ECHO, BUILTIN_EXIT, BUILTIN_HASH, BUILTIN_KILL, BUILTIN_JOBS,
+    BUILTIN_TEST, BUILTIN_TRUE, BUILTIN_FALSE, BUILTIN_EXPORT, BUILTIN_PRINTF,
+    BUILTIN_STATUS, BUILTIN_HISTORY, BUILTIN_MEMINFO, BUILTIN_PARALLEL,
+};
+
+static const struct builtin builtins[] = {
+    [BUILTIN_BRACKET]  = { "[",        run_test,     true,  true  },
+    [BUILTIN_BG]       = { "bg",       run_bg,       true,  false },
+    [BUILTIN_CD]       = { "cd",       run_cd,       false, false },
+    [BUILTIN_FG]       = { "fg",       run_fg,       false, false },
+    [BUILTIN_PWD]      = { "pwd",      run_pwd,      true,  true  },
+    [BUILTIN_ECHO]     = { "echo",     run_echo,     true,  true  },
+    [BUILTIN_EXIT]     = { "exit",     run_exit,     false, false },
+    [BUILTIN_HASH]     = { "hash",     run_hash,     true,  false },
+    [BUILTIN_KILL]     = { "kill",     run_kill,     true,  false },
+    [BUILTIN_JOBS]     = { "jobs",     run_jobs,     true,  false },
+    [BUILTIN_TEST]     = { "test",     run_test,     true,  true  },
+    [BUILTIN_TRUE]     = { "true",     run_true,     true,  true  },
+    [BUILTIN_FALSE]    = { "false",    run_true,     true,  true  },
+    [BUILTIN_EXPORT]   = { "export",   run_export,   true,  false },
+    [BUILTIN_PRINTF]   = { "printf",   run_printf,   true,  true  },
+    [BUILTIN_STATUS]   = { "status",   run_status,   true,  false },
+    [BUILTIN_HISTORY]  = { "history",  run_history,  true,  false },
+    [BUILTIN_MEMINFO]  = { "meminfo",  run_meminfo,  true,  false },
+    // parallel reads < and > itself
+    [BUILTIN_PARALLEL] = { "parallel", run_parallel, false, false },
+};
+
+struct function *find_function(const char *name);
+void run_function(struct command_line *cmd);
+
+// Shell functions are called through the built-in path, which redirects
+// around them
+static const struct builtin function_builtin = { "function", run_function, true, false };
+
+/**
+ * @brief       Finds a built-in by name. The length and one character
+ *              pick the only possible candidate, so a lookup is one
+ *              comparison whatever the number of built-ins.
+ * 
+ * @param name  The command name.
+ * @return const struct builtin* 
+ *              The built-in, or NULL.
+ */
+const struct builtin *find_builtin(const char *name)
+{
+    size_t len = strlen(name);
+    int index = -1;
+    switch (len) {
+    case 1: index = BUILTIN_BRACKET; break;
+    case 2:
+        switch (name[0]) {
+        case 'b': index = BUILTIN_BG; break;
+        case 'c': index = BUILTIN_CD; break;
+        case 'f': index = BUILTIN_FG; break;
+        }
+        break;
+    case 3: index = BUILTIN_PWD; break;
+    case 4:
+        switch (name[1]) {
+        case 'c': index = BUILTIN_ECHO; break;
+        case 'x': index = BUILTIN_EXIT; break;
+        case 'a': index = BUILTIN_HASH; break;
+        case 'e': index = BUILTIN_TEST; break;
+        case 'r': index = BUILTIN_TRUE; break;
+        case 'i': index = BUILTIN_KILL; break;
+        case 'o': index = BUILTIN_JOBS; break;
+        }
+        break;
+    case 5: index = BUILTIN_FALSE; break;
+    case 6:
+        switch (name[1]) {
+        case 'x': index = BUILTIN_EXPORT; break;
+        case 'r': index = BUILTIN_PRINTF; break;
+        case 't': index = BUILTIN_STATUS; break;
+        }
+        break;
+    case 7: index = name[0] == 'h' ? BUILTIN_HISTORY : BUILTIN_MEMINFO; break;
+    case 8: index = BUILTIN_PARALLEL; break;
+    }
+    if (index == -1 || memcmp(builtins[index].name, name, len) != 0) {
+        return NULL;
+    }
+    return &builtins[index];
+}
+
+/**
+ * @brief       Tells whether a built-in that has a program of the same
+ *              name understands these arguments. Where it does not, the
+ *              program runs instead, so a printf conversion or a test
+ *              operator the built-in lacks still works as it would without
+ *              the shortcut.
+ *
+ * @param b     The built-in.
+ * @param cmd   The expanded command.
+ * @return bool True if the built-in can run it.
+ */
+bool builtin_handles(const struct builtin *b, const struct command_line *cmd)
+{
+    if (b->run == run_printf) {
+        return printf_supported(cmd);
+    }
+    if (b->run == run_test) {
+        return test_supported(cmd);
+    }
+    return true;
+}
+
+/**
+ * @brief       qsort comparison of two strings.
+ */
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/**
+ * @brief       Lists the executables on PATH for completion. The list is
+ *              built on first use and dropped with the rest of the PATH
+ *              cache when PATH changes.
+ * 
+ * @param count Receives the number of names.
+ * @return char** 
+ *              The names, sorted and without duplicates.
+ */
+char **path_commands(size_t *count)
+{
+    const char *path = current_path();
+    if (path_cache.commands == NULL) {
+        size_t capacity = 256, n = 0;
+        char **names = malloc(capacity * sizeof(char *));
+        if (names == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (const char *dir = path; ; ) {
+            const char *sep = strchrnul(dir, ':');
+            char dirname[PATH_MAX];
+            snprintf(dirname, sizeof(dirname), "%.*s", (int) (sep - dir), dir);
+            DIR *d = opendir(sep == dir ? "." : dirname);
+            struct dirent *ent;
+            while (d != NULL && (ent = readdir(d)) != NULL) {
+                if (ent->d_name[0] == '.'
+                        || faccessat(dirfd(d), ent->d_name, X_OK, 0) != 0) {
+                    continue;
+                }
+                if (n == capacity) {
+                    capacity *= 2;
+                    names = realloc(names, capacity * sizeof(char *));
+                    if (names == NULL) {
+                        perror("realloc");
+                        exit(1);
+                    }
+                }
+                names[n++] = strdup(ent->d_name);
+            }
+            if (d != NULL) {
+                closedir(d);
+            }
+            if (*sep == '\0') {
+                break;
+            }
+            dir = sep + 1;
+        }
+        qsort(names, n, sizeof(char *), compare_names);
+        size_t unique = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (unique > 0 && strcmp(names[unique - 1], names[i]) == 0) {
+                free(names[i]);
+            } else {
+                names[unique++] = names[i];
+            }
+        }
+        path_cache.commands = names;
+        path_cache.ncommands = unique;
+    }
+    *count = path_cache.ncommands;
+    return path_cache.commands;
+}
+
+/**
+ * @brief       Appends to the editor's output, which goes to the terminal
+ *              in one write when the editor waits for the next key.
+ * 
+ * @param data  Bytes to append.
+ * @param len   Their number.
+ */
+static void edit_out(const char *data, size_t len)
+{
+    if (editor.out_len + len > editor.out_cap) {
+        size_t capacity = editor.out_cap ? editor.out_cap : 256;
+        while (capacity < editor.out_len + len) {
+            capacity *= 2;
+        }
+        editor.out = realloc(editor.out, capacity);
+        if (editor.out == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        editor.out_cap = capacity;
+    }
+    memcpy(editor.out + editor.out_len, data, len);
+    editor.out_len += len;
+}
+
+/**
+ * @brief       Appends a cursor movement escape sequence, e.g. ESC [ 3 D.
+ * 
+ * @param n     Number of cells, 0 appends nothing.
+ * @param dir   'A', 'B', 'C' or 'D'.
+ */
+static void edit_move(int n, char dir)
+{
+    char seq[16];
+    if (n > 0) {
+        edit_out(seq, snprintf(seq, sizeof(seq), "\x1b[%d%c", n, dir));
+    }
+}
+
+/**
+ * @brief       Writes the pending output with a single write.
+ */
+static void edit_flush()
+{
+    size_t done = 0;
+    while (done < editor.out_len) {
+        ssize_t n = write(STDOUT_FILENO, editor.out + done, editor.out_len - done);
+        if (n == -1 && errno != EINTR) {
+            break;
+        }
+        done += n > 0 ? n : 0;
+    }
+    editor.out_len = 0;
+}
+
+/**
+ * @brief       Screen column of a position in a line, counting from the
+ *              start of the prompt. UTF-8 continuation bytes take no room.
+ * 
+ * @param text  The line.
+ * @param pos   Byte position in it.
+ * @return size_t 
+ */
+static size_t edit_column(const char *text, size_t pos)
+{
+    size_t col = PROMPT_LEN;
+    for (size_t i = 0; i < pos; i++) {
+        col += ((unsigned char) text[i] & 0xC0) != 0x80;
+    }
+    return col;
+}
+
+/**
+ * @brief       Moves the cursor between two columns of a line that may
+ *              wrap over several rows.
+ * 
+ * @param from  Current column.
+ * @param to    Wanted column.
+ */
+static void edit_goto(size_t from, size_t to)
+{
+    size_t cols = editor.cols;
+    if (to / cols < from / cols) {
+        edit_move(from / cols - to / cols, 'A');
+    } else {
+        edit_move(to / cols - from / cols, 'B');
+    }
+    if (to % cols == 0 && from % cols != 0) {
+        edit_out("\r", 1);
+    } else if (to % cols < from % cols) {
+        edit_move(from % cols - to % cols, 'D');
+    } else {
+        edit_move(to % cols - from % cols, 'C');
+    }
+}
+
+/**
+ * @brief       Brings the terminal up to date with the line. Only the part
+ *              after the first byte that differs from what is on screen is
+ *              written, then the rest of the old line is cleared and the
+ *              cursor put in place. Everything is queued for edit_flush().
+ */
+static void edit_refresh()
+{
+    size_t same = 0;
+    while (same < editor.len && same < editor.shown_len
+           && editor.buf[same] == editor.shown[same]) {
+        same++;
+    }
+    if (same == editor.len && same == editor.shown_len
+            && editor.cursor == editor.shown_cursor) {
+        return;
+    }
+
+    size_t end = edit_column(editor.buf, editor.len);
+    edit_goto(edit_column(editor.shown, editor.shown_cursor),
+              edit_column(editor.buf, same));
+    edit_out(editor.buf + same, editor.len - same);
+    if (editor.len > same && end % editor.cols == 0) {
+        // leave the pending wrap, so the cursor is where it is counted
+        edit_out("\r\n", 2);
+    }
+    if (end < edit_column(editor.shown, editor.shown_len)) {
+        edit_out("\x1b[J", 3);
+    }
+    edit_goto(end, edit_column(editor.buf, editor.cursor));
+
+    if (editor.shown_cap < editor.len) {
+        editor.shown = realloc(editor.shown, editor.cap);
+        if (editor.shown == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        editor.shown_cap = editor.cap;
+    }
+    memcpy(editor.shown, editor.buf, editor.len);
+    editor.shown_len = editor.len;
+    editor.shown_cursor = editor.cursor;
+}
+
+/**
+ * @brief       Forgets what is on screen and draws the prompt and the line
+ *              from scratch, after something else wrote to the terminal.
+ */
+static void edit_redraw()
+{
+    edit_out(prompt, PROMPT_LEN);
+    editor.shown_len = 0;
+    editor.shown_cursor = 0;
+    prompt_shown = true;
+    edit_refresh();
+}
+
+/**
+ * @brief       Moves below the line and clears it, so a message can be
+ *              printed; edit_redraw() puts the line back.
+ */
+static void edit_hide()
+{
+    edit_goto(edit_column(editor.shown, editor.shown_cursor), 0);
+    edit_out("\r\x1b[J", 4);
+    edit_flush();
+    editor.shown_len = 0;
+    editor.shown_cursor = 0;
+    prompt_shown = false;
+}
+
+/**
+ * @brief       Makes room in the line.
+ * 
+ * @param len   Length the line must be able to hold.
+ */
+static void edit_reserve(size_t len)
+{
+    if (len + 1 > editor.cap) {
+        size_t capacity = editor.cap ? editor.cap : 256;
+        while (capacity < len + 1) {
+            capacity *= 2;
+        }
+        editor.buf = realloc(editor.buf, capacity);
+        if (editor.buf == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        editor.cap = capacity;
+    }
+}
+
+/**
+ * @brief       Replaces part of the line and moves the cursor after the
+ *              replacement. Any edit ends history browsing.
+ * 
+ * @param at    Start of the part.
+ * @param n     Its length.
+ * @param text  Replacement.
+ * @param len   Its length.
+ */
+static void edit_replace(size_t at, size_t n, const char *text, size_t len)
+{
+    edit_reserve(editor.len - n + len);
+    memmove(editor.buf + at + len, editor.buf + at + n, editor.len - at - n);
+    memcpy(editor.buf + at, text, len);
+    editor.len = editor.len - n + len;
+    editor.cursor = at + len;
+    editor.hist_depth = 0;
+}
+
+/**
+ * @brief       Shows a history line, or the line being typed when browsing
+ *              comes back down past the newest entry.
+ * 
+ * @param up    Go to an older line rather than a newer one.
+ */
+static void edit_history(bool up)
+{
+    if (editor.hist_depth == 0) {
+        if (!up) {
+            return;
+        }
+        // the typed text is restored at the bottom and is the search prefix
+        free(editor.typed);
+        editor.typed = strndup(editor.buf, editor.len);
+        editor.typed_len = editor.len;
+    }
+    uint32_t off;
+    if (up) {
+        uint32_t before = editor.hist_depth ? editor.hist[editor.hist_depth - 1] : UINT32_MAX;
+        off = history_search(editor.typed, editor.typed_len, before);
+        if (off == 0 || editor.hist_depth == EDIT_HISTORY_DEPTH) {
+            return;
+        }
+        editor.hist[editor.hist_depth++] = off;
+    } else {
+        off = --editor.hist_depth ? editor.hist[editor.hist_depth - 1] : 0;
+    }
+
+    size_t len = editor.typed_len;
+    const char *text = off != 0 ? history_line(off, &len) : editor.typed;
+    edit_reserve(len);
+    memcpy(editor.buf, text, len);
+    editor.len = editor.cursor = len;
+}
+
+/**
+ * @brief       Adds a completion candidate to the list in scratch_arena.
+ */
+static void add_candidate(char ***list, size_t *n, size_t *cap, const char *name, size_t len)
+{
+    if (*n == *cap) {
+        size_t capacity = *cap ? *cap * 2 : 64;
+        char **grown = arena_alloc(&scratch_arena, capacity * sizeof(char *));
+        memcpy(grown, *list, *n * sizeof(char *));
+        *list = grown;
+        *cap = capacity;
+    }
+    char *copy = arena_alloc(&scratch_arena, len + 2);
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+    (*list)[(*n)++] = copy;
+}
+
+/**
+ * @brief       Tab completion of the word before the cursor. The first word
+ *              of a command completes to built-ins and programs on PATH,
+ *              other words to file names. A single match is inserted with
+ *              a space or a / after it; several matches are completed as
+ *              far as they agree, and a second Tab lists them.
+ * 
+ * @param again Whether the previous key was Tab too.
+ */
+static void edit_complete(bool again)
+{
+    size_t start = editor.cursor;
+    while (start > 0 && editor.buf[start - 1] != ' ' && editor.buf[start - 1] != '|'
+           && editor.buf[start - 1] != '<' && editor.buf[start - 1] != '>') {
+        start--;
+    }
+    size_t before = start;
+    while (before > 0 && editor.buf[before - 1] == ' ') {
+        before--;
+    }
+    const char *word = editor.buf + start;
+    size_t wlen = editor.cursor - start;
+    bool command = (before == 0 || editor.buf[before - 1] == '|')
+                   && memchr(word, '/', wlen) == NULL;
+
+    char **list = NULL;
+    size_t n = 0, cap = 0;
+    size_t base = 0;            // the part of the word being completed
+    if (command) {
+        static const char *prefixes[] = { "time", "limit" };
+        for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+            if (strncmp(builtins[i].name, word, wlen) == 0) {
+                add_candidate(&list, &n, &cap, builtins[i].name, strlen(builtins[i].name));
+            }
+        }
+        for (size_t i = 0; i < 2; i++) {
+            if (strncmp(prefixes[i], word, wlen) == 0) {
+                add_candidate(&list, &n, &cap, prefixes[i], strlen(prefixes[i]));
+            }
+        }
+        size_t count;
+        char **names = path_commands(&count);
+        // binary search for the first name with the prefix
+        size_t lo = 0, hi = count;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (strncmp(names[mid], word, wlen) < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        for (; lo < count && strncmp(names[lo], word, wlen) == 0; lo++) {
+            add_candidate(&list, &n, &cap, names[lo], strlen(names[lo]));
+        }
+    } else {
+        const char *slash = memrchr(word, '/', wlen);
+        base = slash ? (size_t) (slash - word + 1) : 0;
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%.*s", (int) base, word);
+        DIR *d = opendir(base ? dir : ".");
+        struct dirent *ent;
+        while (d != NULL && (ent = readdir(d)) != NULL) {
+            const char *name = ent->d_name;
+            if (strncmp(name, word + base, wlen - base) != 0
+                    || strcmp(name, ".") == 0 || strcmp(name, "..") == 0
+                    || (name[0] == '.' && (wlen == base || word[base] != '.'))) {
+                continue;
+            }
+            size_t len = strlen(name);
+            add_candidate(&list, &n, &cap, name, len);
+            struct stat st;
+            if (fstatat(dirfd(d), name, &st, 0) == 0 && S_ISDIR(st.st_mode)) {
+                // mark directories so they complete with a /
+                list[n - 1][len] = '/';
+                list[n - 1][len + 1] = '\0';
+            }
+        }
+        if (d != NULL) {
+            closedir(d);
+        }
+    }
+    if (n > 1) {
+        // built-ins can also be programs on PATH
+        qsort(list, n, sizeof(char *), compare_names);
+        size_t unique = 1;
+        for (size_t i = 1; i < n; i++) {
+            if (strcmp(list[unique - 1], list[i]) != 0) {
+                list[unique++] = list[i];
+            }
+        }
+        n = unique;
+    }
+
+    if (n == 0) {
+        edit_out("\a", 1);
+    } else if (n == 1) {
+        size_t len = strlen(list[0]);
+        bool dir = list[0][len - 1] == '/';
+        edit_replace(start + base, wlen - base, list[0], len);
+        if (!dir) {
+            edit_replace(editor.cursor, 0, " ", 1);
+        }
+    } else {
+        // extend to what every candidate agrees on
+        size_t common = strlen(list[0]);
+        for (size_t i = 1; i < n; i++) {
+            size_t j = 0;
+            while (j < common && list[i][j] == list[0][j]) {
+                j++;
+            }
+            common = j;
+        }
+        if (common > wlen - base) {
+            edit_replace(start + base, wlen - base, list[0], common);
+        } else if (again) {
+            // list them in columns below the line, then draw it again
+            edit_goto(edit_column(editor.shown, editor.shown_cursor),
+                      edit_column(editor.shown, editor.shown_len));
+            edit_out("\r\n", 2);
+            size_t width = 0;
+            for (size_t i = 0; i < n; i++) {
+                width = strlen(list[i]) > width ? strlen(list[i]) : width;
+            }
+            width += 2;
+            size_t per_row = editor.cols / width ? editor.cols / width : 1;
+            size_t shown = n < EDIT_LIST_MAX ? n : EDIT_LIST_MAX;
+            for (size_t i = 0; i < shown; i++) {
+                size_t len = strlen(list[i]);
+                edit_out(list[i], len);
+                if ((i + 1) % per_row == 0 || i + 1 == shown) {
+                    edit_out("\r\n", 2);
+                } else {
+                    for (size_t pad = len; pad < width; pad++) {
+                        edit_out(" ", 1);
+                    }
+                }
+            }
+            if (n > EDIT_LIST_MAX) {
+                char more[48];
+                edit_out(more, snprintf(more, sizeof(more), "... %zu more\r\n", n - EDIT_LIST_MAX));
+            }
+            edit_redraw();
+        } else {
+            edit_out("\a", 1);
+        }
+    }
+    arena_reset(&scratch_arena);
+}
+
+/**
+ * @brief       Returns the next input byte, reading more when everything
+ *              read so far has been handled. Before blocking, the screen is
+ *              brought up to date, so a burst of input (a paste, or keys
+ *              arriving together over a slow link) is drawn once. While it
+ *              waits, finished background jobs are reported above the line.
+ * 
+ * @param timeout   Milliseconds to wait, or -1 to wait for ever.
+ * @return int      The byte, EDIT_EOF at end of input, EDIT_INTERRUPT after
+ *                  Ctrl+C or EDIT_TIMEOUT.
+ */
+static int edit_getc(int timeout)
+{
+    while (editor.in_pos == editor.in_len) {
+        edit_refresh();
+        edit_flush();
+        struct pollfd fds[3] = {
+            { .fd = STDIN_FILENO, .events = POLLIN },
+            { .fd = sigchld_fd,   .events = POLLIN },
+            { .fd = zygote.fd,    .events = POLLIN },
+        };
+        int ready = poll(fds, 3, timeout);
+        metrics_watched();
+        if (ready == 0) {
+            return EDIT_TIMEOUT;
+        }
+        if (ready == -1) {
+            if (errno != EINTR) {
+                return EDIT_EOF;
+            }
+            if (sigint_received) {
+                sigint_received = 0;
+                return EDIT_INTERRUPT;
+            }
+            // the SIGTSTP handler printed a message below the line
+            edit_redraw();
+            continue;
+        }
+        if ((fds[1].revents | fds[2].revents) & POLLIN) {
+            edit_hide();
+            reap_background_processes();
+            fflush(stdout);
+            edit_redraw();
+        }
+        if (fds[0].revents) {
+            ssize_t n = read(STDIN_FILENO, editor.in, sizeof(editor.in));
+            if (n <= 0 && !(n == -1 && errno == EINTR)) {
+                return EDIT_EOF;
+            }
+            editor.in_pos = 0;
+            editor.in_len = n > 0 ? n : 0;
+        }
+    }
+    return (unsigned char) editor.in[editor.in_pos++];
+}
+
+/**
+ * @brief       Reads an escape sequence after ESC and returns the key it
+ *              names, e.g. 'A' for the up arrow, '3' for Delete.
+ * 
+ * @return int  The key, or 0 for an unknown sequence.
+ */
+static int edit_escape()
+{
+    int c = edit_getc(EDIT_ESCAPE_MS);
+    if (c != '[' && c != 'O') {
+        return 0;
+    }
+    c = edit_getc(EDIT_ESCAPE_MS);
+    if (c >= '0' && c <= '9') {
+        // ESC [ n ~, possibly with parameters after a ;
+        int key = c;
+        while ((c = edit_getc(EDIT_ESCAPE_MS)) >= 0 && c != '~' && !(c >= 'A' && c <= 'Z')) {
+        }
+        return c == '~' ? key : c;
+    }
+    return c >= 0 ? c : 0;
+}
+
+/**
+ * @brief       Reads a line from the terminal with editing, history recall
+ *              and Tab completion. The terminal is in raw mode only while
+ *              the line is edited; Ctrl+C and Ctrl+Z still raise signals.
+ * 
+ *              Keys: arrows, Home/End, Ctrl+A/E/B/F, Backspace, Delete,
+ *              Ctrl+D (end of input on an empty line), Ctrl+K/U/W to cut,
+ *              Ctrl+L to clear the screen, Up/Down or Ctrl+P/N to walk the
+ *              lines in the history that start with what was typed, Tab.
+ * 
+ * @param len   Receives the length of the line.
+ * @return char* 
+ *              The NUL-terminated line, valid until the next call, or NULL
+ *              at end of input.
+ */
+char *edit_line(size_t *len)
+{
+    struct termios cooked, raw;
+    bool have_modes = tcgetattr(STDIN_FILENO, &cooked) == 0;
+    raw = cooked;
+    raw.c_lflag &= ~(ICANON | ECHO | IEXTEN);
+    raw.c_iflag &= ~(IXON);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if (have_modes) {
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+    }
+    struct winsize ws;
+    editor.cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+    editor.len = editor.cursor = 0;
+    editor.hist_depth = 0;
+    edit_reserve(0);
+    edit_redraw();
+
+    bool tab = false;
+    char *line = NULL;
+    while (true) {
+        int c = edit_getc(-1);
+        bool was_tab = tab;
+        tab = false;
+        if (c == 27) {
+            c = edit_escape();
+            c = c == 'A' ? 16 : c == 'B' ? 14 : c == 'C' ? 6 : c == 'D' ? 2
+                : c == 'H' || c == '1' || c == '7' ? 1 : c == 'F' || c == '4' || c == '8' ? 5
+                : c == '3' ? EDIT_DELETE : 0;
+        }
+        if (c == EDIT_EOF || (c == 4 && editor.len == 0)) {
+            break;
+        } else if (c == EDIT_INTERRUPT) {
+            // Ctrl+C drops the line
+            editor.cursor = editor.len;
+            edit_refresh();
+            edit_out("^C\r\n", 4);
+            editor.len = editor.cursor = 0;
+            editor.hist_depth = 0;
+            edit_redraw();
+        } else if (c == '\n' || c == '\r') {
+            editor.cursor = editor.len;
+            edit_refresh();
+            edit_out("\r\n", 2);
+            editor.buf[editor.len] = '\0';
+            *len = editor.len;
+            line = editor.buf;
+            break;
+        } else if (c == 1) {
+            editor.cursor = 0;
+        } else if (c == 5) {
+            editor.cursor = editor.len;
+        } else if (c == 2 && editor.cursor > 0) {
+            // step over UTF-8 continuation bytes
+            while (--editor.cursor > 0 && ((unsigned char) editor.buf[editor.cursor] & 0xC0) == 0x80) {
+            }
+        } else if (c == 6 && editor.cursor < editor.len) {
+            while (++editor.cursor < editor.len && ((unsigned char) editor.buf[editor.cursor] & 0xC0) == 0x80) {
+            }
+        } else if ((c == 127 || c == 8) && editor.cursor > 0) {
+            size_t at = editor.cursor;
+            while (--at > 0 && ((unsigned char) editor.buf[at] & 0xC0) == 0x80) {
+            }
+            edit_replace(at, editor.cursor - at, "", 0);
+        } else if ((c == EDIT_DELETE || c == 4) && editor.cursor < editor.len) {
+            size_t end = editor.cursor + 1;
+            while (end < editor.len && ((unsigned char) editor.buf[end] & 0xC0) == 0x80) {
+                end++;
+            }
+            edit_replace(editor.cursor, end - editor.cursor, "", 0);
+        } else if (c == 11) {
+            edit_replace(editor.cursor, editor.len - editor.cursor, "", 0);
+        } else if (c == 21) {
+            edit_replace(0, editor.cursor, "", 0);
+        } else if (c == 23) {
+            size_t at = editor.cursor;
+            while (at > 0 && editor.buf[at - 1] == ' ') {
+                at--;
+            }
+            while (at > 0 && editor.buf[at - 1] != ' ') {
+                at--;
+            }
+            edit_replace(at, editor.cursor - at, "", 0);
+        } else if (c == 12) {
+            edit_out("\x1b[H\x1b[2J", 7);
+            edit_redraw();
+        } else if (c == 16 || c == 14) {
+            edit_history(c == 16);
+        } else if (c == '\t') {
+            edit_complete(was_tab);
+            tab = true;
+        } else if (c >= 32 && c != 127) {
+            char ch = c;
+            edit_replace(editor.cursor, 0, &ch, 1);
+        }
+    }
+
+    edit_flush();
+    prompt_shown = false;
+    if (have_modes) {
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked);
+    }
+    return line;
+}
+
+/**
+ * @brief       Runs a built-in in the shell process. Redirections are
+ *              applied by swapping the standard streams for the duration
+ *              of the call, the same way a child would see them.
+ * 
+ * @param b     The built-in.
+ * @param cmd   The parsed command.
+ */
+void run_builtin(const struct builtin *b, struct command_line *cmd)
+{
+    if (!b->redirect || (cmd->input_file == NULL && cmd->output_file == NULL
+                         && cmd->error_file == NULL && !cmd->merge_error)) {
+        b->run(cmd);
+        fflush(stdout);
+        return;
+    }
+
+    // Keep the shell's streams above the standard ones
+    int saved[3];
+    for (int i = 0; i < 3; i++) {
+        saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+    }
+    fflush(stdout);
+
+    bool ok = true;
+    if (cmd->input_file != NULL
+            && redirect_stream(cmd->input_file, O_RDONLY, STDIN_FILENO) != 0) {
+        printf("cannot open %s for input\n", cmd->input_file);
+        ok = false;
+    }
+    if (ok && cmd->output_file != NULL
+            && redirect_stream(cmd->output_file, output_flags(cmd->append_output),
+                               STDOUT_FILENO) != 0) {
+        perror(cmd->output_file);
+        ok = false;
+    }
+    if (ok && cmd->merge_error) {
+        dup2(STDOUT_FILENO, STDERR_FILENO);
+    } else if (ok && cmd->error_file != NULL
+            && redirect_stream(cmd->error_file, output_flags(cmd->append_error),
+                               STDERR_FILENO) != 0) {
+        perror(cmd->error_file);
+        ok = false;
+    }
+
+    if (ok) {
+        b->run(cmd);
+    } else {
+        set_exit_status(1);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < 3; i++) {
+        if (saved[i] != -1) {
+            dup2(saved[i], i);
+            close(saved[i]);
+        }
+    }
+}
+
+/**
+ * @brief       Runs one expanded command the way the prompt does: strips
+ *              the time and limit prefixes, then runs a built-in in the
+ *              shell or launches the command in the foreground or
+ *              background.
+ * 
+ * @param cmd   The command.
+ */
+void run_command(struct command_line *cmd)
+{
+    const struct builtin *builtin;
+    struct command_limits limits;
+
+    bool timed = strip_time_prefix(cmd);
+    int limited = strip_limit_prefix(cmd, &limits);
+    launch_limits = limited == 1 ? &limits : NULL;
+    if (limited == -1) {
+        // error already reported
+        set_exit_status(1);
+    } else if (cmd->argc == 0 || cmd->argv[0][0] == '#') {
+        // comment line
+        // do nothing
+    } else if (!valid_pipeline(cmd)) {
+        // error already reported
+    } else if (cmd->next != NULL) {
+        // pipelines always run as processes, even if the first stage
+        // names a built-in
+        if (cmd->is_bg && fg_only == false) {
+            background_process(cmd, timed);
+        } else {
+            foreground_process(cmd, timed);
+        }
+    } else if (compound.functions != NULL && find_function(cmd->argv[0]) != NULL) {
+        if (launch_limits != NULL) {
+            fprintf(stderr, "limit: %s: cannot limit a shell function\n", cmd->argv[0]);
+            set_exit_status(1);
+        } else if (cmd->is_bg && !fg_only) {
+            fprintf(stderr, "%s: a shell function cannot run in the background\n",
+                    cmd->argv[0]);
+            set_exit_status(1);
+        } else {
+            run_builtin(&function_builtin, cmd);
+        }
+    } else if ((builtin = find_builtin(cmd->argv[0])) != NULL
+            && !(builtin->has_program && ((cmd->is_bg && !fg_only)
+                                          || launch_limits != NULL
+                                          || !builtin_handles(builtin, cmd)))) {
+        if (launch_limits != NULL) {
+            // the limits would apply to the shell itself
+            fprintf(stderr, "limit: %s: cannot limit a shell built-in\n",
+                    cmd->argv[0]);
+            set_exit_status(1);
+        } else {
+            run_builtin(builtin, cmd);
+        }
+    } else {
+        if (cmd->is_bg && fg_only == false) {
+            background_process(cmd, timed);
+        } else {
+            foreground_process(cmd, timed);
+        }
+    }
+
+    if (launch_limits != NULL) {
+        // the cgroup is only still here if no job took it
+        release_cgroup(limits.cgroup);
+        if (limits.procs_fd != -1) {
+            close(limits.procs_fd);
+        }
+        launch_limits = NULL;
+    }
+}
+/**
+ * @brief       Copies a string into an arena.
+ * 
+ * @param a     The arena.
+ * @param s     The string, or NULL.
+ * @return char* 
+ *              The copy, or NULL.
+ */
+char *copy_string(struct arena *a, const char *s)
+{
+    if (s == NULL) {
+        return NULL;
+    }
+    size_t len = strlen(s) + 1;
+    return memcpy(arena_alloc(a, len), s, len);
+}
+
+/**
+ * @brief       Copies a command with its stages and argument arrays. A deep
+ *              copy has its own words and file names as well.
+ * 
+ * @param a     Arena for the copy.
+ * @param cmd   The command.
+ * @param skip  Leading words of the first stage to leave out, at most its
+ *              argc.
+ * @param deep  Copy the strings too.
+ * @return struct command_line* 
+ *              The copy.
+ */
+struct command_line *copy_command(struct arena *a, const struct command_line *cmd,
+                                  int skip, bool deep)
+{
+    struct command_line *first = NULL;
+    struct command_line **link = &first;
+    for (const struct command_line *stage = cmd; stage; stage = stage->next, skip = 0) {
+        struct command_line *copy = arena_alloc(a, sizeof(*copy));
+        *copy = *stage;
+        copy->argc = stage->argc - skip;
+        copy->argv = NULL;
+        copy->argv_cap = 0;
+        if (copy->argc > 0) {
+            copy->argv_cap = copy->argc + 1;
+            copy->argv = arena_alloc(a, copy->argv_cap * sizeof(char *));
+            for (int i = 0; i < copy->argc; i++) {
+                copy->argv[i] = deep ? copy_string(a, stage->argv[skip + i])
+                                     : stage->argv[skip + i];
+            }
+            copy->argv[copy->argc] = NULL;
+        }
+        if (deep) {
+            copy->input_file = copy_string(a, stage->input_file);
+            copy->output_file = copy_string(a, stage->output_file);
+            copy->error_file = copy_string(a, stage->error_file);
+        }
+        copy->next = NULL;
+        *link = copy;
+        link = &copy->next;
+    }
+    return first;
+}
+
+/**
+ * @brief       Tells whether a line starts with a keyword.
+ * 
+ * @param cmd   The parsed line.
+ * @param word  The keyword.
+ * @return bool True if the first word is the keyword.
+ */
+static bool is_keyword(const struct command_line *cmd, const char *word)
+{
+    return cmd->argc > 0 && strcmp(cmd->argv[0], word) == 0;
+}
+
+/**
+ * @brief       Tells whether a line is "NAME() {", which starts a function.
+ * 
+ * @param cmd   The parsed line.
+ * @return bool True if the line starts a function definition.
+ */
+static bool is_function_head(const struct command_line *cmd)
+{
+    size_t len = cmd->argc == 2 && cmd->next == NULL ? strlen(cmd->argv[0]) : 0;
+    return len > 2 && strcmp(cmd->argv[0] + len - 2, "()") == 0
+           && strcmp(cmd->argv[1], "{") == 0;
+}
+
+/**
+ * @brief       Tells whether a line read at the prompt starts a compound
+ *              command, or is a keyword that only means something inside
+ *              one, so that it goes to run_compound().
+ * 
+ * @param cmd   The parsed, not yet expanded, line.
+ * @return bool True if run_compound() handles the line.
+ */
+bool is_compound(const struct command_line *cmd)
+{
+    static const char *const keywords[] = {
+        "if", "then", "elif", "else", "fi", "while", "for", "do", "done", "}",
+        "break", "continue", "return",
+    };
+    for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++) {
+        if (is_keyword(cmd, keywords[i])) {
+            return true;
+        }
+    }
+    return is_function_head(cmd);
+}
+
+/**
+ * @brief       Reports a keyword or word where the grammar does not allow
+ *              it.
+ * 
+ * @param word  The word.
+ */
+static void unexpected_token(const char *word)
+{
+    fprintf(stderr, "syntax error near unexpected token `%s'\n", word);
+}
+
+/**
+ * @brief       Checks that a closing keyword (fi, done, }) is alone on its
+ *              line.
+ * 
+ * @param cmd   The line.
+ * @return bool True if nothing follows the keyword.
+ */
+static bool keyword_alone(const struct command_line *cmd)
+{
+    if (cmd->argc == 1 && cmd->next == NULL) {
+        return true;
+    }
+    unexpected_token(cmd->argc > 1 ? cmd->argv[1] : "|");
+    return false;
+}
+
+/**
+ * @brief       Reads the next line of a compound command, skipping lines
+ *              that run nothing. The line before it is freed.
+ * 
+ * @return struct command_line* 
+ *              The line in line_arena, or NULL at the end of the input,
+ *              which is reported.
+ */
+struct command_line *read_compound_line()
+{
+    while (true) {
+        arena_reset(&line_arena);
+        struct command_line *cmd = parse_input();
+        if (cmd == NULL) {
+            fprintf(stderr, "syntax error: unexpected end of file\n");
+            return NULL;
+        }
+        if (cmd->argc > 0) {
+            return cmd;
+        }
+    }
+}
+
+struct node *parse_node(struct arena *a, struct command_line *line);
+
+/**
+ * @brief       Parses a body: the words after the keyword that starts it,
+ *              if any, as its first command, then the lines up to one that
+ *              starts with one of the keywords that end it.
+ * 
+ * @param a     Arena for the nodes.
+ * @param line  The line with the keyword that starts the body.
+ * @param ends  The keywords that end the body, NULL-terminated.
+ * @param body  Receives the body.
+ * @param end   Receives the line that ended the body, in line_arena.
+ * @return bool False after a syntax error, which is reported.
+ */
+bool parse_body(struct arena *a, struct command_line *line, const char *const *ends,
+                struct node **body, struct command_line **end)
+{
+    struct node **link = body;
+    *body = NULL;
+    if (line != NULL && line->argc > 1) {
+        // "then CMD", "do CMD", "else CMD"
+        if ((*link = parse_node(a, copy_command(&line_arena, line, 1, false))) == NULL) {
+            return false;
+        }
+        link = &(*link)->next;
+    }
+    while (true) {
+        struct command_line *next = read_compound_line();
+        if (next == NULL) {
+            return false;
+        }
+        for (int i = 0; ends[i] != NULL; i++) {
+            if (is_keyword(next, ends[i])) {
+                *end = next;
+                return true;
+            }
+        }
+        if ((*link = parse_node(a, next)) == NULL) {
+            return false;
+        }
+        link = &(*link)->next;
+    }
+}
+
+/**
+ * @brief       Reads the line that must follow an if or while condition or
+ *              a for, then the body it starts.
+ * 
+ * @param a         Arena for the nodes.
+ * @param keyword   "then" or "do".
+ * @param ends      The keywords that end the body, NULL-terminated.
+ * @param body      Receives the body.
+ * @param end       Receives the line that ended the body.
+ * @return bool False after a syntax error, which is reported.
+ */
+bool parse_clause(struct arena *a, const char *keyword, const char *const *ends,
+                  struct node **body, struct command_line **end)
+{
+    struct command_line *line = read_compound_line();
+    if (line == NULL) {
+        return false;
+    }
+    if (!is_keyword(line, keyword)) {
+        unexpected_token(line->argv[0]);
+        return false;
+    }
+    return parse_body(a, line, ends, body, end);
+}
+
+/**
+ * @brief       Parses the condition of an if or while: the rest of the
+ *              line, optionally after a !.
+ * 
+ * @param a     Arena for the condition.
+ * @param node  The if or while.
+ * @param line  Its line.
+ * @return bool False after a syntax error, which is reported.
+ */
+bool parse_condition(struct arena *a, struct node *node, struct command_line *line)
+{
+    int skip = 1;
+    if (line->argc > 1 && strcmp(line->argv[1], "!") == 0) {
+        node->negate = true;
+        skip = 2;
+    }
+    if (line->argc == skip) {
+        unexpected_token("newline");
+        return false;
+    }
+    node->cmd = copy_command(a, line, skip, true);
+    return true;
+}
+
+/**
+ * @brief       Tells whether the first len bytes of a word are a valid
+ *              variable or function name.
+ * 
+ * @param name  The word.
+ * @param len   Length of the name.
+ * @return bool True if the name is valid.
+ */
+static bool valid_name(const char *name, size_t len)
+{
+    bool valid = len > 0 && is_name_char(name[0], true);
+    for (size_t i = 1; valid && i < len; i++) {
+        valid = is_name_char(name[i], false);
+    }
+    return valid;
+}
+
+/**
+ * @brief       Parses one line of a compound command. A line that starts
+ *              an if, while, for or function reads the lines up to its
+ *              end, so the whole body is parsed here, once, however often
+ *              it runs. Everything is copied into the arena, since each
+ *              line read frees the one before it.
+ * 
+ *              Keywords are only recognized as the first word of a line,
+ *              and then, do and else may be followed by a command.
+ * 
+ * @param a     Arena for the nodes; function bodies go to compound.kept.
+ * @param line  The line, in line_arena.
+ * @return struct node* 
+ *              The node, or NULL after a syntax error, which is reported.
+ */
+struct node *parse_node(struct arena *a, struct command_line *line)
+{
+    static const char *const if_ends[] = { "elif", "else", "fi", NULL };
+    static const char *const fi[] = { "fi", NULL };
+    static const char *const done[] = { "done", NULL };
+    static const char *const brace[] = { "}", NULL };
+    static const char *const stray[] = { "then", "elif", "else", "fi", "do", "done", "}" };
+    struct node *node = arena_calloc(a, sizeof(struct node));
+    struct command_line *end;
+
+    if (is_keyword(line, "if")) {
+        node->type = NODE_IF;
+        if (!parse_condition(a, node, line)
+                || !parse_clause(a, "then", if_ends, &node->body, &end)) {
+            return NULL;
+        }
+        if (is_keyword(end, "elif")) {
+            // the rest is an if of its own in the else body, which reads
+            // up to the one fi
+            struct command_line *elif = copy_command(&line_arena, end, 0, false);
+            elif->argv[0] = "if";
+            return (node->orelse = parse_node(a, elif)) != NULL ? node : NULL;
+        }
+        if (is_keyword(end, "else") && !parse_body(a, end, fi, &node->orelse, &end)) {
+            return NULL;
+        }
+        return keyword_alone(end) ? node : NULL;
+    }
+    if (is_keyword(line, "while")) {
+        node->type = NODE_WHILE;
+        if (!parse_condition(a, node, line)
+                || !parse_clause(a, "do", done, &node->body, &end)) {
+            return NULL;
+        }
+        return keyword_alone(end) ? node : NULL;
+    }
+    if (is_keyword(line, "for")) {
+        node->type = NODE_FOR;
+        if (line->argc < 2 || line->next != NULL
+                || (line->argc > 2 && strcmp(line->argv[2], "in") != 0)) {
+            unexpected_token(line->argc < 2 ? "newline" : line->next != NULL ? "|" : line->argv[2]);
+            return NULL;
+        }
+        if (!valid_name(line->argv[1], strlen(line->argv[1]))) {
+            fprintf(stderr, "for: `%s': not a valid identifier\n", line->argv[1]);
+            return NULL;
+        }
+        node->name = copy_string(a, line->argv[1]);
+        // without "in" the loop goes over $1 ...
+        node->cmd = line->argc > 2 ? copy_command(a, line, 3, true) : NULL;
+        if (!parse_clause(a, "do", done, &node->body, &end)) {
+            return NULL;
+        }
+        return keyword_alone(end) ? node : NULL;
+    }
+    if (is_function_head(line)) {
+        size_t len = strlen(line->argv[0]) - 2;
+        if (!valid_name(line->argv[0], len)) {
+            fprintf(stderr, "`%.*s': not a valid function name\n", (int) len, line->argv[0]);
+            return NULL;
+        }
+        node->type = NODE_FUNCTION;
+        char *name = arena_alloc(&compound.kept, len + 1);
+        memcpy(name, line->argv[0], len);
+        name[len] = '\0';
+        node->name = name;
+        // the body outlives the command that defines it
+        if (!parse_body(&compound.kept, NULL, brace, &node->body, &end)) {
+            return NULL;
+        }
+        return keyword_alone(end) ? node : NULL;
+    }
+    if (is_keyword(line, "break") || is_keyword(line, "continue")) {
+        node->type = line->argv[0][0] == 'b' ? NODE_BREAK : NODE_CONTINUE;
+        return keyword_alone(line) ? node : NULL;
+    }
+    if (is_keyword(line, "return")) {
+        node->type = NODE_RETURN;
+        node->cmd = line->argc > 1 ? copy_command(a, line, 1, true) : NULL;
+        return node;
+    }
+    for (size_t i = 0; i < sizeof(stray) / sizeof(stray[0]); i++) {
+        if (is_keyword(line, stray[i])) {
+            unexpected_token(stray[i]);
+            return NULL;
+        }
+    }
+    node->type = NODE_COMMAND;
+    node->cmd = copy_command(a, line, 0, true);
+    return node;
+}
+
+/**
+ * @brief       Runs one command of a compound command or function. The
+ *              parsed command is kept for the next run, so run_command()
+ *              gets a copy, or the expanded command, and everything the
+ *              line allocates is freed when it is done.
+ * 
+ * @param cmd   The parsed command.
+ * @return enum flow 
+ *              FLOW_INTERRUPT if Ctrl+C stopped it, FLOW_NEXT otherwise.
+ */
+enum flow run_line(struct command_line *cmd)
+{
+    reap_background_processes();
+    trim_job_table();
+    struct arena_mark mark = arena_save(&line_arena);
+    struct command_line *run = expand_command(cmd);
+    if (run == cmd) {
+        run = copy_command(&line_arena, cmd, 0, false);
+    }
+    run_command(run);
+    arena_restore(&line_arena, mark);
+
+    // Ctrl+C reaches the shell itself when no child has the terminal, and
+    // kills the foreground job when one does
+    if (sigint_received || fg_interrupted) {
+        compound.interrupted = true;
+    }
+    return compound.interrupted ? FLOW_INTERRUPT : FLOW_NEXT;
+}
+
+/**
+ * @brief       Runs the condition of an if or while.
+ * 
+ * @param node  The if or while.
+ * @param flow  Receives FLOW_INTERRUPT if Ctrl+C stopped it.
+ * @return bool True if the condition exited 0, or did not with a !.
+ */
+bool run_condition(struct node *node, enum flow *flow)
+{
+    *flow = run_line(node->cmd);
+    bool ok = prev_fg_status.exited && prev_fg_status.code == 0;
+    if (node->negate) {
+        set_exit_status(ok);
+    }
+    return ok != node->negate;
+}
+
+enum flow run_nodes(struct node *node);
+
+/**
+ * @brief       Sets the variable of a for loop. The loop owns a NAME=VALUE
+ *              buffer that it puts in environ and overwrites for each
+ *              item, since every setenv() value of a long loop would
+ *              stay allocated.
+ * 
+ * @param buf   The buffer, with NAME= filled in and room for the longest
+ *              item.
+ * @param len   Length of NAME=.
+ * @param value The item.
+ */
+void set_loop_variable(char *buf, size_t len, const char *value)
+{
+    strcpy(buf + len, value);
+    buf[len - 1] = '\0';
+    const char *current = getenv(buf);
+    buf[len - 1] = '=';
+    if (current != buf + len) {
+        // first item, or the body assigned the variable itself
+        putenv(buf);
+        invalidate_env_index();
+    }
+}
+
+/**
+ * @brief       Runs a while or for loop. Its status is that of the last
+ *              command of the body, or 0 if the body never ran.
+ * 
+ * @param node  The loop.
+ * @return enum flow 
+ *              FLOW_RETURN or FLOW_INTERRUPT if the body ended the
+ *              function or everything, FLOW_NEXT otherwise.
+ */
+enum flow run_loop(struct node *node)
+{
+    struct last_status status = { .exited = true, .code = 0 };
+    enum flow flow = FLOW_NEXT;
+    struct arena_mark mark = arena_save(&line_arena);
+    char **items = compound.args;
+    int nitems = compound.nargs;
+    char *buf = NULL;
+    size_t len = 0;
+    if (node->type == NODE_FOR) {
+        if (node->cmd != NULL) {
+            struct command_line *list = expand_command(node->cmd);
+            items = list->argv;
+            nitems = list->argc;
+        }
+        size_t longest = 0;
+        for (int i = 0; i < nitems; i++) {
+            size_t n = strlen(items[i]);
+            longest = n > longest ? n : longest;
+        }
+        len = strlen(node->name) + 1;
+        buf = malloc(len + longest + 1);
+        if (buf == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        memcpy(buf, node->name, len - 1);
+        buf[len - 1] = '=';
+    }
+
+    compound.loops++;
+    for (int i = 0; flow == FLOW_NEXT; i++) {
+        if (node->type == NODE_WHILE) {
+            if (!run_condition(node, &flow) || flow != FLOW_NEXT) {
+                break;
+            }
+        } else if (i == nitems) {
+            break;
+        } else {
+            set_loop_variable(buf, len, items[i]);
+        }
+        flow = run_nodes(node->body);
+        status = prev_fg_status;
+        if (flow == FLOW_BREAK) {
+            flow = FLOW_NEXT;
+            break;
+        }
+        if (flow == FLOW_CONTINUE) {
+            flow = FLOW_NEXT;
+        }
+    }
+    compound.loops--;
+
+    if (buf != NULL) {
+        // the variable keeps the last item, in a copy environ can own
+        const char *value = getenv(node->name);
+        if (value == buf + len && setenv(node->name, value, 1) == -1) {
+            perror("setenv");
+            unsetenv(node->name);
+        }
+        invalidate_env_index();
+        free(buf);
+    }
+    arena_restore(&line_arena, mark);
+    if (flow == FLOW_NEXT) {
+        prev_fg_status = status;
+    }
+    return flow;
+}
+
+/**
+ * @brief       Finds a function by name.
+ * 
+ * @param name  The name.
+ * @return struct function* 
+ *              The function, or NULL.
+ */
+struct function *find_function(const char *name)
+{
+    for (struct function *f = compound.functions; f != NULL; f = f->next) {
+        if (strcmp(f->name, name) == 0) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief       Runs a return: sets $? to its value, if it has one.
+ * 
+ * @param node  The return.
+ * @return enum flow 
+ *              FLOW_RETURN, or FLOW_NEXT outside a function.
+ */
+enum flow run_return(struct node *node)
+{
+    if (compound.depth == 0) {
+        fprintf(stderr, "return: can only `return' from a function\n");
+        set_exit_status(1);
+        return FLOW_NEXT;
+    }
+    if (node->cmd != NULL) {
+        struct arena_mark mark = arena_save(&line_arena);
+        struct command_line *value = expand_command(node->cmd);
+        char *end = NULL;
+        long code = value->argc > 0 ? strtol(value->argv[0], &end, 10) : 0;
+        if (value->argc > 0 && (*value->argv[0] == '\0' || *end != '\0')) {
+            fprintf(stderr, "return: %s: numeric argument required\n", value->argv[0]);
+            code = 2;
+        }
+        arena_restore(&line_arena, mark);
+        set_exit_status(code & 255);
+    }
+    return FLOW_RETURN;
+}
+
+/**
+ * @brief       Runs one node of a compound command.
+ * 
+ * @param node  The node.
+ * @return enum flow 
+ *              How the rest of the enclosing bodies continue.
+ */
+enum flow run_node(struct node *node)
+{
+    enum flow flow = FLOW_NEXT;
+    switch (node->type) {
+    case NODE_COMMAND:
+        return run_line(node->cmd);
+    case NODE_IF: {
+        bool taken = run_condition(node, &flow);
+        if (flow != FLOW_NEXT) {
+            return flow;
+        }
+        if (taken) {
+            return run_nodes(node->body);
+        }
+        if (node->orelse != NULL) {
+            return run_nodes(node->orelse);
+        }
+        set_exit_status(0);
+        return FLOW_NEXT;
+    }
+    case NODE_WHILE:
+    case NODE_FOR:
+        return run_loop(node);
+    case NODE_FUNCTION: {
+        struct function *f = find_function(node->name);
+        if (f == NULL) {
+            f = arena_calloc(&compound.kept, sizeof(struct function));
+            f->name = node->name;
+            f->next = compound.functions;
+            compound.functions = f;
+        }
+        f->body = node->body;
+        set_exit_status(0);
+        return FLOW_NEXT;
+    }
+    case NODE_BREAK:
+    case NODE_CONTINUE:
+        set_exit_status(0);
+        if (compound.loops == 0) {
+            fprintf(stderr, "%s: only meaningful in a loop\n",
+                    node->type == NODE_BREAK ? "break" : "continue");
+            return FLOW_NEXT;
+        }
+        return node->type == NODE_BREAK ? FLOW_BREAK : FLOW_CONTINUE;
+    case NODE_RETURN:
+        return run_return(node);
+    }
+    return FLOW_NEXT;
+}
+
+/**
+ * @brief       Runs a body until it ends or something in it breaks,
+ *              continues, returns or is interrupted.
+ * 
+ * @param node  The first node of the body.
+ * @return enum flow 
+ *              FLOW_NEXT if the whole body ran.
+ */
+enum flow run_nodes(struct node *node)
+{
+    for (; node != NULL; node = node->next) {
+        enum flow flow = run_node(node);
+        if (flow != FLOW_NEXT) {
+            return flow;
+        }
+    }
+    return FLOW_NEXT;
+}
+
+/**
+ * @brief       Runs a shell function in the shell, like a built-in: the
+ *              arguments become $1 ... until it returns, and its status is
+ *              that of its last command or of return.
+ * 
+ * @param cmd   The call.
+ */
+void run_function(struct command_line *cmd)
+{
+    struct node *body = find_function(cmd->argv[0])->body;
+    if (compound.depth == FUNCTION_DEPTH_MAX) {
+        fprintf(stderr, "%s: maximum function nesting level exceeded\n", cmd->argv[0]);
+        set_exit_status(1);
+        return;
+    }
+    if (compound.depth == 0 && compound.loops == 0) {
+        // called at the prompt
+        sigint_received = 0;
+        fg_interrupted = false;
+        compound.interrupted = false;
+    }
+    char **args = compound.args;
+    int nargs = compound.nargs;
+    int loops = compound.loops;
+    compound.args = cmd->argv + 1;
+    compound.nargs = cmd->argc - 1;
+    compound.loops = 0;
+    compound.depth++;
+    set_exit_status(0);
+    run_nodes(body);
+    compound.depth--;
+    compound.loops = loops;
+    compound.args = args;
+    compound.nargs = nargs;
+}
+
+/**
+ * @brief       Reads the rest of a compound command that starts with this
+ *              line, with the "> " prompt, then runs it. Nothing in it is
+ *              parsed again while it runs. A syntax error drops the lines
+ *              read so far.
+ * 
+ * @param cmd   The first line, not yet expanded.
+ */
+void run_compound(struct command_line *cmd)
+{
+    prompt = "> ";
+    struct node *node = parse_node(&compound.arena, cmd);
+    prompt = ": ";
+    if (node != NULL) {
+        sigint_received = 0;
+        fg_interrupted = false;
+        compound.interrupted = false;
+        run_node(node);
+        compound.interrupted = false;
+    }
+    arena_reset(&compound.arena);
+}
+
+
+/**
+ * @brief       Copies everything in a capture file to a stream, with
+ *              sendfile() where the stream allows it.
+ * 
+ * @param from  The capture file.
+ * @param to    The stream.
+ */
+void copy_output(int from, int to)
+{
+    struct stat st;
+    if (fstat(from, &st) == -1) {
+        return;
+    }
+    off_t off = 0;
+    while (off < st.st_size) {
+        ssize_t n = sendfile(to, from, &off, st.st_size - off);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && errno == EINVAL) {
+            // e.g. an O_APPEND stdout: copy through a buffer instead
+            char buf[16 * 1024];
+            n = pread(from, buf, sizeof(buf), off);
+            for (ssize_t done = 0, w; n > 0 && done < n; done += w) {
+                w = write(to, buf + done, n - done);
+                if (w <= 0) {
+                    return;
+                }
+            }
+            off += n > 0 ? n : 0;
+        }
+        if (n <= 0) {
+            return;
+        }
+    }
+}
+
+/**
+ * @brief       Records that a batched command has finished. Called by the
+ *              reaper when the last process of its job is reaped.
+ * 
+ * @param job   The job of the command.
+ */
+void batch_finished(struct job *job)
+{
+    struct batch_entry *entry = &batch.entries[job->batch - 1];
+    trace_command(&job->trace, job->pid, job->status, &job->start, &job->end);
+    set_wait_status(&entry->status, job->status);
+    entry->status.has_usage = true;
+    entry->status.usage = job->usage;
+    entry->status.start = job->start;
+    entry->status.end = job->end;
+    for (int i = 0; i < entry->nfiles; i++) {
+        free(entry->files[i].name);
+    }
+    entry->nfiles = 0;
+    entry->done = true;
+    batch.running--;
+}
+
+/**
+ * @brief       Reports the finished lines at the front of the batch queue:
+ *              their output is written and their status becomes the last
+ *              foreground status, in script order.
+ */
+void batch_flush()
+{
+    while (batch.count > 0 && batch.entries[batch.head].done) {
+        struct batch_entry *entry = &batch.entries[batch.head];
+        fflush(stdout);
+        fflush(stderr);
+        copy_output(entry->out_fd, STDOUT_FILENO);
+        copy_output(entry->err_fd, STDERR_FILENO);
+        close(entry->out_fd);
+        close(entry->err_fd);
+        if (entry->sets_status) {
+            prev_fg_status = entry->status;
+            if (prev_fg_status.terminated) {
+                print_termination(&prev_fg_status);
+                fflush(stdout);
+            }
+        }
+        batch.head = (batch.head + 1) % batch.capacity;
+        batch.count--;
+    }
+}
+
+/**
+ * @brief       Sleeps until a child exits, then reaps it and reports what
+ *              the queue allows.
+ */
+void batch_wait()
+{
+    struct pollfd fds[2] = {
+        { .fd = sigchld_fd, .events = POLLIN },
+        { .fd = zygote.fd,  .events = POLLIN },
+    };
+    if (poll(fds, 2, -1) == -1 && errno != EINTR) {
+        perror("poll");
+        exit(1);
+    }
+    metrics_watched();
+    reap_background_processes();
+    batch_flush();
+}
+
+/**
+ * @brief       Waits for every batched line and reports them all. Anything
+ *              that may depend on earlier lines runs after this.
+ */
+void batch_drain()
+{
+    batch_flush();
+    while (batch.count > 0) {
+        batch_wait();
+    }
+}
+
+/**
+ * @brief       Whether a word expands $? or $!, whose values depend on the
+ *              lines before it having finished. A $ inside $(...) is still
+ *              plain text at this point.
+ * 
+ * @param word  The word, as marked by the lexer.
+ * @return bool 
+ */
+static bool word_uses_status(const char *word)
+{
+    for (const char *p = word; (p = strpbrk(p, "\x01\x02$")) != NULL; p++) {
+        if (p[1] == '?' || p[1] == '!') {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief       Whether an unexpanded command uses $? or $! in any word or
+ *              redirection.
+ * 
+ * @param cmd   The command as parsed.
+ * @return bool 
+ */
+bool batch_uses_status(struct command_line *cmd)
+{
+    for (struct command_line *stage = cmd; stage; stage = stage->next) {
+        for (int i = 0; i < stage->argc; i++) {
+            if (word_uses_status(stage->argv[i])) {
+                return true;
+            }
+        }
+        const char *files[] = { stage->input_file, stage->output_file, stage->error_file };
+        for (int i = 0; i < 3; i++) {
+            if (files[i] != NULL && word_uses_status(files[i])) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief       Collects the files a command redirects to or from. Devices
+ *              such as /dev/null are left out, sharing them is harmless.
+ * 
+ * @param cmd   The command.
+ * @param files Receives up to BATCH_FILES names, not copied.
+ * @return int  The number of files, or -1 if there are too many to track.
+ */
+static int batch_files(struct command_line *cmd, struct batch_file *files)
+{
+    int n = 0;
+    for (struct command_line *stage = cmd; stage; stage = stage->next) {
+        struct batch_file found[] = {
+            { stage->input_file, false },
+            { stage->output_file, true },
+            { stage->error_file, true },
+        };
+        for (int i = 0; i < 3; i++) {
+            if (found[i].name == NULL || strncmp(found[i].name, "/dev/", 5) == 0) {
+                continue;
+            }
+            if (n == BATCH_FILES) {
+                return -1;
+            }
+            files[n++] = found[i];
+        }
+    }
+    return n;
+}
+
+/**
+ * @brief       Whether a command would write a file a running batched
+ *              command uses, or use a file one of them writes.
+ * 
+ * @param files The command's files.
+ * @param n     Their number.
+ * @return bool 
+ */
+static bool batch_conflicts(const struct batch_file *files, int n)
+{
+    for (int e = 0; e < batch.count; e++) {
+        const struct batch_entry *entry = &batch.entries[(batch.head + e) % batch.capacity];
+        for (int i = 0; !entry->done && i < entry->nfiles; i++) {
+            for (int j = 0; j < n; j++) {
+                if ((files[j].write || entry->files[i].write)
+                        && strcmp(files[j].name, entry->files[i].name) == 0) {
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief       Recognizes the comments that start and end a region of lines
+ *              the batch executor may run at the same time:
+ *              "# smallsh: parallel" and "# smallsh: serial".
+ * 
+ * @param line  The line as read.
+ * @param len   Its length.
+ * @return int  1 for parallel, 0 for serial, -1 for any other line.
+ */
+int batch_directive(const char *line, size_t len)
+{
+    static const char *const words[] = { "#", "smallsh:", NULL };
+    size_t i = 0;
+    for (int w = 0; words[w] != NULL; w++) {
+        while (i < len && (line[i] == ' ' || line[i] == '\t')) {
+            i++;
+        }
+        size_t n = strlen(words[w]);
+        if (len - i < n || memcmp(line + i, words[w], n) != 0) {
+            return -1;
+        }
+        i += n;
+    }
+    while (i < len && (line[i] == ' ' || line[i] == '\t')) {
+        i++;
+    }
+    while (len > i && (line[len - 1] == ' ' || line[len - 1] == '\t')) {
+        len--;
+    }
+    if (len - i == 8 && memcmp(line + i, "parallel", 8) == 0) {
+        return 1;
+    }
+    if (len - i == 6 && memcmp(line + i, "serial", 6) == 0) {
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * @brief       Starts an expanded script line in the batch, alongside the
+ *              lines already running. Programs and pipelines run with their
+ *              output held in memory files until the lines before them are
+ *              reported, and read /dev/null unless they redirect stdin.
+ *              Built-ins that only produce output run at once into such
+ *              files too, and & lines start as usual with their message
+ *              held back.
+ * 
+ *              Only & lines and the lines of a "# smallsh: parallel"
+ *              region are batched; any other line is a barrier, run once
+ *              the batch has finished. Lines that change the shell (cd,
+ *              export, exit, ...) or use the time and limit prefixes are
+ *              barriers too, and a line that shares a file with a running
+ *              one waits for the batch to finish first.
+ * 
+ * @param cmd   The expanded command.
+ * @return bool False if the line must run the usual way, after
+ *              batch_drain().
+ */
+bool batch_add(struct command_line *cmd)
+{
+    if (cmd->argc == 0 || cmd->argv[0][0] == '#') {
+        // comment line
+        return true;
+    }
+    for (struct command_line *stage = cmd; stage; stage = stage->next) {
+        if (stage->argc == 0) {
+            // run_command reports the syntax error
+            return false;
+        }
+    }
+    const struct builtin *builtin = cmd->next == NULL ? find_builtin(cmd->argv[0]) : NULL;
+    if (builtin != NULL && builtin->has_program && !builtin_handles(builtin, cmd)) {
+        // runs as the program
+        builtin = NULL;
+    }
+    bool bg = cmd->is_bg && !fg_only;
+    if (!bg && !batch.parallel) {
+        // may depend on the lines before it in ways no redirection shows
+        return false;
+    }
+    if ((builtin != NULL && !builtin->has_program) || find_function(cmd->argv[0]) != NULL
+            || strcmp(cmd->argv[0], "time") == 0 || strcmp(cmd->argv[0], "limit") == 0) {
+        return false;
+    }
+    struct batch_file files[BATCH_FILES];
+    int nfiles = bg ? 0 : batch_files(cmd, files);
+    if (nfiles == -1) {
+        return false;
+    }
+    if (batch_conflicts(files, nfiles)) {
+        batch_drain();
+    }
+    batch_flush();
+    while (batch.running >= batch.limit || batch.count == batch.capacity) {
+        batch_wait();
+    }
+
+    int out_fd = memfd_create("smallsh-batch", MFD_CLOEXEC);
+    int err_fd = memfd_create("smallsh-batch", MFD_CLOEXEC);
+    if (out_fd == -1 || err_fd == -1) {
+        perror("memfd_create");
+        if (out_fd != -1) {
+            close(out_fd);
+        }
+        return false;
+    }
+    int slot = (batch.head + batch.count) % batch.capacity;
+    struct batch_entry *entry = &batch.entries[slot];
+    *entry = (struct batch_entry) { .out_fd = out_fd, .err_fd = err_fd };
+    batch.count++;
 
-static struct last_status prev_fg_status = {false, false,0 };
+    fflush(stdout);
+    fflush(stderr);
+    int saved[3];
+    int fds[3] = { dev_null(), out_fd, err_fd };
+    for (int i = 0; i < 3; i++) {
+        saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+        dup2(fds[i], i);
+    }
+
+    if (bg) {
+        // runs as a background job, only "background pid is N" is held
+        run_command(cmd);
+        entry->done = true;
+    } else if (builtin != NULL) {
+        run_builtin(builtin, cmd);
+        entry->status = prev_fg_status;
+        entry->sets_status = true;
+        entry->done = true;
+    } else {
+        int nstages = count_stages(cmd);
+        pid_t pids[nstages];
+        uint16_t paths[nstages];
+        struct trace_info trace = { 0 };
+        launch_pipeline(cmd, false, pids, paths, &trace);
+        int id = add_bg_job(pids, nstages);
+        struct job *job = &job_table.slots[id - 1];
+        job->batch = slot + 1;
+        job->trace = trace;
+        entry->sets_status = true;
+        for (int i = 0; i < nfiles; i++) {
+            entry->files[i] = (struct batch_file) { strdup(files[i].name), files[i].write };
+        }
+        entry->nfiles = nfiles;
+        batch.running++;
+    }
 
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < 3; i++) {
+        dup2(saved[i], i);
+        close(saved[i]);
+    }
+    return true;
+}
 
 /**
- * @brief           Handler for SIGTSTP. Forces the shell into a foreground only mode
- *                  and ignores all & commands to run a background process.
- * 
- * @param signo     The signal number that is passed to the handler
+ * @brief       Turns on the batch executor if SMALLSH_BATCH is set and the
+ *              shell runs a script. Its value is the number of lines run at
+ *              once, one per online CPU if it is empty.
  */
-void handle_SIGTSTP(int signo){
-    // signal_received = true;
-    const char *msg_enter = "\nEntering foreground-only mode (& is now ignored)\n";
-    const char *msg_exit  = "\nExiting foreground-only mode\n";
-    if (!fg_only) {
-        fg_only = 1;
-        write(STDOUT_FILENO, msg_enter, strlen(msg_enter));
-    } else {
-        fg_only = 0;
-        write(STDOUT_FILENO, msg_exit, strlen(msg_exit));
+void init_batch()
+{
+    const char *value = getenv("SMALLSH_BATCH");
+    if (value == NULL || interactive) {
+        return;
+    }
+    long limit = *value != '\0' ? strtol(value, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (limit < 2) {
+        // one line at a time is the usual loop
+        return;
+    }
+    batch.limit = limit;
+    batch.capacity = limit * BATCH_QUEUE_FACTOR;
+    batch.entries = calloc(batch.capacity, sizeof(struct batch_entry));
+    if (batch.entries == NULL) {
+        perror("calloc");
+        exit(1);
     }
-    // Flush any pending input from the terminal.
-    fflush(stdout);
 }
 
 /**
- * @brief           Signal handler for SIGINT. Ignores the signal for parent
- *                  and does not do anything.
+ * @brief       Queues a session to be looked at once the current events are
+ *              handled: to start its next request, finish its command or
+ *              close it.
  * 
- * @param signo     The signal number passed to the handler.
+ * @param s     The session.
  */
-void handle_SIGINT(int signo){
-    // ignore signal for parent
-    // this handler will not be passed down to child processes
+void session_ready(struct session *s)
+{
+    if (s->queued) {
+        return;
+    }
+    if (server.nready == server.ready_cap) {
+        server.ready_cap = server.ready_cap ? server.ready_cap * 2 : 64;
+        server.ready = realloc(server.ready, server.ready_cap * sizeof(int));
+        if (server.ready == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    server.ready[server.nready++] = s->id;
+    s->queued = true;
 }
 
 /**
- * @brief           Iterates through the background process global array to 
- *                  check for background proccesses that have ended. If the
- *                  process has ended, the status is printed and the pid 
- *                  removed from the array. 
+ * @brief       Sets what the event loop waits for on a session. Requests
+ *              are read while fewer than SERVER_IN_MAX bytes are waiting,
+ *              and the output pipes of its command are paused while the
+ *              client is more than SERVER_OUT_MAX bytes behind, so a slow
+ *              client holds back its command instead of growing the shell.
+ * 
+ * @param s     The session.
  */
-void check_background_processes() {
-    int bgStatus;
-    for (int i = 0; i < MAX_BG_PC; i++) {
-        if (background_processes[i] != 0) {  // if this slot has a valid PID
-            pid_t result = waitpid(background_processes[i], &bgStatus, WNOHANG);
-            if (result > 0) { // Process finished
-                if (WIFEXITED(bgStatus)) {
-                    printf("background pid %d is done: exit value %d\n", 
-                           result, WEXITSTATUS(bgStatus));
-                } else if (WIFSIGNALED(bgStatus)) {
-                    printf("background pid %d is done: terminated by signal %d\n", 
-                           result, WTERMSIG(bgStatus));
-                }
-                fflush(stdout);
-                // Remove the PID from the array now that it's been reaped.
-                background_processes[i] = 0;
+void session_update(struct session *s)
+{
+    if (s->fd == -1) {
+        return;
+    }
+    size_t backlog = s->out_len - s->out_sent;
+    uint32_t events = (!s->eof && s->in_len - s->in_start < SERVER_IN_MAX ? EPOLLIN : 0)
+                      | (backlog > 0 ? EPOLLOUT : 0);
+    if (events != s->events) {
+        struct epoll_event ev = { .events = events, .data.u64 = SERVER_EVENT(SERVER_CLIENT, s->id) };
+        epoll_ctl(server.epoll_fd, EPOLL_CTL_MOD, s->fd, &ev);
+        s->events = events;
+    }
+    bool paused = backlog > SERVER_OUT_MAX;
+    if (paused != s->paused) {
+        for (int i = 0; i < 2; i++) {
+            if (s->pipes[i] != -1) {
+                struct epoll_event ev = {
+                    .events = paused ? 0 : EPOLLIN,
+                    .data.u64 = SERVER_EVENT(SERVER_STDOUT + i, s->id),
+                };
+                epoll_ctl(server.epoll_fd, EPOLL_CTL_MOD, s->pipes[i], &ev);
             }
         }
+        s->paused = paused;
     }
 }
 
+/**
+ * @brief       Drops a client whose socket failed. A running command is
+ *              sent SIGHUP and the session is freed when it is reaped.
+ * 
+ * @param s     The session.
+ */
+void session_abort(struct session *s)
+{
+    if (s->fd != -1) {
+        close(s->fd);
+        s->fd = -1;
+    }
+    s->eof = true;
+    s->in_len = s->in_start = 0;
+    s->out_len = s->out_sent = 0;
+    if (s->job != 0) {
+        int slot = s->job - 1;
+        for (int b = 0; b <= job_table.index_mask; b++) {
+            if (job_table.index[b].pid != 0 && job_table.index[b].slot == slot) {
+                kill(job_table.index[b].pid, SIGHUP);
+            }
+        }
+    }
+    if (s->paused) {
+        // nobody reads the output, but the command must not block on it
+        for (int i = 0; i < 2; i++) {
+            if (s->pipes[i] != -1) {
+                struct epoll_event ev = {
+                    .events = EPOLLIN,
+                    .data.u64 = SERVER_EVENT(SERVER_STDOUT + i, s->id),
+                };
+                epoll_ctl(server.epoll_fd, EPOLL_CTL_MOD, s->pipes[i], &ev);
+            }
+        }
+        s->paused = false;
+    }
+    session_ready(s);
+}
 
 /**
- * @brief       Adds a background process pid to the global array. 
+ * @brief       Sends pending output until the socket would block. A client
+ *              that has gone away is dropped: its queued requests are
+ *              discarded and its running command gets SIGHUP.
  * 
- * @param pid   The pid of the background process.
+ * @param s     The session.
  */
-void add_bg_process(int pid) {
-    for (int i = 0; i < MAX_BG_PC; i++) {
-        if (background_processes[i] == 0) {
-            background_processes[i] = pid;
+void session_flush(struct session *s)
+{
+    while (s->out_sent < s->out_len) {
+        ssize_t n = send(s->fd, s->out + s->out_sent, s->out_len - s->out_sent,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n > 0) {
+            s->out_sent += n;
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            session_abort(s);
             return;
         }
     }
+    if (s->out_sent == s->out_len) {
+        s->out_len = s->out_sent = 0;
+    }
+    session_update(s);
+    if (s->out_len == 0 && s->eof) {
+        session_ready(s);
+    }
 }
 
 /**
- * @brief           Gets input from the user and parses it for commands. 
- *                  Creates a command_line struct with data about the command.
- *                  Parses I/O redirection and background process flags.
+ * @brief       Appends to a session's pending output and sends as much of
+ *              it as the socket takes without blocking. What is left waits
+ *              for EPOLLOUT.
  * 
- * @return struct command_line* 
- *                  Returns the command_line struct with the data about the 
- *                  command. 
+ * @param s     The session.
+ * @param data  Bytes to send.
+ * @param len   Their number.
  */
-struct command_line *parse_input()
+void session_send(struct session *s, const char *data, size_t len)
 {
-    char input[INPUT_LENGTH];
-    struct command_line *curr_command = (struct command_line *) calloc(1,sizeof(struct command_line));
-    // Get input
-    printf(": ");
-    fflush(stdout);
-    fgets(input, INPUT_LENGTH, stdin);
-    // Tokenize the input
-    char *token = strtok(input, " \n");
-    while(token){
-        if (!strcmp(token,"<")){
-            curr_command->input_file = strdup(strtok(NULL," \n"));
-        } else if(!strcmp(token,">")){
-            curr_command->output_file = strdup(strtok(NULL," \n"));
-        } else if(!strcmp(token,"&")){
-            curr_command->is_bg = true;
-        } else{
-            curr_command->argv[curr_command->argc++] = strdup(token);
-        }
-        token=strtok(NULL," \n");
+    if (s->fd == -1) {
+        return;
     }
-    return curr_command;
+    if (s->out_len + len > s->out_cap) {
+        size_t capacity = s->out_cap ? s->out_cap : 4096;
+        while (capacity < s->out_len + len) {
+            capacity *= 2;
+        }
+        s->out = realloc(s->out, capacity);
+        if (s->out == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        s->out_cap = capacity;
+    }
+    memcpy(s->out + s->out_len, data, len);
+    s->out_len += len;
+    session_flush(s);
 }
 
 /**
- * @brief       Frees the command line struct from memory.
+ * @brief       Sends a frame: a header line such as "out 12" followed by
+ *              the data, or "done 0" on its own.
  * 
- * @param cmd   Command to be freed.
+ * @param s     The session.
+ * @param kind  "out", "err" or "done".
+ * @param value The data length, or the status for done.
+ * @param data  The data, or NULL.
  */
-void free_command(struct command_line *cmd)
+void session_frame(struct session *s, const char *kind, long value, const char *data)
+{
+    char header[32];
+    session_send(s, header, snprintf(header, sizeof(header), "%s %ld\n", kind, value));
+    if (data != NULL && value > 0) {
+        session_send(s, data, value);
+    }
+}
+
+/**
+ * @brief       Sends the contents of a capture file as a frame.
+ * 
+ * @param s     The session.
+ * @param kind  "out" or "err".
+ * @param fd    The capture file, closed here.
+ */
+void session_send_capture(struct session *s, const char *kind, int fd)
 {
-    // Free the strings in argv[]
-    for (int i = 0; i < cmd->argc; i++) {
-        free(cmd->argv[i]);
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            session_frame(s, kind, st.st_size, map);
+            munmap(map, st.st_size);
+        }
     }
+    close(fd);
+}
+
+/**
+ * @brief       Records that the command of a session has been reaped.
+ *              Called by the reaper for jobs started by the server.
+ * 
+ * @param job   The job of the command.
+ */
+void session_finished(struct job *job)
+{
+    struct session *s = server.sessions[job->session - 1];
+    trace_command(&job->trace, job->pid, job->status, &job->start, &job->end);
+    set_wait_status(&s->status, job->status);
+    s->status.limit = limit_reason(job->cgroup, job->cpu_limited, job->status);
+    s->status.has_usage = true;
+    s->status.usage = job->usage;
+    s->status.start = job->start;
+    s->status.end = job->end;
+    s->job = 0;
+    session_ready(s);
+}
 
-    // Free the input_file and output_file if they were set
-    if (cmd->input_file) {
-        free(cmd->input_file);
+/**
+ * @brief       Starts the command of a request with its stdout and stderr
+ *              on pipes the event loop reads. It becomes a job of the
+ *              shell tagged with the session.
+ * 
+ * @param s     The session.
+ * @param cmd   The command.
+ */
+void session_launch(struct session *s, struct command_line *cmd)
+{
+    int out[2], err[2];
+    if (pipe2(out, O_CLOEXEC) == -1 || pipe2(err, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        exit(1);
     }
+    dup2(out[1], STDOUT_FILENO);
+    dup2(err[1], STDERR_FILENO);
+    close(out[1]);
+    close(err[1]);
 
-    if (cmd->output_file) {
-        free(cmd->output_file);
+    int nstages = count_stages(cmd);
+    pid_t pids[nstages];
+    uint16_t paths[nstages];
+    struct trace_info trace = { 0 };
+    launch_pipeline(cmd, false, pids, paths, &trace);
+    int id = add_bg_job(pids, nstages);
+    struct job *job = &job_table.slots[id - 1];
+    job->session = s->id + 1;
+    job->trace = trace;
+    take_limits(job);
+    s->job = id;
+    if (cmd->is_bg) {
+        // the & is ignored, but $! names the command as it would at the prompt
+        s->last_bg_pid = pids[nstages - 1];
     }
 
-    // Finally free the struct itself
-    free(cmd);
+    s->pipes[0] = out[0];
+    s->pipes[1] = err[0];
+    for (int i = 0; i < 2; i++) {
+        fcntl(s->pipes[i], F_SETFL, O_NONBLOCK);
+        struct epoll_event ev = {
+            .events = s->paused ? 0 : EPOLLIN,
+            .data.u64 = SERVER_EVENT(SERVER_STDOUT + i, s->id),
+        };
+        epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, s->pipes[i], &ev);
+    }
 }
 
 /**
- * @brief       Creates a child process in the foreground. Since it is a 
- *              foreground process, the parent process waits for the child
- *              to finish before continuing.
+ * @brief       Runs one request of a session the way run_command() runs a
+ *              line at the prompt, in the session's directory and with its
+ *              $?. stdin is /dev/null and a trailing & is ignored. What
+ *              the shell itself prints, built-ins included, is captured
+ *              and sent as frames; a command's output is streamed from
+ *              pipes by the event loop.
  * 
- *              If the command contains input and output redirection, the
- *              stdin and stdout are redirected. 
- * 
- * @param cmd   The command_line struct that contains the data needed to 
- *              run the command. 
+ * @param s     The session.
+ * @param cmd   The expanded command.
  */
-void foreground_process(struct command_line *cmd)
+void session_run(struct session *s, struct command_line *cmd)
 {
-    int fgStatus;
-  
-    // Fork a new process
-    pid_t childPid = fork();
-  
-    switch(childPid){
+    const struct builtin *builtin;
+    struct command_limits limits;
 
-        case -1:
-            perror("fork()\n");
-            exit(1);
-            break;
+    int out_fd = memfd_create("smallsh-server", MFD_CLOEXEC);
+    int err_fd = memfd_create("smallsh-server", MFD_CLOEXEC);
+    if (out_fd == -1 || err_fd == -1) {
+        perror("memfd_create");
+        exit(1);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    int saved[3];
+    int fds[3] = { dev_null(), out_fd, err_fd };
+    for (int i = 0; i < 3; i++) {
+        saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+        dup2(fds[i], i);
+    }
 
-        case 0:
+    s->timed = strip_time_prefix(cmd);
+    int limited = strip_limit_prefix(cmd, &limits);
+    launch_limits = limited == 1 ? &limits : NULL;
+    if (limited == -1) {
+        // error already reported
+        set_exit_status(1);
+    } else if (cmd->argc == 0 || cmd->argv[0][0] == '#') {
+        // comment line
+    } else if (!valid_pipeline(cmd)) {
+        // error already reported
+    } else if (cmd->next == NULL && (builtin = find_builtin(cmd->argv[0])) != NULL
+            && !(builtin->has_program && (launch_limits != NULL
+                                          || !builtin_handles(builtin, cmd)))) {
+        if (launch_limits != NULL) {
+            fprintf(stderr, "limit: %s: cannot limit a shell built-in\n",
+                    cmd->argv[0]);
+            set_exit_status(1);
+        } else if (builtin->run == run_exit) {
+            // ends the session, not the server
+            s->eof = true;
+            s->in_len = s->in_start = 0;
+        } else if (builtin->run == run_fg || builtin->run == run_bg
+                || builtin->run == run_jobs || builtin->run == run_parallel) {
+            fprintf(stderr, "%s: not available in server mode\n", builtin->name);
+            set_exit_status(1);
+        } else {
+            run_builtin(builtin, cmd);
+        }
+    } else {
+        session_launch(s, cmd);
+    }
 
-            if (cmd->input_file != NULL) {
-                // Open the source file
-                int sourceFD = open(cmd->input_file, O_RDONLY);
-                if (sourceFD == -1) { 
-                    printf("cannot open %s for input\n", cmd->input_file);
-                    exit(1); 
-                }
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < 3; i++) {
+        dup2(saved[i], i);
+        close(saved[i]);
+    }
+    if (launch_limits != NULL) {
+        // the cgroup is only still here if no job took it
+        release_cgroup(limits.cgroup);
+        if (limits.procs_fd != -1) {
+            close(limits.procs_fd);
+        }
+        launch_limits = NULL;
+    }
+    if (s->job == 0) {
+        s->status = prev_fg_status;
+    }
+    if (cmd->argc > 0 && strcmp(cmd->argv[0], "cd") == 0) {
+        close(s->cwd);
+        s->cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    }
+    session_send_capture(s, "out", out_fd);
+    session_send_capture(s, "err", err_fd);
+}
 
-                // Redirect stdin to source file
-                int in_result = dup2(sourceFD, 0);
-                if (in_result == -1) { 
-                    perror(cmd->input_file); 
-                    exit(2); 
-                }
+/**
+ * @brief       Moves a session forward: reports a command that has
+ *              finished, runs requests while they complete at once (built-
+ *              ins, blank lines) and frees the session once the client is
+ *              done and everything has been sent.
+ * 
+ * @param s     The session.
+ */
+void session_advance(struct session *s)
+{
+    s->queued = false;
+    if (s->busy && s->job == 0 && s->pipes[0] == -1 && s->pipes[1] == -1) {
+        s->busy = false;
+        if (s->timed && s->status.has_usage) {
+            char *text = NULL;
+            size_t len = 0;
+            FILE *f = open_memstream(&text, &len);
+            if (f != NULL) {
+                print_usage(f, &s->status);
+                fclose(f);
+                session_frame(s, "out", len, text);
+                free(text);
             }
+        }
+        if (s->status.terminated) {
+            char text[64];
+            int len = snprintf(text, sizeof(text), s->status.limit ? "terminated by signal %d (%s)\n"
+                               : "terminated by signal %d\n", s->status.code, s->status.limit);
+            session_frame(s, "out", len, text);
+        }
+        session_frame(s, "done", s->status.code + (s->status.terminated ? 128 : 0), NULL);
+    }
 
-            if (cmd->output_file != NULL) {
-                // Open target file
-                int targetFD = open(cmd->output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                if (targetFD == -1) { 
-                    perror(cmd->output_file); 
-                    exit(1); 
-                }
-
-                // Redirect stdout to target file
-                int out_result = dup2(targetFD, 1);
-                if (out_result == -1) { 
-                    perror(cmd->output_file); 
-                    exit(2); 
-                }
-            }
+    char *nl;
+    while (!s->busy && s->fd != -1
+            && (nl = memchr(s->in + s->in_start, '\n', s->in_len - s->in_start)) != NULL) {
+        char *line = s->in + s->in_start;
+        s->in_start = nl + 1 - s->in;
+        fchdir(s->cwd);
+        prev_fg_status = s->status;
+        last_bg_pid = s->last_bg_pid;
+        struct command_line *cmd = expand_command(parse_line(line, nl - line));
 
-            execvp(cmd->argv[0], cmd->argv);
-            // exec only returns if there is an error
-            perror(cmd->argv[0]);
-            exit(2);
+        // every request gets a done frame, even a blank line
+        s->busy = true;
+        session_run(s, cmd);
+        free_command(cmd);
+        if (s->job != 0) {
             break;
+        }
+        s->busy = false;
+        s->timed = false;
+        session_frame(s, "done", s->status.code + (s->status.terminated ? 128 : 0), NULL);
+    }
+    session_update(s);
 
-        default:
-            // Wait for child's termination
-            childPid = waitpid(childPid, &fgStatus, 0);
-            if (childPid == -1) {
-                perror("wait");
-            }
-            if (WIFSIGNALED(fgStatus)) {
-                prev_fg_status.terminated = true;
-                prev_fg_status.exited = false;
-                prev_fg_status.code = WTERMSIG(fgStatus);
-            } else if (WIFEXITED(fgStatus)) {
-                prev_fg_status.exited = true;
-                prev_fg_status.terminated = false;
-                prev_fg_status.code = WEXITSTATUS(fgStatus);
+    if (s->eof && !s->busy && s->job == 0 && (s->fd == -1 || s->out_sent == s->out_len)) {
+        if (s->fd != -1) {
+            close(s->fd);
+        }
+        close(s->cwd);
+        free(s->in);
+        free(s->out);
+        server.sessions[s->id] = NULL;
+        server.free_ids[server.nfree++] = s->id;
+        server.count--;
+        free(s);
+    }
+}
+
+/**
+ * @brief       Reads one of a session's command output pipes and forwards
+ *              what it got as a frame. At end of file the pipe is closed.
+ * 
+ * @param s     The session.
+ * @param which 0 for stdout, 1 for stderr.
+ */
+void session_read_pipe(struct session *s, int which)
+{
+    char buf[SERVER_READ];
+    ssize_t n = read(s->pipes[which], buf, sizeof(buf));
+    if (n > 0) {
+        session_frame(s, which == 0 ? "out" : "err", n, buf);
+    } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+        // a child that has not exec'd yet may hold the pipe too, and with
+        // it the epoll registration
+        epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, s->pipes[which], NULL);
+        close(s->pipes[which]);
+        s->pipes[which] = -1;
+        session_ready(s);
+    }
+}
+
+/**
+ * @brief       Reads requests from a client. Complete lines are run by
+ *              session_advance(); end of file means no more requests, and
+ *              the session closes once the last one has been answered.
+ * 
+ * @param s     The session.
+ */
+void session_read(struct session *s)
+{
+    if (s->in_start > 0) {
+        // drop the requests that have been run
+        s->in_len -= s->in_start;
+        memmove(s->in, s->in + s->in_start, s->in_len);
+        s->in_start = 0;
+    }
+    if (s->in_cap - s->in_len < SERVER_READ) {
+        s->in_cap = s->in_cap ? s->in_cap * 2 : SERVER_READ * 2;
+        s->in = realloc(s->in, s->in_cap);
+        if (s->in == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    ssize_t n = read(s->fd, s->in + s->in_len, s->in_cap - s->in_len);
+    if (n > 0) {
+        s->in_len += n;
+    } else if (n == 0) {
+        s->eof = true;
+        if (s->in_len > 0 && s->in[s->in_len - 1] != '\n') {
+            // a last request without a newline still runs
+            s->in[s->in_len++] = '\n';
+        }
+    } else if (errno != EAGAIN && errno != EINTR) {
+        session_abort(s);
+        return;
+    }
+    session_update(s);
+    session_ready(s);
+}
+
+/**
+ * @brief       Accepts every pending connection as a new session, which
+ *              starts in the server's working directory with status 0.
+ */
+void server_accept()
+{
+    int fd;
+    while ((fd = accept4(server.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        if (server.nfree == 0) {
+            int capacity = server.capacity ? server.capacity * 2 : JOB_TABLE_MIN;
+            server.sessions = realloc(server.sessions, capacity * sizeof(struct session *));
+            server.free_ids = realloc(server.free_ids, capacity * sizeof(int));
+            if (server.sessions == NULL || server.free_ids == NULL) {
+                perror("realloc");
+                exit(1);
             }
-            if (prev_fg_status.terminated) {
-                printf("terminated by signal %d\n", prev_fg_status.code);
+            for (int id = capacity - 1; id >= server.capacity; id--) {
+                server.sessions[id] = NULL;
+                server.free_ids[server.nfree++] = id;
             }
-            break;
-
+            server.capacity = capacity;
+        }
+        struct session *s = calloc(1, sizeof(struct session));
+        if (s == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        s->id = server.free_ids[--server.nfree];
+        s->fd = fd;
+        s->cwd = fcntl(server.cwd, F_DUPFD_CLOEXEC, 0);
+        s->pipes[0] = s->pipes[1] = -1;
+        s->status.exited = true;
+        server.sessions[s->id] = s;
+        server.count++;
+        s->events = EPOLLIN;
+        struct epoll_event ev = { .events = EPOLLIN, .data.u64 = SERVER_EVENT(SERVER_CLIENT, s->id) };
+        epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("accept4");
     }
 }
 
 /**
- * @brief       Creates a child process in the background. Since it is a 
- *              background process, the parent process does not wait for 
- *              the child to finish before continuing.
+ * @brief       Adds a descriptor to the server's epoll set for reading.
  * 
- *              If the command contains input and output redirection, the
- *              stdin and stdout are redirected, otherwise /dev/null is
- *              used.
+ * @param fd    The descriptor.
+ * @param data  Its SERVER_EVENT() tag.
+ */
+void server_watch(int fd, uint64_t data)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = data };
+    if (epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+/**
+ * @brief       `smallsh --server PATH`. Listens on a Unix socket and runs
+ *              the lines each client sends, one after another per client
+ *              and concurrently across clients, from a single epoll loop.
+ *              The loop also waits on the reaper's signalfd, so sessions
+ *              are told about exits as they happen. Does not return.
  * 
- * @param cmd   The command_line struct that contains the data needed to 
- *              run the command. 
+ * @param path  The socket path. A stale socket there is replaced.
  */
-void background_process(struct command_line *cmd)
+void run_server(const char *path)
 {
-    int bgStatus;
-  
-    // Fork a new process
-    pid_t childPid = fork();
-  
-    switch(childPid){
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
 
-        case -1:
-            perror("fork()\n");
-            exit(1);
-            break;
+    // every session holds a socket, a directory and two pipes
+    raise_nofile_limit();
 
-        case 0:
-            char *src_file;
-            if (cmd->input_file != NULL) {
-                src_file = strdup(cmd->input_file);
-            } else {
-                src_file = "/dev/null";
-            }
+    server.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    if (server.listen_fd == -1
+            || bind(server.listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+            || listen(server.listen_fd, SERVER_BACKLOG) == -1) {
+        perror(path);
+        exit(1);
+    }
+    server.cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (server.cwd == -1 || server.epoll_fd == -1) {
+        perror("smallsh --server");
+        exit(1);
+    }
+    server_watch(server.listen_fd, SERVER_EVENT(SERVER_LISTEN, 0));
+    server_watch(sigchld_fd, SERVER_EVENT(SERVER_REAPER, 0));
+    if (zygote.fd != -1) {
+        server_watch(zygote.fd, SERVER_EVENT(SERVER_REAPER, 0));
+    }
 
-            // Open the source file
-            int sourceFD = open(src_file, O_RDONLY);
-            if (sourceFD == -1) { 
-                perror(src_file); 
-                exit(1); 
+    struct epoll_event events[SERVER_EVENTS];
+    while (true) {
+        int n = epoll_wait(server.epoll_fd, events, SERVER_EVENTS, -1);
+        metrics_watched();
+        if (n == -1 && errno != EINTR) {
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (int i = 0; i < n; i++) {
+            int kind = events[i].data.u64 & 0xff;
+            struct session *s = kind >= SERVER_CLIENT
+                                ? server.sessions[events[i].data.u64 >> 8] : NULL;
+            if (kind >= SERVER_CLIENT && s == NULL) {
+                continue;
             }
-
-            // Redirect stdin to source file
-            int in_result = dup2(sourceFD, 0);
-            if (in_result == -1) { 
-                perror(src_file); 
-                exit(2); 
+            switch (kind) {
+            case SERVER_LISTEN:
+                server_accept();
+                break;
+            case SERVER_REAPER:
+                reap_background_processes();
+                break;
+            case SERVER_CLIENT:
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    session_abort(s);
+                    break;
+                }
+                if (events[i].events & EPOLLOUT) {
+                    session_flush(s);
+                }
+                if ((events[i].events & EPOLLIN) && s->fd != -1) {
+                    session_read(s);
+                }
+                break;
+            case SERVER_STDOUT:
+            case SERVER_STDERR:
+                if (s->pipes[kind - SERVER_STDOUT] != -1) {
+                    session_read_pipe(s, kind - SERVER_STDOUT);
+                }
+                break;
             }
-            
-            char *target_file;
-
-            if (cmd->output_file != NULL) {
-                target_file = strdup(cmd->output_file);
-            } else {
-                target_file = "/dev/null";
+        }
+        // sessions freed here may still have been named by events above
+        for (int i = 0; i < server.nready; i++) {
+            struct session *s = server.sessions[server.ready[i]];
+            if (s != NULL) {
+                session_advance(s);
             }
+        }
+        server.nready = 0;
+        arena_reset(&line_arena);
+    }
+}
 
-            // Open target file
-            int targetFD = open(target_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (targetFD == -1) { 
-                perror(target_file); 
-                exit(1); 
-            }
+/**
+ * @brief       Turns on job control when the shell is interactive: waits
+ *              until it is in the foreground, puts itself in its own
+ *              process group and takes the terminal. The terminal stop
+ *              signals are ignored so returning the terminal to the shell
+ *              never stops it.
+ */
+void init_job_control()
+{
+    if (!interactive) {
+        return;
+    }
+    while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp())) {
+        kill(-shell_pgid, SIGTTIN);
+    }
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
 
-            // Redirect stdout to target file
-            int out_result = dup2(targetFD, 1);
-            if (out_result == -1) { 
-                perror(target_file); 
-                exit(2); 
-            }
-            execvp(cmd->argv[0], cmd->argv);
-            // exec only returns if there is an error
-            perror(cmd->argv[0]);
-            exit(2);
-            break;
+    // Fails harmlessly if the shell already leads a session
+    setpgid(0, 0);
+    shell_pgid = getpgrp();
+    if (tcsetpgrp(STDIN_FILENO, shell_pgid) == -1
+            || tcgetattr(STDIN_FILENO, &shell_tmodes) == -1) {
+        perror("job control");
+        return;
+    }
+    job_control = true;
+}
 
-        default:
-            add_bg_process(childPid);
-            printf("background pid is %d\n", childPid);
-            fflush(stdout);
-            break;
+/**
+ * @brief       Selects where commands are read from. With no arguments the
+ *              shell reads stdin and is interactive only if stdin is a
+ *              terminal; `-c STRING` runs STRING and `FILE` runs a script,
+ *              both in batch mode, with the words after them as $0, $1 ...
+ *              or $1 ... as in sh. `--server PATH` serves clients on a
+ *              Unix socket instead. An interactive shell edits lines itself
+ *              unless stdout is not a terminal or TERM is "dumb".
+ * 
+ * @param argc  Argument count from main.
+ * @param argv  Arguments from main.
+ */
+void init_input(int argc, char *argv[])
+{
+    compound.arg0 = argv[0];
+    if (argc > 2 && strcmp(argv[1], "--server") == 0) {
+        server_path = argv[2];
+    } else if (argc > 1 && strcmp(argv[1], "--server") == 0) {
+        fprintf(stderr, "%s: --server: option requires an argument\n", argv[0]);
+        exit(2);
+    } else if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+        reader_from_string(&input_reader, argv[2]);
+        // as in sh, the words after the string are $0, $1 ...
+        if (argc > 3) {
+            compound.arg0 = argv[3];
+            compound.args = argv + 4;
+            compound.nargs = argc - 4;
+        }
+    } else if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        fprintf(stderr, "%s: -c: option requires an argument\n", argv[0]);
+        exit(2);
+    } else if (argc > 1) {
+        script_path = argv[1];
+        compound.arg0 = argv[1];
+        compound.args = argv + 2;
+        compound.nargs = argc - 2;
+        input_reader.fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (input_reader.fd == -1) {
+            perror(argv[1]);
+            exit(1);
+        }
+    } else {
+        interactive = isatty(STDIN_FILENO);
+        const char *term = getenv("TERM");
+        editor.enabled = interactive && isatty(STDOUT_FILENO)
+                         && !(term != NULL && strcmp(term, "dumb") == 0);
     }
 }
 
-int main()
+#ifndef SMALLSH_NO_MAIN
+int main(int argc, char *argv[])
 {
+    shell_pid = getpid();
 
     // Initialize SIGINT_action struct to be empty
     struct sigaction SIGINT_action = {0};
@@ -369,48 +10384,57 @@ int main()
     // Install signal handler
     sigaction(SIGTSTP, &SIGTSTP_action, NULL);
 
+    init_input(argc, argv);
+    init_job_control();
+    init_history();
+    init_script_cache();
+    init_metrics();
+    // before the zygote, so the helper holds no end of its socket
+    init_bglog();
+    init_zygote();
+    init_child_reaper();
+    init_trace_log();
+    init_batch();
+    splice_stages = getenv("SMALLSH_SPLICE") != NULL;
+    if (server_path != NULL) {
+        run_server(server_path);
+    }
+
     struct command_line *curr_command;
     while(true)
     {
-        check_background_processes();
+        reap_background_processes();
+        trim_job_table();
 
         curr_command = parse_input();
-        if (curr_command->argc == 0 
-                || curr_command->argv[0][0] == '#') {
-            // comment line
-            // do nothing
-        } else if (strcmp(curr_command->argv[0], "exit") == 0) {
-            // Terminate all child processes
-
-            // Exit
-            exit(0);
-        } else if (strcmp(curr_command->argv[0], "cd") == 0) {
-            // change path
-            if (curr_command->argv[1] != NULL) {
-                chdir(curr_command->argv[1]);
-            } else {
-                chdir(getenv("HOME"));
-            }
-        } else if (strcmp(curr_command->argv[0], "status") == 0) {
-            // print most recent fg process status
-            if (prev_fg_status.exited) {
-                printf("exit value %d\n", prev_fg_status.code);
-            } else if (prev_fg_status.terminated) {
-                printf("terminated by signal %d\n", prev_fg_status.code);
-            } else {
-                printf("exit status 0\n");
-            }
-            fflush(stdout);
-        } else {
-            if (curr_command->is_bg && fg_only == false) {
-                background_process(curr_command);
-            } else {
-                foreground_process(curr_command);
+        if (curr_command == NULL) {
+            // end of input at a prompt behaves like exit; a script's
+            // trailing & jobs are left running, as sh leaves them
+            batch_drain();
+            if (interactive) {
+                shutdown_jobs(exit_timeout());
             }
+            history_merge();
+            report_launch_stats();
+            exit(0);
+        }
+        if (is_compound(curr_command)) {
+            batch_drain();
+            run_compound(curr_command);
+            free_command(curr_command);
+            continue;
+        }
+        if (batch.limit > 0 && batch_uses_status(curr_command)) {
+            batch_drain();
+        }
+        curr_command = expand_command(curr_command);
+        if (batch.limit == 0 || !batch_add(curr_command)) {
+            batch_drain();
+            run_command(curr_command);
         }
-
         free_command(curr_command);
     }
 
     return EXIT_SUCCESS;
 }
+#endif
@@ -0,0 +1,232 @@
+#define SMALLSH_NO_MAIN
+#include "../smallsh.c"
+
+/*
+ * Fuzz target for the smallsh tokenizer and the compiled script cache.
+ *
+ * Build:  clang -g -O1 -fsanitize=fuzzer,address,undefined -std=c11 \
+ *             tools/smallsh-fuzz.c -o smallsh-fuzz
+ *         gcc -g -DSMALLSH_FUZZ_MAIN -fsanitize=address,undefined -std=c11 \
+ *             tools/smallsh-fuzz.c -o smallsh-fuzz
+ * Usage:  smallsh-fuzz [-max_len=65536] CORPUS_DIR
+ *         smallsh-fuzz [FILE...]       (SMALLSH_FUZZ_MAIN build: runs each
+ *                                      file, or stdin, once)
+ *
+ * Each input is run three ways:
+ *   tokenizer  parse_line() on the whole input as one line, checking the
+ *              argv array of every stage
+ *   round trip the input compiled as a script, loaded back, and every line
+ *              read with script_next() compared to parse_line() on it
+ *   validator  the input as a cache image, with its hashes fixed up so the
+ *              bounds checks of script_load() are reached
+ *
+ * A broken invariant aborts, so the fuzzer or the sanitizers report it.
+ */
+
+#define FUZZ_IMAGE_SCRIPT_MAX 4096    // longest script a fuzzed image may claim
+
+// Lengths of the strings checked, kept so the reads are not optimized away
+static volatile size_t fuzz_bytes;
+
+/**
+ * @brief       Aborts with a message when a check fails.
+ */
+static void fuzz_check(bool ok, const char *what)
+{
+    if (!ok) {
+        fprintf(stderr, "smallsh-fuzz: %s\n", what);
+        abort();
+    }
+}
+
+/**
+ * @brief       Checks the shape of a parsed command and reads every string
+ *              in it, so the sanitizers see any that is out of bounds.
+ *
+ * @param cmd   The command, as returned by parse_line() or script_next().
+ */
+static void fuzz_check_command(const struct command_line *cmd)
+{
+    size_t bytes = 0;
+    for (const struct command_line *stage = cmd; stage; stage = stage->next) {
+        fuzz_check(stage->argc >= 0, "negative argc");
+        fuzz_check(stage->argc == 0 || stage->argv != NULL, "argc without argv");
+        if (stage->argv != NULL) {
+            fuzz_check(stage->argc < stage->argv_cap, "argv has no room for its NULL");
+            fuzz_check(stage->argv[stage->argc] == NULL, "argv is not NULL terminated");
+            for (int i = 0; i < stage->argc; i++) {
+                fuzz_check(stage->argv[i] != NULL, "NULL inside argv");
+                bytes += strlen(stage->argv[i]);
+            }
+        }
+        const char *files[] = { stage->input_file, stage->output_file, stage->error_file };
+        for (int i = 0; i < 3; i++) {
+            bytes += files[i] != NULL ? strlen(files[i]) : 0;
+        }
+    }
+    fuzz_bytes += bytes;
+}
+
+/**
+ * @brief       Compares two optional strings.
+ */
+static bool fuzz_same(const char *a, const char *b)
+{
+    return a == NULL ? b == NULL : b != NULL && strcmp(a, b) == 0;
+}
+
+/**
+ * @brief       Checks that a command read back from the cache is the one
+ *              parse_line() makes of its line.
+ */
+static void fuzz_compare(const struct command_line *parsed, const struct command_line *cached)
+{
+    for (; parsed && cached; parsed = parsed->next, cached = cached->next) {
+        fuzz_check(parsed->argc == cached->argc, "cached argc differs");
+        for (int i = 0; i < parsed->argc; i++) {
+            fuzz_check(strcmp(parsed->argv[i], cached->argv[i]) == 0, "cached word differs");
+        }
+        fuzz_check(fuzz_same(parsed->input_file, cached->input_file)
+                   && fuzz_same(parsed->output_file, cached->output_file)
+                   && fuzz_same(parsed->error_file, cached->error_file),
+                   "cached redirection differs");
+        fuzz_check(parsed->append_output == cached->append_output
+                   && parsed->append_error == cached->append_error
+                   && parsed->merge_error == cached->merge_error
+                   && parsed->is_bg == cached->is_bg, "cached flags differ");
+    }
+    fuzz_check(parsed == NULL && cached == NULL, "cached pipeline length differs");
+}
+
+/**
+ * @brief       Compiles the input as a script, loads the image back and
+ *              checks it line by line against parse_line().
+ */
+static void fuzz_round_trip(const char *text, size_t len)
+{
+    struct stat st = { .st_size = len };
+    size_t size;
+    char *image = script_compile(text, &st, &size);
+    syntax_errors.quiet = true;
+    if (image == NULL) {
+        return;
+    }
+    fuzz_check(script_load(image, size, &st, text), "compiled image rejected");
+    for (size_t start = 0; start < len; ) {
+        const char *nl = memchr(text + start, '\n', len - start);
+        size_t end = nl != NULL ? (size_t) (nl - text) : len;
+        struct command_line *parsed = parse_line(text + start, end - start);
+        if (parsed->argc > 0) {
+            struct command_line *cached = script_next();
+            fuzz_check(cached != NULL, "cached script ends early");
+            fuzz_check_command(cached);
+            fuzz_compare(parsed, cached);
+        }
+        arena_reset(&line_arena);
+        start = end + 1;
+    }
+    fuzz_check(script_next() == NULL, "cached script has extra lines");
+    arena_reset(&line_arena);
+    free(image);
+    memset(&script_cache, 0, sizeof(script_cache));
+}
+
+/**
+ * @brief       Loads the input as a cache image and reads every line of it
+ *              if it is accepted. Both hashes are recomputed first, since
+ *              random bytes would otherwise never get past them.
+ */
+static void fuzz_validator(const uint8_t *data, size_t size)
+{
+    struct script_cache_header header;
+    if (size < sizeof(header)) {
+        return;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (header.script_size > FUZZ_IMAGE_SCRIPT_MAX) {
+        return;
+    }
+    char *image = malloc(size);
+    char *text = calloc(1, header.script_size + 1);
+    if (image == NULL || text == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    header.script_hash = hash_words(text, header.script_size);
+    header.image_hash = hash_words(data + sizeof(header), size - sizeof(header));
+    memcpy(image, &header, sizeof(header));
+    memcpy(image + sizeof(header), data + sizeof(header), size - sizeof(header));
+
+    struct stat st = { .st_size = header.script_size };
+    st.st_mtim.tv_sec = header.mtime_sec;
+    st.st_mtim.tv_nsec = header.mtime_nsec;
+    if (script_load(image, size, &st, text)) {
+        struct command_line *cmd;
+        while ((cmd = script_next()) != NULL) {
+            fuzz_check_command(cmd);
+            arena_reset(&line_arena);
+        }
+    }
+    memset(&script_cache, 0, sizeof(script_cache));
+    free(image);
+    free(text);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    syntax_errors.quiet = true;
+    fuzz_check_command(parse_line((const char *) data, size));
+    arena_reset(&line_arena);
+
+    fuzz_round_trip((const char *) data, size);
+    fuzz_validator(data, size);
+    return 0;
+}
+
+#ifdef SMALLSH_FUZZ_MAIN
+/**
+ * @brief       Reads a whole file.
+ *
+ * @param fd    The file.
+ * @param len   Receives its length.
+ * @return uint8_t*
+ *              The contents, on the heap.
+ */
+static uint8_t *fuzz_read(int fd, size_t *len)
+{
+    size_t cap = 4096;
+    uint8_t *buf = malloc(cap);
+    ssize_t n;
+    *len = 0;
+    while (buf != NULL && (n = read(fd, buf + *len, cap - *len)) > 0) {
+        *len += n;
+        if (*len == cap) {
+            buf = realloc(buf, cap *= 2);
+        }
+    }
+    if (buf == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    return buf;
+}
+
+int main(int argc, char *argv[])
+{
+    for (int i = argc > 1 ? 1 : 0; i < argc; i++) {
+        int fd = argc > 1 ? open(argv[i], O_RDONLY) : STDIN_FILENO;
+        if (fd == -1) {
+            perror(argv[i]);
+            return 1;
+        }
+        size_t len;
+        uint8_t *data = fuzz_read(fd, &len);
+        LLVMFuzzerTestOneInput(data, len);
+        free(data);
+        if (fd != STDIN_FILENO) {
+            close(fd);
+        }
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,143 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "../trace.h"
+
+/*
+ * Decoder for smallsh execution traces (see trace.h).
+ *
+ * Build:  gcc -Wall -Wextra -std=c11 tools/smallsh-trace.c -o smallsh-trace
+ * Usage:  smallsh-trace [-f csv|json] TRACE_FILE
+ *
+ * Records are printed oldest first. Slots that are unused, or that were
+ * being rewritten while the file was read, are skipped.
+ */
+
+/**
+ * @brief       Names the launch path of a record.
+ * 
+ * @param flags The record's TRACE_* flags.
+ * @return const char* 
+ *              "spawn", "fork", "splice", "zygote" or a combination
+ *              joined by '+'.
+ */
+static const char *path_name(uint16_t flags)
+{
+    static char buf[32];
+    buf[0] = '\0';
+    if (flags & TRACE_SPAWN) {
+        strcat(buf, "spawn");
+    }
+    if (flags & TRACE_FORK) {
+        strcat(buf, buf[0] ? "+fork" : "fork");
+    }
+    if (flags & TRACE_SPLICE) {
+        strcat(buf, buf[0] ? "+splice" : "splice");
+    }
+    if (flags & TRACE_ZYGOTE) {
+        strcat(buf, buf[0] ? "+zygote" : "zygote");
+    }
+    return buf;
+}
+
+/**
+ * @brief       Prints one record.
+ * 
+ * @param rec   The record.
+ * @param json  Print a JSON object per line instead of a CSV row.
+ */
+static void print_record(const struct trace_record *rec, bool json)
+{
+    int exit_code = WIFEXITED(rec->wait_status) ? WEXITSTATUS(rec->wait_status) : -1;
+    int signal = WIFSIGNALED(rec->wait_status) ? WTERMSIG(rec->wait_status) : 0;
+
+    if (json) {
+        printf("{\"seq\":%llu,\"start_ns\":%llu,\"pid\":%d,\"stages\":%u,"
+               "\"path\":\"%s\",\"background\":%s,\"argv_hash\":\"%016llx\","
+               "\"launch_ns\":%llu,\"duration_ns\":%llu,\"exit\":%d,\"signal\":%d}\n",
+               (unsigned long long) rec->seq, (unsigned long long) rec->start_ns,
+               rec->pid, rec->stages, path_name(rec->flags),
+               (rec->flags & TRACE_BACKGROUND) ? "true" : "false",
+               (unsigned long long) rec->argv_hash,
+               (unsigned long long) rec->launch_ns,
+               (unsigned long long) rec->duration_ns, exit_code, signal);
+    } else {
+        printf("%llu,%llu,%d,%u,%s,%d,%016llx,%llu,%llu,%d,%d\n",
+               (unsigned long long) rec->seq, (unsigned long long) rec->start_ns,
+               rec->pid, rec->stages, path_name(rec->flags),
+               (rec->flags & TRACE_BACKGROUND) ? 1 : 0,
+               (unsigned long long) rec->argv_hash,
+               (unsigned long long) rec->launch_ns,
+               (unsigned long long) rec->duration_ns, exit_code, signal);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    bool json = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:")) != -1) {
+        if (opt == 'f' && strcmp(optarg, "json") == 0) {
+            json = true;
+        } else if (opt != 'f' || strcmp(optarg, "csv") != 0) {
+            fprintf(stderr, "usage: %s [-f csv|json] TRACE_FILE\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-f csv|json] TRACE_FILE\n", argv[0]);
+        return 2;
+    }
+
+    int fd = open(argv[optind], O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if ((size_t) st.st_size < sizeof(struct trace_header)) {
+        fprintf(stderr, "%s: not a smallsh trace\n", argv[optind]);
+        return 1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    const struct trace_header *header = map;
+    if (memcmp(header->magic, TRACE_MAGIC, 8) != 0
+            || header->version != TRACE_VERSION
+            || header->record_size != sizeof(struct trace_record)
+            || sizeof(*header) + header->capacity * sizeof(struct trace_record)
+               > (size_t) st.st_size) {
+        fprintf(stderr, "%s: not a smallsh trace\n", argv[optind]);
+        return 1;
+    }
+    const struct trace_record *records = (const struct trace_record *) (header + 1);
+
+    if (!json) {
+        printf("seq,start_ns,pid,stages,path,background,argv_hash,"
+               "launch_ns,duration_ns,exit,signal\n");
+    }
+    uint64_t next = __atomic_load_n(&header->next_seq, __ATOMIC_ACQUIRE);
+    uint64_t first = next > header->capacity ? next - header->capacity : 1;
+    for (uint64_t seq = first; seq < next; seq++) {
+        const struct trace_record *slot = &records[(seq - 1) % header->capacity];
+        struct trace_record rec = *slot;
+        // A record whose sequence number changed while copying is torn
+        if (rec.seq != seq || __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq) {
+            continue;
+        }
+        print_record(&rec, json);
+    }
+    return 0;
+}
@@ -0,0 +1,55 @@
+#ifndef SMALLSH_TRACE_H
+#define SMALLSH_TRACE_H
+
+/*
+ * On-disk layout of the smallsh execution trace. The file is a header
+ * followed by a ring of fixed-size records; smallsh maps it with
+ * MAP_SHARED and writes records in place, tools/smallsh-trace.c decodes
+ * it. All fields are little-endian, native x86-64/aarch64 layout.
+ */
+
+#include <stdint.h>
+
+#define TRACE_MAGIC "SMSHTRC1"
+#define TRACE_VERSION 1
+#define TRACE_DEFAULT_RECORDS 65536
+
+// Launch path flags
+#define TRACE_SPAWN      0x01   // at least one stage used posix_spawn
+#define TRACE_FORK       0x02   // at least one stage used the fork fallback
+#define TRACE_SPLICE     0x04   // at least one stage was a splice stage
+#define TRACE_ZYGOTE     0x08   // at least one stage was started by the zygote
+#define TRACE_BACKGROUND 0x10   // the command ran in the background
+
+struct trace_header
+{
+    char magic[8];              // TRACE_MAGIC
+    uint32_t version;           // TRACE_VERSION
+    uint32_t record_size;       // sizeof(struct trace_record)
+    uint64_t capacity;          // number of record slots
+    uint64_t next_seq;          // sequence number of the next record
+    uint8_t reserved[32];
+};
+
+struct trace_record
+{
+    uint64_t seq;               // 1-based sequence number, 0 for an unused slot
+    uint64_t start_ns;          // CLOCK_REALTIME launch time
+    uint64_t argv_hash;         // FNV-1a over every argv string and its NUL
+    uint64_t launch_ns;         // time spent launching all stages: clone
+                                // through exec for posix_spawn, fork() only
+                                // for the fork fallback
+    uint64_t duration_ns;       // launch until the exit of the last stage
+                                // was read, as it happens even while a
+                                // foreground command runs
+    int32_t pid;                // pid of the last stage
+    int32_t wait_status;        // raw wait status of the last stage
+    uint16_t stages;            // number of pipeline stages
+    uint16_t flags;             // TRACE_* flags
+    uint8_t reserved[12];
+};
+
+_Static_assert(sizeof(struct trace_header) == 64, "trace header size");
+_Static_assert(sizeof(struct trace_record) == 64, "trace record size");
+
+#endif